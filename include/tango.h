@@ -11,11 +11,65 @@ DLLEXPORT void tango_init(const char *config, const char *grid_name,
                 unsigned int gis, unsigned int gie,
                 unsigned int gjs, unsigned int gje);
 
+DLLEXPORT void tango_init_blocks(const char *config, const char *grid_name,
+                                 /* Local domain, lis, lie, ljs, lje for each
+                                  * block. */
+                                 unsigned int num_blocks,
+                                 const unsigned int blocks[],
+                                 /* Global domain */
+                                 unsigned int gis, unsigned int gie,
+                                 unsigned int gjs, unsigned int gje);
+
+DLLEXPORT void tango_add_component(const char *config, const char *grid_name,
+                                   unsigned int num_blocks,
+                                   const unsigned int blocks[],
+                                   unsigned int gis, unsigned int gie,
+                                   unsigned int gjs, unsigned int gje);
+DLLEXPORT void tango_init_components(void);
+DLLEXPORT void tango_set_component(const char *grid_name);
+
+DLLEXPORT void tango_set_mask(const char *grid_name, const int mask[], int size);
+
+DLLEXPORT void tango_redecompose(unsigned int lis, unsigned int lie,
+                                 unsigned int ljs, unsigned int lje);
+DLLEXPORT void tango_redecompose_blocks(unsigned int num_blocks,
+                                        const unsigned int blocks[]);
+
 DLLEXPORT void tango_begin_transfer(const char* timestamp,
                                     const char* grid_name);
+DLLEXPORT void tango_begin_multi_transfer(const char* timestamp);
 DLLEXPORT void tango_put(const char* field_name, double array[], int size);
 DLLEXPORT void tango_get(const char* field_name, double array[], int size);
+DLLEXPORT void tango_put_ensemble(const char* field_name, double array[],
+                                  int size, int num_members);
+DLLEXPORT void tango_accumulate(const char* field_name, double array[],
+                                int size);
+DLLEXPORT void tango_get_ensemble(const char* field_name, double array[],
+                                  int size, int num_members);
+DLLEXPORT void tango_put_to(const char* grid_name, const char* field_name,
+                            double array[], int size);
+DLLEXPORT void tango_get_from(const char* grid_name, const char* field_name,
+                              double array[], int size);
+DLLEXPORT void tango_put_strided(const char* field_name, double array[],
+                                 long offset, long stride_i, long stride_j);
+DLLEXPORT void tango_get_strided(const char* field_name, double array[],
+                                 long offset, long stride_i, long stride_j);
+DLLEXPORT void tango_put_halo(const char* field_name, double array[],
+                              int halo_i, int halo_j);
+DLLEXPORT void tango_get_halo(const char* field_name, double array[],
+                              int halo_i, int halo_j);
+DLLEXPORT void tango_put_halo_column_major(const char* field_name,
+                                           double array[],
+                                           int halo_i, int halo_j);
+DLLEXPORT void tango_get_halo_column_major(const char* field_name,
+                                           double array[],
+                                           int halo_i, int halo_j);
 DLLEXPORT void tango_end_transfer(void);
+DLLEXPORT void tango_progress(void);
+DLLEXPORT void tango_memory_usage(const char *category, long long *current,
+                                  long long *peak);
 DLLEXPORT void tango_finalize(void);
 
+DLLEXPORT void tango_thread_rank_init(int rank, int num_ranks);
+
 #endif /* TANGO_H */
@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+
+#include "accounting.h"
+
+/* Doubles in front of a buffer from new_buffer(), for its size in bytes and
+ * its category. */
+#define BUFFER_HEADER (2)
+
+/* The last of each is the total. */
+static atomic<size_t> current[NUM_MEMORY_CATEGORIES + 1];
+static atomic<size_t> peak[NUM_MEMORY_CATEGORIES + 1];
+
+static const char *category_names[NUM_MEMORY_CATEGORIES + 1] = {
+    "tiles", "mappings", "weights", "send_buffers", "recv_buffers", "total"
+};
+
+static void raise_peak(int category, size_t now)
+{
+    size_t old = peak[category].load(memory_order_relaxed);
+
+    while (now > old &&
+           !peak[category].compare_exchange_weak(old, now,
+                                                 memory_order_relaxed)) {
+    }
+}
+
+void memory_allocated(MemoryCategory category, size_t bytes)
+{
+    raise_peak(category, current[category] += bytes);
+    raise_peak(NUM_MEMORY_CATEGORIES,
+               current[NUM_MEMORY_CATEGORIES] += bytes);
+}
+
+void memory_freed(MemoryCategory category, size_t bytes)
+{
+    current[category] -= bytes;
+    current[NUM_MEMORY_CATEGORIES] -= bytes;
+}
+
+static int clamp_category(int category)
+{
+    if (category < 0 || category > NUM_MEMORY_CATEGORIES) {
+        return NUM_MEMORY_CATEGORIES;
+    }
+    return category;
+}
+
+size_t memory_current(int category)
+{
+    return current[clamp_category(category)];
+}
+
+size_t memory_peak(int category)
+{
+    return peak[clamp_category(category)];
+}
+
+const char *memory_category_name(int category)
+{
+    return category_names[clamp_category(category)];
+}
+
+double *new_buffer(size_t count, MemoryCategory category, bool zero)
+{
+    double *buf;
+    if (zero) {
+        buf = new double[count + BUFFER_HEADER]();
+    } else {
+        buf = new double[count + BUFFER_HEADER];
+    }
+
+    size_t header[BUFFER_HEADER] = {count * sizeof(double),
+                                    (size_t)category};
+    static_assert(sizeof(header) == BUFFER_HEADER * sizeof(double),
+                  "buffer header must be a whole number of doubles");
+    memcpy(buf, header, sizeof(header));
+    memory_allocated(category, count * sizeof(double));
+
+    return buf + BUFFER_HEADER;
+}
+
+size_t buffer_count(const double *buf)
+{
+    size_t header[BUFFER_HEADER];
+    memcpy(header, buf - BUFFER_HEADER, sizeof(header));
+    return header[0] / sizeof(double);
+}
+
+void delete_buffer(double *buf)
+{
+    if (buf == nullptr) {
+        return;
+    }
+
+    size_t header[BUFFER_HEADER];
+    buf -= BUFFER_HEADER;
+    memcpy(header, buf, sizeof(header));
+    assert(header[1] < NUM_MEMORY_CATEGORIES);
+    memory_freed((MemoryCategory)header[1], header[0]);
+
+    delete[] buf;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+/* What Tango's memory is used for, see memory_current() and
+ * tango_memory_usage(). */
+enum MemoryCategory {
+    /* The points of the local and remote tiles. */
+    MEMORY_TILES,
+    /* The links and weights of each mapping, and the last message for XOR
+     * compression. */
+    MEMORY_MAPPINGS,
+    /* Weights read from the remapping files, while the routing is built or
+     * if they are cached. */
+    MEMORY_WEIGHTS,
+    /* Packed messages until their send completes. */
+    MEMORY_SEND_BUFFERS,
+    /* Received messages until they have been unpacked. */
+    MEMORY_RECV_BUFFERS,
+    NUM_MEMORY_CATEGORIES
+};
+
+/* The counts are for the whole process, so when threads act as ranks they
+ * cover all of them. */
+void memory_allocated(MemoryCategory category, size_t bytes);
+void memory_freed(MemoryCategory category, size_t bytes);
+
+/* In bytes. Any category from NUM_MEMORY_CATEGORIES on is the total, whose
+ * peak is the most in use at once over all categories. */
+size_t memory_current(int category);
+size_t memory_peak(int category);
+
+/* The name used in tango_memory_usage() and reports, e.g. "tiles". */
+const char *memory_category_name(int category);
+
+/* A standard allocator that counts what it hands out against a category. */
+template <class T, MemoryCategory C>
+class CountingAllocator {
+public:
+    typedef T value_type;
+    template <class U> struct rebind { typedef CountingAllocator<U, C> other; };
+
+    CountingAllocator() {}
+    template <class U>
+    CountingAllocator(const CountingAllocator<U, C>&) {}
+
+    T *allocate(size_t n)
+        {
+            T *p = allocator<T>().allocate(n);
+            memory_allocated(C, n * sizeof(T));
+            return p;
+        }
+    void deallocate(T *p, size_t n)
+        {
+            memory_freed(C, n * sizeof(T));
+            allocator<T>().deallocate(p, n);
+        }
+};
+
+template <class T, class U, MemoryCategory C>
+bool operator==(const CountingAllocator<T, C>&, const CountingAllocator<U, C>&)
+{
+    return true;
+}
+
+template <class T, class U, MemoryCategory C>
+bool operator!=(const CountingAllocator<T, C>&, const CountingAllocator<U, C>&)
+{
+    return false;
+}
+
+template <class T, MemoryCategory C>
+using counted_vector = vector<T, CountingAllocator<T, C> >;
+
+/* Message buffers of count doubles. The size and category are kept in front
+ * of the buffer so that it can be freed, by delete_buffer(), wherever it
+ * ends up. */
+double *new_buffer(size_t count, MemoryCategory category, bool zero = false);
+void delete_buffer(double *buf);
+/* Number of doubles in a buffer from new_buffer(). */
+size_t buffer_count(const double *buf);
@@ -0,0 +1,279 @@
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <mpi.h>
+
+#include "compression.h"
+
+static inline uint64_t to_bits(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static inline double from_bits(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline unsigned int leading_zero_bytes(uint64_t word)
+{
+    unsigned int n = 0;
+
+    while (n < 8 && (word >> (56 - (8 * n))) == 0) {
+        n++;
+    }
+    return n;
+}
+
+size_t xor_compress_bound(unsigned int count)
+{
+    return ((count + 1) / 2) + (count * sizeof(double));
+}
+
+size_t xor_compress(const double *data, unsigned int count,
+                    XorHistory& history, unsigned char *out)
+{
+    if (history.size() != count) {
+        history.assign(count, 0.0);
+    }
+
+    unsigned char *headers = out;
+    unsigned char *payload = out + ((count + 1) / 2);
+    memset(headers, 0, (count + 1) / 2);
+
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t word = to_bits(data[i]) ^ to_bits(history[i]);
+        unsigned int zeros = leading_zero_bytes(word);
+
+        headers[i / 2] |= zeros << (4 * (i % 2));
+        for (unsigned int b = 0; b < 8 - zeros; b++) {
+            *payload++ = (word >> (8 * b)) & 0xff;
+        }
+        history[i] = data[i];
+    }
+
+    return payload - out;
+}
+
+void xor_decompress(const unsigned char *in, size_t size, unsigned int count,
+                    XorHistory& history, double *data)
+{
+    const unsigned char *headers = in;
+    size_t header_size = (count + 1) / 2;
+    size_t expected = header_size;
+    bool ok = (size >= header_size);
+
+    /* Check the size before reading anything. */
+    for (unsigned int i = 0; ok && i < count; i++) {
+        unsigned int zeros = (headers[i / 2] >> (4 * (i % 2))) & 0xf;
+        ok = (zeros <= 8);
+        expected += 8 - zeros;
+    }
+    if (!ok || size != expected) {
+        cerr << "Error: bad compressed message of " << size << " bytes for "
+             << count << " values." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (history.size() != count) {
+        history.assign(count, 0.0);
+    }
+
+    const unsigned char *payload = in + header_size;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int zeros = (headers[i / 2] >> (4 * (i % 2))) & 0xf;
+        uint64_t word = 0;
+
+        for (unsigned int b = 0; b < 8 - zeros; b++) {
+            word |= (uint64_t)(*payload++) << (8 * b);
+        }
+        data[i] = from_bits(word ^ to_bits(history[i]));
+        history[i] = data[i];
+    }
+}
+
+static const unsigned int block_size = 64;
+
+enum { stored_raw = 0, stored_quantized = 1 };
+
+/* Map signed to unsigned so that small magnitudes have few bits. */
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned int bit_width(uint64_t v)
+{
+    return (v == 0) ? 0 : 64 - __builtin_clzll(v);
+}
+
+size_t quantize_compress_bound(unsigned int count)
+{
+    unsigned int num_blocks = (count + block_size - 1) / block_size;
+
+    return 1 + sizeof(double) + num_blocks + (count * sizeof(double));
+}
+
+static size_t store_raw(const double *data, unsigned int count,
+                        unsigned char *out)
+{
+    out[0] = stored_raw;
+    memcpy(out + 1, data, count * sizeof(double));
+    return 1 + (count * sizeof(double));
+}
+
+size_t quantize_compress(const double *data, unsigned int count,
+                         double tolerance, double relative_tolerance,
+                         unsigned char *out)
+{
+    double max_abs = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        max_abs = max(max_abs, fabs(data[i]));
+    }
+    if (!isfinite(max_abs)) {
+        return store_raw(data, count, out);
+    }
+
+    double error = tolerance;
+    if (relative_tolerance > 0 && max_abs > 0) {
+        double rel_error = relative_tolerance * max_abs;
+        error = (error > 0) ? min(error, rel_error) : rel_error;
+    }
+
+    /* Leave a little room for rounding when values are converted back, this
+     * is tiny as long as the quantized values are well within double
+     * precision. Otherwise the error is too small to bother. */
+    double quantum = 1.998 * error;
+    if (quantum <= 0 || (max_abs / quantum) > 1e12) {
+        return store_raw(data, count, out);
+    }
+
+    out[0] = stored_quantized;
+    memcpy(out + 1, &quantum, sizeof(quantum));
+    unsigned char *p = out + 1 + sizeof(quantum);
+
+    double inv_quantum = 1.0 / quantum;
+    int64_t prev = 0;
+    uint64_t codes[block_size];
+
+    for (unsigned int start = 0; start < count; start += block_size) {
+        unsigned int n = min(block_size, count - start);
+        uint64_t all = 0;
+
+        for (unsigned int i = 0; i < n; i++) {
+            int64_t q = llround(data[start + i] * inv_quantum);
+            codes[i] = zigzag(q - prev);
+            prev = q;
+            all |= codes[i];
+        }
+
+        unsigned int width = bit_width(all);
+        *p++ = width;
+
+        /* Pack n values of width bits, least significant bits first. */
+        uint64_t acc = 0;
+        unsigned int acc_bits = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            acc |= codes[i] << acc_bits;
+            unsigned int used = min(width, 64 - acc_bits);
+            acc_bits += used;
+            if (acc_bits == 64) {
+                memcpy(p, &acc, sizeof(acc));
+                p += sizeof(acc);
+                acc = (used < width) ? (codes[i] >> used) : 0;
+                acc_bits = width - used;
+            }
+        }
+        unsigned int tail = (acc_bits + 7) / 8;
+        memcpy(p, &acc, tail);
+        p += tail;
+    }
+
+    /* Not worth it. */
+    if ((size_t)(p - out) > 1 + (count * sizeof(double))) {
+        return store_raw(data, count, out);
+    }
+
+    return p - out;
+}
+
+static void bad_message(size_t size, unsigned int count)
+{
+    cerr << "Error: bad compressed message of " << size << " bytes for "
+         << count << " values." << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+size_t quantize_decompress(const unsigned char *in, size_t size,
+                           unsigned int count, double *data)
+{
+    if (size < 1) {
+        bad_message(size, count);
+    }
+
+    if (in[0] == stored_raw) {
+        if (size < 1 + (count * sizeof(double))) {
+            bad_message(size, count);
+        }
+        memcpy(data, in + 1, count * sizeof(double));
+        return 1 + (count * sizeof(double));
+    }
+
+    double quantum;
+    if (in[0] != stored_quantized || size < 1 + sizeof(quantum)) {
+        bad_message(size, count);
+    }
+    memcpy(&quantum, in + 1, sizeof(quantum));
+
+    const unsigned char *p = in + 1 + sizeof(quantum);
+    const unsigned char *end = in + size;
+    int64_t prev = 0;
+
+    for (unsigned int start = 0; start < count; start += block_size) {
+        unsigned int n = min(block_size, count - start);
+
+        if (p >= end || *p > 64) {
+            bad_message(size, count);
+        }
+        unsigned int width = *p++;
+        size_t bytes = ((n * width) + 7) / 8;
+        if ((size_t)(end - p) < bytes) {
+            bad_message(size, count);
+        }
+
+        uint64_t mask = (width == 64) ? ~0ULL : ((1ULL << width) - 1);
+        size_t bit = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            /* Gather the bytes that hold this value, at most 9. */
+            uint64_t code = 0;
+            size_t first = bit / 8, shift = bit % 8;
+            size_t last = (bit + width + 7) / 8;
+            for (size_t b = first; b < last && b < first + 8; b++) {
+                code |= (uint64_t)p[b] << (8 * (b - first));
+            }
+            code >>= shift;
+            if (shift != 0 && last > first + 8) {
+                code |= (uint64_t)p[first + 8] << (64 - shift);
+            }
+
+            prev += unzigzag(code & mask);
+            data[start + i] = prev * quantum;
+            bit += width;
+        }
+        p += bytes;
+    }
+
+    return p - in;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include "accounting.h"
+
+using namespace std;
+
+/* Lossless compression of coupling messages. Each value is XORed with the
+ * value in the same position of the previous message, for slowly varying
+ * fields this leaves mostly zero high order bytes. The leading zero bytes of
+ * each 64 bit word are then dropped.
+ *
+ * The format is a 4 bit count of leading zero bytes for each word, two to a
+ * byte, followed by the remaining bytes of each word, least significant
+ * first. */
+
+/* The previous message of a mapping, kept as long as the mapping. */
+typedef counted_vector<double, MEMORY_MAPPINGS> XorHistory;
+
+/* Upper bound on the compressed size, in bytes, of count doubles. */
+size_t xor_compress_bound(unsigned int count);
+
+/* Compress count doubles from data into out, which must hold at least
+ * xor_compress_bound(count) bytes. history holds the previous message, if its
+ * size is not count it is treated as all zeros. Afterwards history holds data.
+ * Returns the number of bytes used. */
+size_t xor_compress(const double *data, unsigned int count,
+                    XorHistory& history, unsigned char *out);
+
+/* The reverse of the above. history must be the same as that given to
+ * xor_compress() and is updated in the same way. */
+void xor_decompress(const unsigned char *in, size_t size, unsigned int count,
+                    XorHistory& history, double *data);
+
+/* Lossy compression to within a given error. Values are rounded to a multiple
+ * of (nearly) twice the error, the differences between neighbouring multiples
+ * are stored in blocks of 64 using the fewest bits that fit the whole block.
+ * Block-wise fixed widths keep the packing loops simple, for the compiler to
+ * vectorise.
+ *
+ * The quantum is stored at the start so the receiver doesn't need to know the
+ * error. Data that can't be quantized, e.g. because it isn't finite, or a
+ * zero error, is stored as is. */
+
+/* Upper bound on the compressed size, in bytes, of count doubles. */
+size_t quantize_compress_bound(unsigned int count);
+
+/* Compress count doubles from data into out. The absolute error is at most
+ * tolerance or relative_tolerance times the largest magnitude in data,
+ * whichever is smaller, ignoring zeros. Returns the number of bytes used.
+ *
+ * The bound is for each value of this data, i.e. of one message. Where a
+ * receiver adds up values from several messages, e.g. a point fed by k
+ * remote tiles, the errors add up too, to at most k times the bound. */
+size_t quantize_compress(const double *data, unsigned int count,
+                         double tolerance, double relative_tolerance,
+                         unsigned char *out);
+
+/* Decompress count doubles from in, which holds size bytes. Returns the
+ * number of bytes used, so that several can be stored one after the
+ * other. */
+size_t quantize_decompress(const unsigned char *in, size_t size,
+                           unsigned int count, double *data);
@@ -1,14 +1,34 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <unistd.h>
 #include <yaml-cpp/yaml.h>
+#include <algorithm>
 #include <fstream>
 #include <mpi.h>
 #include <netcdf>
 
 using namespace netCDF;
 
+/* Fewest weights sorted by each thread, below this sorting isn't worth
+ * sharing out. */
+#define MIN_SORT_PART (65536)
+
+/* Give up after an error in the config or the weights. Without MPI, e.g.
+ * in tango_regrid, there is nothing to abort so just exit. */
+static void config_error(void)
+{
+    int initialized, finalized;
+
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    if (initialized && !finalized) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    exit(1);
+}
+
 static bool file_exists(string file)
 {
     if (access(file.c_str(), F_OK) == -1) {
@@ -22,14 +42,15 @@ static bool file_exists(string file)
  * fields. */
 void Config::parse_config(void)
 {
-    YAML::Node mappings, fields;
+    YAML::Node root, mappings, fields, mask_files;
 
     string config_file = config_dir + "/config.yaml";
     if (!file_exists(config_file)) {
         cerr << "Error: " << config_file << " does not exist." << endl;
-        MPI_Abort(MPI_COMM_WORLD, 1);
+        config_error();
     }
-    mappings = YAML::LoadFile(config_file)["mappings"];
+    root = YAML::LoadFile(config_file);
+    mappings = root["mappings"];
 
     /* Iterate over mappings. */
     for (size_t i = 0; i < mappings.size(); i++) {
@@ -43,7 +64,7 @@ void Config::parse_config(void)
             cerr << "Mapping with source_grid = " << recv_grid << " and "
                  << " destination_grid = " << send_grid
                  << " occurs more than once." << endl;
-            MPI_Abort(MPI_COMM_WORLD, 1);
+            config_error();
         }
 
         if (local_grid_name == recv_grid) {
@@ -56,9 +77,84 @@ void Config::parse_config(void)
             continue;
         }
 
+        /* Optional lossless compression of the messages, e.g.
+         *     compression: xor
+         * This suits fields that change little between transfers. */
+        if (mappings[i]["compression"]) {
+            string compression = mappings[i]["compression"].as<string>();
+            if (compression != "xor") {
+                cerr << "Error: unknown compression " << compression
+                     << " in mapping from " << recv_grid << " to "
+                     << send_grid << endl;
+                config_error();
+            }
+
+            if (local_grid_name == recv_grid) {
+                compressed_send_grids.insert(send_grid);
+            } else {
+                compressed_recv_grids.insert(recv_grid);
+            }
+        }
+
+        /* Optional lag, with
+         *     lag: 1
+         * the receiver gets the data that was sent at the previous
+         * transfer, so that sender and receiver can run at the same time. */
+        if (mappings[i]["lag"]) {
+            unsigned int lag = mappings[i]["lag"].as<unsigned int>();
+            if (lag > 1) {
+                cerr << "Error: only a lag of 0 or 1 is supported." << endl;
+                config_error();
+            }
+
+            if (lag == 1 && local_grid_name == recv_grid) {
+                lagged_send_grids.insert(send_grid);
+            } else if (lag == 1) {
+                lagged_recv_grids.insert(recv_grid);
+            }
+        }
+
+        /* Optional number of steps over which fields are accumulated
+         * before being sent, see tango_accumulate(), e.g.
+         *     coupling_interval: 4 */
+        if (mappings[i]["coupling_interval"] && local_grid_name == recv_grid) {
+            unsigned int interval =
+                mappings[i]["coupling_interval"].as<unsigned int>();
+            if (interval == 0) {
+                cerr << "Error: coupling_interval must be at least 1." << endl;
+                config_error();
+            }
+            coupling_intervals[send_grid] = interval;
+        }
+
+        /* A field is either just a name or a map with the name and an
+         * error that is acceptable for it, e.g.
+         *     fields: [sst, {name: lw_flux, tolerance: 1e-4}]
+         * tolerance is an absolute error, relative_tolerance is relative to
+         * the largest magnitude in the message, not in the whole field.
+         * Both bound the error of each message. A point that gets
+         * contributions from k remote tiles can be off by up to k times
+         * as much, e.g. along the edges of tiles with conservative
+         * remapping. */
         fields = mappings[i]["fields"];
         for (size_t k = 0; k < fields.size(); k++) {
-            string field_name = fields[k].as<string>();
+            string field_name;
+            string peer_grid = (local_grid_name == recv_grid) ? send_grid
+                                                              : recv_grid;
+
+            if (fields[k].IsMap()) {
+                field_name = fields[k]["name"].as<string>();
+                if (fields[k]["tolerance"]) {
+                    tolerances[peer_grid + ":" + field_name] =
+                        fields[k]["tolerance"].as<double>();
+                }
+                if (fields[k]["relative_tolerance"]) {
+                    relative_tolerances[peer_grid + ":" + field_name] =
+                        fields[k]["relative_tolerance"].as<double>();
+                }
+            } else {
+                field_name = fields[k].as<string>();
+            }
 
             if (local_grid_name == recv_grid) {
                send_grid_to_fields_map[send_grid].push_back(field_name);
@@ -67,11 +163,165 @@ void Config::parse_config(void)
             }
         }
     }
+
+    /* Optional masks section. This maps a grid name to a SCRIP grid file,
+     * e.g. as made by grids/mom2scrip.py, e.g.
+     *     masks:
+     *         ocean: ocean_grid.nc
+     * Only the masks of grids that we are involved with are read. */
+    if (root["masks"]) {
+        mask_files = root["masks"];
+        for (auto it = mask_files.begin(); it != mask_files.end(); ++it) {
+            string grid = it->first.as<string>();
+            if (grid == local_grid_name || is_peer_grid(grid)) {
+                read_mask(grid, config_dir + "/" + it->second.as<string>());
+            }
+        }
+    }
+
+    /* Optional, start a helper thread that completes sends in the
+     * background, waking up every so many microseconds, e.g.
+     *     progress_interval: 100
+     * With MPI this needs MPI_THREAD_MULTIPLE. */
+    if (root["progress_interval"]) {
+        progress_interval = root["progress_interval"].as<unsigned int>();
+    }
+
+    /* Optional, write a summary of who sends how much to whom once the
+     * routing has been worked out, e.g.
+     *     traffic_report: traffic.yaml
+     * The path is relative to the working directory. See
+     * write_traffic_report(). */
+    if (root["traffic_report"]) {
+        traffic_report = root["traffic_report"].as<string>();
+    }
+
+    /* Optional, suggest a placement of ranks on nodes that keeps coupling
+     * traffic within nodes and write it as a rankfile, e.g.
+     *     rank_placement: rankfile
+     *     ranks_per_node: 48
+     * With MPI ranks_per_node defaults to the largest node of the run. See
+     * write_rank_placement(). */
+    if (root["rank_placement"]) {
+        rank_placement = root["rank_placement"].as<string>();
+    }
+    if (root["ranks_per_node"]) {
+        ranks_per_node = root["ranks_per_node"].as<unsigned int>();
+    }
+
+    /* Optional, the messages going between nodes are gathered onto a leader
+     * rank of each component on each node, which sends one message to
+     * each destination node, e.g.
+     *     node_aggregation: true
+     * If ranks_per_node is given it is used to decide which ranks share a
+     * node, they are assumed to be filled in rank order. This needs MPI. */
+    if (root["node_aggregation"]) {
+        node_aggregation = root["node_aggregation"].as<bool>();
+    }
+
+    /* Optional, keep the remapping weights in memory once the routing has
+     * been built so that tango_redecompose() doesn't read them again, e.g.
+     *     cache_weights: true
+     * This costs a copy of the weights to and from every peer grid. */
+    if (root["cache_weights"]) {
+        cache_weights = root["cache_weights"].as<bool>();
+    }
+
+    /* Optional, record a timeline of what each rank spends its time on and
+     * write it as Chrome trace JSON at tango_finalize(), one file per rank
+     * named <trace>.<rank>.json, e.g.
+     *     trace: coupling_trace
+     *     trace_events: 100000
+     * trace_events is how many of the latest events each rank keeps. The
+     * files can be opened with Perfetto or chrome://tracing. */
+    if (root["trace"]) {
+        trace = root["trace"].as<string>();
+    }
+    if (root["trace_events"]) {
+        trace_events = root["trace_events"].as<unsigned int>();
+    }
+
+    /* Optional, write how much memory Tango uses on each rank, by what
+     * it is used for, at tango_finalize(), e.g.
+     *     memory_report: memory.yaml
+     * The path is relative to the working directory. See
+     * write_memory_report() and tango_memory_usage(). */
+    if (root["memory_report"]) {
+        memory_report = root["memory_report"].as<string>();
+    }
+}
+
+/* Read the grid_imask variable from a SCRIP grid file. SCRIP uses zero for
+ * points that do not participate. */
+void Config::read_mask(string grid, string mask_file)
+{
+    if (!file_exists(mask_file)) {
+        cerr << "Error: mask file " << mask_file << " for grid " << grid
+             << " does not exist." << endl;
+        config_error();
+    }
+
+    NcFile grid_file(mask_file, NcFile::read);
+    NcVar imask_var = grid_file.getVar("grid_imask");
+    if (imask_var.isNull()) {
+        cerr << "Error: no grid_imask variable in " << mask_file << endl;
+        config_error();
+    }
+
+    unsigned int size = imask_var.getDim(0).getSize();
+    int *imask = new int[size];
+    imask_var.getVar(imask);
+
+    vector<bool>& mask = masks[grid];
+    mask.resize(size);
+    for (unsigned int i = 0; i < size; i++) {
+        mask[i] = (imask[i] != 0);
+    }
+
+    delete[] imask;
+}
+
+unsigned int Config::get_coupling_interval(string grid) const
+{
+    auto it = coupling_intervals.find(grid);
+    return (it == coupling_intervals.end()) ? 1 : it->second;
+}
+
+/* The acceptable error for a field sent to/received from grid, zero if the
+ * field must be sent exactly. */
+double Config::get_tolerance(string field, string grid) const
+{
+    auto it = tolerances.find(grid + ":" + field);
+    return (it == tolerances.end()) ? 0 : it->second;
+}
+
+double Config::get_relative_tolerance(string field, string grid) const
+{
+    auto it = relative_tolerances.find(grid + ":" + field);
+    return (it == relative_tolerances.end()) ? 0 : it->second;
+}
+
+/* Return the mask for a grid, this is empty if the grid is not masked. */
+const vector<bool>& Config::get_mask(string grid) const
+{
+    static const vector<bool> no_mask;
+
+    auto it = masks.find(grid);
+    if (it == masks.end()) {
+        return no_mask;
+    }
+    return it->second;
 }
 
 bool Config::can_send_field_to_grid(string field, string grid)
 {
-    for (const auto &f : send_grid_to_fields_map[grid]) {
+    /* Don't use [] here, this is called from several threads. */
+    auto it = send_grid_to_fields_map.find(grid);
+    if (it == send_grid_to_fields_map.end()) {
+        return false;
+    }
+
+    for (const auto &f : it->second) {
         if (f == field) {
             return true;
         }
@@ -81,7 +331,13 @@ bool Config::can_send_field_to_grid(string field, string grid)
 
 bool Config::can_recv_field_from_grid(string field, string grid)
 {
-    for (const auto &f : recv_grid_to_fields_map[grid]) {
+    /* Don't use [] here, this is called from several threads. */
+    auto it = recv_grid_to_fields_map.find(grid);
+    if (it == recv_grid_to_fields_map.end()) {
+        return false;
+    }
+
+    for (const auto &f : it->second) {
         if (f == field) {
             return true;
         }
@@ -89,30 +345,57 @@ bool Config::can_recv_field_from_grid(string field, string grid)
     return false;
 }
 
-/* Return the permutation that sorts a vector. */
-vector<unsigned int> sort_permutation(vector<unsigned int> const& vec)
+/* Return the permutation that sorts a vector. Equal elements keep their
+ * order, so the result is the same however many threads there are. Parts
+ * are sorted on each thread and then merged in pairs, also in parallel. */
+template <typename V>
+vector<unsigned int> sort_permutation(V const& vec)
 {
     vector<unsigned int> perm(vec.size());
     iota(perm.begin(), perm.end(), 0);
-    sort(perm.begin(), perm.end(),
-        [&](unsigned int i, unsigned int j){ return vec[i] < vec[j]; });
+    auto before = [&](unsigned int i, unsigned int j)
+        { return vec[i] < vec[j] || (vec[i] == vec[j] && i < j); };
+
+    size_t num_parts = min((size_t)num_init_threads(),
+                           (perm.size() / MIN_SORT_PART) + 1);
+    vector<size_t> bounds(num_parts + 1);
+    for (size_t p = 0; p <= num_parts; p++) {
+        bounds[p] = (perm.size() * p) / num_parts;
+    }
+
+#pragma omp parallel for schedule(static)
+    for (size_t p = 0; p < num_parts; p++) {
+        sort(perm.begin() + bounds[p], perm.begin() + bounds[p + 1], before);
+    }
+    for (size_t width = 1; width < num_parts; width *= 2) {
+#pragma omp parallel for schedule(static)
+        for (size_t p = 0; p < num_parts; p += 2 * width) {
+            if (p + width < num_parts) {
+                size_t end = min(p + (2 * width), num_parts);
+                inplace_merge(perm.begin() + bounds[p],
+                              perm.begin() + bounds[p + width],
+                              perm.begin() + bounds[end], before);
+            }
+        }
+    }
 
     return perm;
 }
 
 /* Apply a permutation to vector. */
-template <typename T>
-void apply_permutation(vector<T>& vec,
-                       vector<unsigned int> const& perm)
+template <typename V>
+void apply_permutation(V& vec, vector<unsigned int> const& perm)
 {
     assert(vec.size() == perm.size());
 
-    vector<T> sorted_vec(perm.size());
+    V sorted_vec(perm.size());
 
-    transform(perm.begin(), perm.end(), sorted_vec.begin(),
-        [&](unsigned int i){ return vec[i]; });
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < perm.size(); i++) {
+        sorted_vec[i] = vec[perm[i]];
+    }
 
-    vec = sorted_vec;
+    vec.swap(sorted_vec);
 }
 
 /* Read some information about the local grid from the remapping file. */
@@ -136,6 +419,14 @@ void Config::read_grid_info(void)
     } else {
         this->local_grid_size = rmp_file.getDim("n_b").getSize();
     }
+
+    const vector<bool>& mask = get_mask(local_grid_name);
+    if (!mask.empty() && mask.size() != this->local_grid_size) {
+        cerr << "Error: mask for grid " << local_grid_name << " has size "
+             << mask.size() << " but grid size is " << this->local_grid_size
+             << endl;
+        config_error();
+    }
 }
 
 /* Read the weights from the remapping weights file.
@@ -145,15 +436,16 @@ void Config::read_grid_info(void)
  * any changes made to src order also need to be made to dest and
  * weights order. */
 void Config::read_weights(string src_grid, string dest_grid,
-                          vector<unsigned int>& src_points,
-                          vector<unsigned int>& dest_points,
-                          vector<double>& weights, bool sort_src) const
+                    counted_vector<unsigned int, MEMORY_WEIGHTS>& src_points,
+                    counted_vector<unsigned int, MEMORY_WEIGHTS>& dest_points,
+                    counted_vector<double, MEMORY_WEIGHTS>& weights,
+                    bool sort_src) const
 {
     string remap_file = config_dir + "/" + src_grid + "_to_" +
                         dest_grid + "_rmp.nc";
     if (!file_exists(remap_file)) {
         cerr << "Error: " << remap_file << " does not exist." << endl;
-        MPI_Abort(MPI_COMM_WORLD, 1);
+        config_error();
     }
 
     /* open the remapping weights file */
@@ -169,17 +461,18 @@ void Config::read_weights(string src_grid, string dest_grid,
     assert(src_size == dest_size);
     assert(dest_size == weights_size);
 
-    unsigned int *src_data = new unsigned int[src_size];
-    unsigned int *dest_data = new unsigned int[dest_size];
-    double *weights_data = new double[weights_size];
+    counted_vector<unsigned int, MEMORY_WEIGHTS> src_data(src_size);
+    counted_vector<unsigned int, MEMORY_WEIGHTS> dest_data(dest_size);
+    counted_vector<double, MEMORY_WEIGHTS> weights_data(weights_size);
 
-    src_var.getVar(src_data);
-    dest_var.getVar(dest_data);
-    weights_var.getVar(weights_data);
+    src_var.getVar(src_data.data());
+    dest_var.getVar(dest_data.data());
+    weights_var.getVar(weights_data.data());
 
-    src_points.insert(src_points.begin(), src_data, src_data + src_size);
-    dest_points.insert(dest_points.begin(), dest_data, dest_data + dest_size);
-    weights.insert(weights.begin(), weights_data, weights_data + weights_size);
+    src_points.insert(src_points.begin(), src_data.begin(), src_data.end());
+    dest_points.insert(dest_points.begin(), dest_data.begin(),
+                       dest_data.end());
+    weights.insert(weights.begin(), weights_data.begin(), weights_data.end());
 
     vector<unsigned int> perm;
     if (sort_src) {
@@ -190,10 +483,6 @@ void Config::read_weights(string src_grid, string dest_grid,
     apply_permutation(src_points, perm);
     apply_permutation(dest_points, perm);
     apply_permutation(weights, perm);
-
-    delete[] src_data;
-    delete[] dest_data;
-    delete[] weights_data;
 }
 
 bool Config::is_peer_grid(string grid) const
@@ -7,8 +7,25 @@
 #include <list>
 #include <vector>
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+#include "accounting.h"
+
 using namespace std;
 
+/* The number of threads that work done at initialisation, e.g. reading the
+ * weights and building the routing, is shared out over. */
+static inline int num_init_threads(void)
+{
+#if defined(_OPENMP)
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
 class Config
 {
 private:
@@ -34,22 +51,100 @@ private:
     /* Read this as: the variables that we receive from each grid. */
     unordered_map<string, list<string> > recv_grid_to_fields_map;
 
+    /* Grids that we send to/receive from with XOR-delta compression, see
+     * compression.h. */
+    unordered_set<string> compressed_send_grids;
+    unordered_set<string> compressed_recv_grids;
+
+    /* Acceptable absolute and relative errors of fields that can be sent
+     * lossy, keyed by "peer_grid:field". */
+    unordered_map<string, double> tolerances;
+    unordered_map<string, double> relative_tolerances;
+
+    /* Grids that we send to/receive from with a lag of one coupling step. */
+    unordered_set<string> lagged_send_grids;
+    unordered_set<string> lagged_recv_grids;
+
+    /* The number of tango_accumulate() steps between sends to a grid. */
+    unordered_map<string, unsigned int> coupling_intervals;
+
+    /* Optional land/sea masks, keyed by grid name. They are global, indexed
+     * by (point - 1) where point is the 1-based index used in the remapping
+     * files. A true entry means the point is active, i.e. it takes part in
+     * coupling. Grids without an entry are not masked. */
+    unordered_map<string, vector<bool> > masks;
+
+    void read_mask(string grid, string mask_file);
+
+    /* How often, in microseconds, a helper thread should drive outstanding
+     * sends. Zero means there is no helper thread. */
+    unsigned int progress_interval;
+
+    /* Where to write a report of the coupling traffic, empty for none. */
+    string traffic_report;
+
+    /* Where to write a suggested placement of ranks on nodes, empty for
+     * none, and how many ranks fit on a node, zero if not given. */
+    string rank_placement;
+    unsigned int ranks_per_node;
+
+    /* Send messages between nodes through a leader rank on each node. */
+    bool node_aggregation;
+
+    /* Keep the remapping weights after the routing has been built. */
+    bool cache_weights;
+
+    /* Prefix of the trace files to write, empty for no tracing, and the
+     * most events kept by each rank. */
+    string trace;
+    unsigned int trace_events;
+
+    /* Where to write a report of Tango's memory use, empty for none. */
+    string memory_report;
+
 public:
     Config(string config_dir, string grid_name)
-        : config_dir(config_dir), local_grid_name(grid_name) {}
+        : config_dir(config_dir), local_grid_name(grid_name),
+          progress_interval(0), ranks_per_node(0),
+          node_aggregation(false), cache_weights(false),
+          trace_events(65536) {}
     void parse_config(void);
     void read_grid_info(void);
     string get_local_grid(void) const { return local_grid_name; }
+    unsigned int get_progress_interval(void) const
+        { return progress_interval; }
+    string get_traffic_report(void) const { return traffic_report; }
+    string get_rank_placement(void) const { return rank_placement; }
+    unsigned int get_ranks_per_node(void) const { return ranks_per_node; }
+    bool is_node_aggregation(void) const { return node_aggregation; }
+    bool is_cache_weights(void) const { return cache_weights; }
+    string get_trace(void) const { return trace; }
+    unsigned int get_trace_events(void) const { return trace_events; }
+    string get_memory_report(void) const { return memory_report; }
     unsigned int get_local_grid_size(void) const { return local_grid_size; }
     string get_grid_info_file(void) const { return grid_info_file; }
     bool can_send_field_to_grid(string field, string grid);
     bool can_recv_field_from_grid(string field, string grid);
+    bool is_send_compressed(string grid) const
+        { return compressed_send_grids.count(grid) != 0; }
+    bool is_recv_compressed(string grid) const
+        { return compressed_recv_grids.count(grid) != 0; }
+    unsigned int get_coupling_interval(string grid) const;
+    bool is_send_lagged(string grid) const
+        { return lagged_send_grids.count(grid) != 0; }
+    bool is_recv_lagged(string grid) const
+        { return lagged_recv_grids.count(grid) != 0; }
+    double get_tolerance(string field, string grid) const;
+    double get_relative_tolerance(string field, string grid) const;
     void read_weights(string src_grid, string dest_grid,
-                       vector<unsigned int>& src_points,
-                       vector<unsigned int>& dest_points,
-                       vector<double>& weights, bool sort_src) const;
+                      counted_vector<unsigned int, MEMORY_WEIGHTS>& src_points,
+                      counted_vector<unsigned int, MEMORY_WEIGHTS>& dest_points,
+                      counted_vector<double, MEMORY_WEIGHTS>& weights,
+                      bool sort_src) const;
     const unordered_set<string>& get_send_grids(void) const { return send_grids; }
     const unordered_set<string>& get_recv_grids(void) const { return recv_grids; }
+    void set_mask(string grid, const vector<bool>& mask) { masks[grid] = mask; }
+    const vector<bool>& get_mask(string grid) const;
     bool is_peer_grid(string grid) const;
     bool is_send_grid(string grid) const;
     bool is_recv_grid(string grid) const;
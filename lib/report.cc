@@ -0,0 +1,578 @@
+#include <assert.h>
+#include <limits.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "accounting.h"
+#include "report.h"
+
+/* A rank carrying more than this many times the mean traffic is flagged. */
+#define IMBALANCE_THRESHOLD (2.0)
+
+/* Flag the decomposition if fewer than this fraction of the ranks that
+ * couple carry half the traffic. */
+#define CONCENTRATION_THRESHOLD (0.25)
+
+/* One message of a single field, see Router::get_traffic(). */
+class Message {
+public:
+    int src_rank;
+    int dest_rank;
+    unsigned int points;
+    unsigned int links;
+};
+
+/* Traffic of a single rank. */
+class RankTraffic {
+public:
+    set<int> peers;
+    unsigned long send_bytes;
+    unsigned long recv_bytes;
+    /* Weights applied when sending, i.e. the cost of the remapping. */
+    unsigned long links;
+    RankTraffic() : send_bytes(0), recv_bytes(0), links(0) {}
+    unsigned long bytes(void) const { return send_bytes + recv_bytes; }
+};
+
+static unsigned long message_bytes(const Message& m)
+{
+    return (unsigned long)m.points * sizeof(double);
+}
+
+/* Add up the traffic of each rank. Messages within a rank don't go through
+ * the transport so they don't count. */
+static void add_traffic(const vector<Message>& messages,
+                        map<int, RankTraffic>& ranks)
+{
+    for (const auto& m : messages) {
+        ranks[m.src_rank].links += m.links;
+        if (m.src_rank == m.dest_rank) {
+            continue;
+        }
+        ranks[m.src_rank].peers.insert(m.dest_rank);
+        ranks[m.src_rank].send_bytes += message_bytes(m);
+        ranks[m.dest_rank].peers.insert(m.src_rank);
+        ranks[m.dest_rank].recv_bytes += message_bytes(m);
+    }
+}
+
+static void write_stats(ofstream& out, const string& indent,
+                        const string& name, const vector<double>& values)
+{
+    double max = 0, total = 0;
+
+    for (auto v : values) {
+        max = std::max(max, v);
+        total += v;
+    }
+    double mean = values.empty() ? 0 : total / values.size();
+
+    out << indent << name << ": {max: " << max << ", mean: " << mean;
+    if (mean > 0) {
+        out << ", imbalance: " << max / mean;
+    }
+    out << "}" << endl;
+}
+
+/* Write the per rank statistics and return any warnings about them. */
+static list<string> write_rank_stats(ofstream& out, const string& indent,
+                                     const map<int, RankTraffic>& ranks)
+{
+    vector<double> peers, send_bytes, recv_bytes, bytes, links;
+    vector<pair<unsigned long, int> > by_bytes;
+    unsigned long total = 0;
+    list<string> warnings;
+
+    for (const auto& kv : ranks) {
+        const RankTraffic& r = kv.second;
+        peers.push_back(r.peers.size());
+        send_bytes.push_back(r.send_bytes);
+        recv_bytes.push_back(r.recv_bytes);
+        bytes.push_back(r.bytes());
+        links.push_back(r.links);
+        by_bytes.push_back(make_pair(r.bytes(), kv.first));
+        total += r.bytes();
+    }
+
+    out << indent << "ranks: " << ranks.size() << endl;
+    write_stats(out, indent, "peers_per_rank", peers);
+    write_stats(out, indent, "send_bytes_per_rank", send_bytes);
+    write_stats(out, indent, "recv_bytes_per_rank", recv_bytes);
+    write_stats(out, indent, "links_per_rank", links);
+
+    if (total == 0) {
+        return warnings;
+    }
+
+    /* The fewest ranks that carry half the traffic. */
+    sort(by_bytes.rbegin(), by_bytes.rend());
+    unsigned long sum = 0;
+    vector<int> busiest;
+    for (const auto& b : by_bytes) {
+        busiest.push_back(b.second);
+        sum += b.first;
+        if (2 * sum >= total) {
+            break;
+        }
+    }
+    sort(busiest.begin(), busiest.end());
+
+    out << indent << "ranks_with_half_the_bytes: [";
+    for (size_t i = 0; i < busiest.size(); i++) {
+        out << (i == 0 ? "" : ", ") << busiest[i];
+    }
+    out << "]" << endl;
+
+    double mean = (double)total / ranks.size();
+    if (by_bytes.front().first > IMBALANCE_THRESHOLD * mean) {
+        warnings.push_back("rank " + to_string(by_bytes.front().second) +
+                           " has " + to_string(by_bytes.front().first / mean)
+                           + " times the mean traffic");
+    }
+    if (ranks.size() > 1 &&
+        busiest.size() < CONCENTRATION_THRESHOLD * ranks.size()) {
+        warnings.push_back(to_string(busiest.size()) + " of " +
+                           to_string(ranks.size()) +
+                           " ranks carry half the traffic");
+    }
+
+    return warnings;
+}
+
+/* Gather the messages sent by every rank onto rank 0, keyed by source and
+ * destination grid. Returns false on the other ranks. */
+static bool gather_messages(Transport& transport,
+                            const list<Router *>& routers,
+                            map<pair<string, string>, vector<Message> >& pairs)
+{
+    vector<int> entries, all_entries, all_sizes;
+
+    assert(!routers.empty());
+    for (const auto& r : routers) {
+        r->get_traffic(entries);
+    }
+    transport.gatherv(entries, all_entries, all_sizes);
+
+    if (transport.get_rank() != 0) {
+        return false;
+    }
+
+    const Router *router = routers.front();
+    assert(all_entries.size() % 6 == 0);
+    for (size_t i = 0; i < all_entries.size(); i += 6) {
+        const int *e = &all_entries[i];
+        Message m = {e[2], e[3], (unsigned int)e[4], (unsigned int)e[5]};
+        pairs[make_pair(router->get_grid_name(e[0]),
+                        router->get_grid_name(e[1]))].push_back(m);
+    }
+    return true;
+}
+
+void write_traffic_report(Transport& transport,
+                          const list<Router *>& routers, const string& path)
+{
+    map<pair<string, string>, vector<Message> > pairs;
+
+    if (!gather_messages(transport, routers, pairs)) {
+        return;
+    }
+
+    ofstream out(path);
+    if (!out) {
+        cerr << "Error: can't write traffic report " << path << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    out << "# Coupling traffic worked out from the routing tables. Bytes are"
+        << endl << "# for one field in one transfer." << endl
+        << "ranks: " << transport.get_size() << endl
+        << "grid_pairs:" << endl;
+
+    map<int, RankTraffic> all_ranks;
+    list<string> warnings;
+    for (auto& kv : pairs) {
+        auto& messages = kv.second;
+        sort(messages.begin(), messages.end(),
+             [](const Message& a, const Message& b) {
+                 return make_pair(a.src_rank, a.dest_rank) <
+                        make_pair(b.src_rank, b.dest_rank);
+             });
+
+        unsigned long points = 0;
+        for (const auto& m : messages) {
+            points += m.points;
+        }
+
+        out << "  - source_grid: " << kv.first.first << endl
+            << "    destination_grid: " << kv.first.second << endl
+            << "    messages: " << messages.size() << endl
+            << "    points: " << points << endl
+            << "    bytes: " << points * sizeof(double) << endl
+            << "    # [source rank, destination rank, points, bytes]" << endl
+            << "    matrix:" << endl;
+        for (const auto& m : messages) {
+            out << "      - [" << m.src_rank << ", " << m.dest_rank << ", "
+                << m.points << ", " << message_bytes(m) << "]" << endl;
+        }
+
+        map<int, RankTraffic> ranks;
+        add_traffic(messages, ranks);
+        add_traffic(messages, all_ranks);
+        for (const auto& w : write_rank_stats(out, "    ", ranks)) {
+            warnings.push_back(kv.first.first + " to " + kv.first.second +
+                               ": " + w);
+        }
+    }
+
+    out << "summary:" << endl;
+    for (const auto& w : write_rank_stats(out, "  ", all_ranks)) {
+        warnings.push_back("all grids: " + w);
+    }
+
+    out << "warnings:" << (warnings.empty() ? " []" : "") << endl;
+    for (const auto& w : warnings) {
+        out << "  - \"" << w << "\"" << endl;
+        cerr << "Warning: " << w << ", see " << path << endl;
+    }
+}
+
+/* Bytes between each pair of ranks, in both directions. */
+typedef vector<map<int, unsigned long> > TrafficGraph;
+
+/* The bytes that cross between nodes when rank r is on node[r]. */
+static unsigned long cut_bytes(const TrafficGraph& graph,
+                               const vector<int>& node)
+{
+    unsigned long bytes = 0;
+
+    for (size_t a = 0; a < graph.size(); a++) {
+        for (const auto& kv : graph[a]) {
+            if ((size_t)kv.first > a && node[a] != node[kv.first]) {
+                bytes += kv.second;
+            }
+        }
+    }
+    return bytes;
+}
+
+/* Bytes between rank a and the ranks on node n, other than a. */
+static unsigned long bytes_to_node(const TrafficGraph& graph,
+                                   const vector<int>& node, int a, int n)
+{
+    unsigned long bytes = 0;
+
+    for (const auto& kv : graph[a]) {
+        if (kv.first != a && node[kv.first] == n) {
+            bytes += kv.second;
+        }
+    }
+    return bytes;
+}
+
+/* Split the ranks into nodes of at most ranks_per_node so that few bytes
+ * cross between nodes. Each node is grown from the busiest rank left by
+ * adding the rank with the most traffic to it, then pairs of ranks on
+ * different nodes are swapped while that helps. This is deterministic. */
+static vector<int> partition(const TrafficGraph& graph,
+                             unsigned int ranks_per_node)
+{
+    int num_ranks = graph.size();
+    vector<int> node(num_ranks, -1);
+    vector<pair<unsigned long, int> > order;
+
+    for (int r = 0; r < num_ranks; r++) {
+        unsigned long total = 0;
+        for (const auto& kv : graph[r]) {
+            total += kv.second;
+        }
+        /* Busiest first, then by rank. */
+        order.push_back(make_pair(~total, r));
+    }
+    sort(order.begin(), order.end());
+
+    size_t next = 0;
+    for (int n = 0; next < order.size(); n++) {
+        /* Bytes between each unplaced rank and this node. */
+        map<int, unsigned long> connected;
+        unsigned int members = 0;
+
+        while (members < ranks_per_node) {
+            int r = -1;
+            unsigned long best = 0;
+            for (const auto& kv : connected) {
+                if (node[kv.first] == -1 && (r == -1 || kv.second > best)) {
+                    r = kv.first;
+                    best = kv.second;
+                }
+            }
+            if (r == -1) {
+                while (next < order.size() && node[order[next].second] != -1) {
+                    next++;
+                }
+                if (next == order.size()) {
+                    break;
+                }
+                r = order[next].second;
+            }
+
+            node[r] = n;
+            members++;
+            connected.erase(r);
+            for (const auto& kv : graph[r]) {
+                if (node[kv.first] == -1) {
+                    connected[kv.first] += kv.second;
+                }
+            }
+        }
+
+        while (next < order.size() && node[order[next].second] != -1) {
+            next++;
+        }
+    }
+
+    for (int pass = 0; pass < 10; pass++) {
+        bool improved = false;
+
+        for (int a = 0; a < num_ranks; a++) {
+            for (const auto& kv : graph[a]) {
+                int b = kv.first;
+                int na = node[a], nb = node[b];
+                if (na == nb) {
+                    continue;
+                }
+
+                /* Swapping a and b changes the bytes crossing nodes by
+                 * this much. The a-b traffic still crosses. */
+                long gain = (long)bytes_to_node(graph, node, a, nb) -
+                            (long)bytes_to_node(graph, node, a, na) +
+                            (long)bytes_to_node(graph, node, b, na) -
+                            (long)bytes_to_node(graph, node, b, nb) -
+                            2 * (long)kv.second;
+                if (gain > 0) {
+                    node[a] = nb;
+                    node[b] = na;
+                    improved = true;
+                    break;
+                }
+            }
+        }
+
+        if (!improved) {
+            break;
+        }
+    }
+
+    return node;
+}
+
+/* The node that each rank is on now, numbered in order of their lowest rank,
+ * and the most ranks on any node. Only rank 0 gets the nodes. */
+static void current_nodes(Transport& transport, vector<int>& nodes,
+                          unsigned int& max_ranks_per_node)
+{
+    MPI_Comm node_comm;
+    int node_size, leader = transport.get_rank();
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+    MPI_Comm_free(&node_comm);
+
+    int max_size;
+    MPI_Allreduce(&node_size, &max_size, 1, MPI_INT, MPI_MAX,
+                  MPI_COMM_WORLD);
+    max_ranks_per_node = max_size;
+
+    vector<int> sizes;
+    transport.gatherv(vector<int>(1, leader), nodes, sizes);
+
+    map<int, int> numbers;
+    for (auto& n : nodes) {
+        auto it = numbers.insert(make_pair(n, numbers.size())).first;
+        n = it->second;
+    }
+}
+
+/* Ask MPI how it would renumber the ranks given the traffic graph. Returns
+ * the new rank of each rank, on rank 0 only. */
+static vector<int> mpi_reorder(Transport& transport, const TrafficGraph& graph)
+{
+    vector<int> sources, degrees, destinations, weights;
+    MPI_Comm graph_comm;
+    int new_rank;
+
+    /* Rank 0 gives all the edges. Weights are in KB so they fit. */
+    for (size_t a = 0; a < graph.size(); a++) {
+        sources.push_back(a);
+        degrees.push_back(graph[a].size());
+        for (const auto& kv : graph[a]) {
+            destinations.push_back(kv.first);
+            weights.push_back((int)min(kv.second / 1024 + 1,
+                                       (unsigned long)INT_MAX));
+        }
+    }
+
+    MPI_Dist_graph_create(MPI_COMM_WORLD, sources.size(), sources.data(),
+                          degrees.data(), destinations.data(), weights.data(),
+                          MPI_INFO_NULL, 1, &graph_comm);
+    MPI_Comm_rank(graph_comm, &new_rank);
+    MPI_Comm_free(&graph_comm);
+
+    vector<int> new_ranks, sizes;
+    transport.gatherv(vector<int>(1, new_rank), new_ranks, sizes);
+    return new_ranks;
+}
+
+void write_rank_placement(Transport& transport,
+                          const list<Router *>& routers,
+                          unsigned int ranks_per_node, const string& path,
+                          bool use_mpi)
+{
+    map<pair<string, string>, vector<Message> > pairs;
+    vector<int> nodes;
+    unsigned int detected = 0;
+    bool root = gather_messages(transport, routers, pairs);
+    int num_ranks = transport.get_size();
+
+    if (use_mpi) {
+        current_nodes(transport, nodes, detected);
+        if (ranks_per_node == 0) {
+            ranks_per_node = detected;
+        }
+    }
+    if (ranks_per_node == 0) {
+        cerr << "Error: ranks_per_node must be set in config.yaml for "
+             << "rank_placement." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    TrafficGraph graph;
+    if (root) {
+        graph.resize(num_ranks);
+        for (const auto& kv : pairs) {
+            for (const auto& m : kv.second) {
+                if (m.src_rank != m.dest_rank) {
+                    graph[m.src_rank][m.dest_rank] += message_bytes(m);
+                    graph[m.dest_rank][m.src_rank] += message_bytes(m);
+                }
+            }
+        }
+    }
+
+    /* Collective, so all ranks take part. */
+    vector<int> new_ranks;
+    if (use_mpi) {
+        new_ranks = mpi_reorder(transport, graph);
+    }
+
+    if (!root) {
+        return;
+    }
+
+    /* Launchers usually fill nodes in rank order. */
+    vector<int> blocked(num_ranks);
+    for (int r = 0; r < num_ranks; r++) {
+        blocked[r] = r / ranks_per_node;
+    }
+    vector<int> suggested = partition(graph, ranks_per_node);
+
+    ofstream out(path);
+    if (!out) {
+        cerr << "Error: can't write rank placement " << path << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    out << "# Placement of ranks on nodes that keeps coupling traffic within"
+        << endl << "# nodes, " << ranks_per_node << " ranks per node. Use "
+        << "with e.g. mpirun --rankfile." << endl
+        << "# Bytes crossing nodes for one field in one transfer:" << endl
+        << "#   ranks in order: " << cut_bytes(graph, blocked) << endl;
+    if (!nodes.empty()) {
+        out << "#   this run: " << cut_bytes(graph, nodes) << endl;
+    }
+    if (!new_ranks.empty()) {
+        /* Rank r would take over the node of the rank renumbered to r. */
+        vector<int> reordered(num_ranks);
+        for (int r = 0; r < num_ranks; r++) {
+            reordered[new_ranks[r]] = nodes[r];
+        }
+        out << "#   MPI_Dist_graph_create reordering this run: "
+            << cut_bytes(graph, reordered) << endl;
+    }
+    out << "#   this placement: " << cut_bytes(graph, suggested) << endl;
+
+    map<int, int> slots;
+    for (int r = 0; r < num_ranks; r++) {
+        out << "rank " << r << "=+n" << suggested[r] << " slot="
+            << slots[suggested[r]]++ << endl;
+    }
+}
+
+/* Byte counts go through the transport as two ints. */
+static void push_bytes(vector<int>& out, size_t bytes)
+{
+    out.push_back((int)(bytes >> 31));
+    out.push_back((int)(bytes & 0x7FFFFFFF));
+}
+
+static size_t pop_bytes(const int *in)
+{
+    return ((size_t)in[0] << 31) + (size_t)in[1];
+}
+
+void write_memory_report(Transport& transport, const string& path)
+{
+    vector<int> mine, all, sizes;
+
+    for (int c = 0; c <= NUM_MEMORY_CATEGORIES; c++) {
+        push_bytes(mine, memory_current(c));
+        push_bytes(mine, memory_peak(c));
+    }
+    transport.gatherv(mine, all, sizes);
+
+    if (transport.get_rank() != 0) {
+        return;
+    }
+
+    ofstream out(path);
+    if (!out) {
+        cerr << "Error: can't write memory report " << path << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int num_ranks = transport.get_size();
+    assert(all.size() == mine.size() * num_ranks);
+
+    out << "# Memory used by Tango in bytes, current at tango_finalize() and"
+        << endl << "# the peak over the run." << endl
+        << "ranks: " << num_ranks << endl
+        << "categories:" << endl;
+    for (int c = 0; c <= NUM_MEMORY_CATEGORIES; c++) {
+        vector<size_t> current, peak;
+        size_t max_current = 0, max_peak = 0, total_peak = 0;
+        for (int r = 0; r < num_ranks; r++) {
+            const int *e = &all[(r * mine.size()) + (4 * c)];
+            current.push_back(pop_bytes(e));
+            peak.push_back(pop_bytes(e + 2));
+            max_current = max(max_current, current.back());
+            max_peak = max(max_peak, peak.back());
+            total_peak += peak.back();
+        }
+
+        out << "  " << memory_category_name(c) << ":" << endl
+            << "    max_current: " << max_current << endl
+            << "    max_peak: " << max_peak << endl
+            << "    mean_peak: " << total_peak / num_ranks << endl
+            << "    # [rank, current, peak]" << endl
+            << "    ranks:" << endl;
+        for (int r = 0; r < num_ranks; r++) {
+            out << "      - [" << r << ", " << current[r] << ", " << peak[r]
+                << "]" << endl;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <list>
+#include <string>
+
+#include "router.h"
+#include "transport.h"
+
+using namespace std;
+
+/* Write a report of the coupling traffic between ranks, as worked out from
+ * the routing tables, to path. This is collective, the traffic of every rank
+ * is gathered onto rank 0 which writes the file.
+ *
+ * For each pair of grids the report has every message as
+ * [source rank, destination rank, points, bytes], followed by the number of
+ * peers per rank and the bytes per rank. Bytes are for a single field in a
+ * single transfer, most of the cost of a coupling step scales with these.
+ * The summary covers all grids. Decompositions where the traffic is badly
+ * spread over the ranks are flagged in the report and on stderr. */
+void write_traffic_report(Transport& transport,
+                          const list<Router *>& routers, const string& path);
+
+/* Suggest how to place the ranks on nodes, with at most ranks_per_node on
+ * each, so that little of the coupling traffic crosses between nodes. The
+ * result is written to path as an Open MPI rankfile, with the bytes that
+ * cross nodes for the usual placement in rank order, the current run and the
+ * suggestion. With use_mpi, ranks_per_node can be zero to use the largest
+ * node of this run, and the renumbering that MPI_Dist_graph_create() comes
+ * up with is also shown. This is collective and rank 0 writes the file. */
+void write_rank_placement(Transport& transport,
+                          const list<Router *>& routers,
+                          unsigned int ranks_per_node, const string& path,
+                          bool use_mpi);
+
+/* Write the memory used by Tango on every rank, see accounting.h, to path.
+ * For each category the report has the current use and the peak of every
+ * rank, in bytes, and the largest of each over the ranks. When threads
+ * act as ranks the counts are for the whole process. This is collective and
+ * rank 0 writes the file. */
+void write_memory_report(Transport& transport, const string& path);
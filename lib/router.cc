@@ -1,6 +1,9 @@
 
 #include <algorithm>
+#include <numeric>
+#include <tuple>
 #include <iostream>
+#include <limits>
 #include <mpi.h>
 #include <assert.h>
 #include <unistd.h>
@@ -8,34 +11,58 @@
 #include "router.h"
 
 #define MAX_GRID_NAME_SIZE 32
-#define DESCRIPTION_SIZE (MAX_GRID_NAME_SIZE + 9)
+#define TANGO_TAG 0x7A960
 #define WEIGHT_THRESHOLD 1e-12
+/* Rows worked on at once by the kernels, see apply_bucket(). */
+#define KERNEL_ROWS 64u
+
+/* Check whether a point has been masked out, e.g. it is land on an ocean
+ * grid. An empty mask means that all points are active. */
+static inline bool is_masked(const vector<bool>& mask, point_t point)
+{
+    if (mask.empty()) {
+        return false;
+    }
+    assert(point > 0 && point <= mask.size());
+    return !mask[point - 1];
+}
 
 
-Tile::Tile(tile_id_t tile_id, int lis, int lie, int ljs, int lje,
+Tile::Tile(tile_id_t tile_id, const vector<Block>& blocks,
            int gis, int gie, int gjs, int gje)
-    : id(tile_id), lis(lis), lie(lie), ljs(ljs), lje(lje),
-      gis(gis), gie(gie), gjs(gjs), gje(gje)
+    : id(tile_id), blocks(blocks), gis(gis), gie(gie), gjs(gjs), gje(gje)
 {
     /* Set up list of points that this tile is responsible for with a global
-     * reference. */
+     * reference. These are in local order, i.e. one block after the other. */
+    vector<point_t> block_points;
     int n_cols = gje - gjs;
-    int n_local_rows = lie - lis;
-    int i_offset = lis - gis;
-    int j_offset = ljs - gjs;
 
-    for (int i = i_offset; i < (i_offset + n_local_rows); i++) {
-        point_t index = (n_cols * i) + j_offset;
+    for (const auto& b : blocks) {
+        int n_local_rows = b.lie - b.lis;
+        int i_offset = b.lis - gis;
+        int j_offset = b.ljs - gjs;
 
-        for (int j = ljs; j < lje; j++) {
-            /* Since the remapping scheme (ESMP) labels points starting at 1
-             * (not 0) we need to do the same. */
-            points.push_back(index + 1);
-            index++;
+        for (int i = i_offset; i < (i_offset + n_local_rows); i++) {
+            point_t index = (n_cols * i) + j_offset;
+
+            for (unsigned int j = b.ljs; j < b.lje; j++) {
+                /* Since the remapping scheme (ESMP) labels points starting at
+                 * 1 (not 0) we need to do the same. */
+                block_points.push_back(index + 1);
+                index++;
+            }
         }
     }
 
-    sort(points.begin(), points.end());
+    /* Sort the points, keeping track of the local index of each. */
+    local_indices.resize(block_points.size());
+    iota(local_indices.begin(), local_indices.end(), 0);
+    sort(local_indices.begin(), local_indices.end(),
+        [&](point_t i, point_t j){ return block_points[i] < block_points[j]; });
+
+    points.resize(block_points.size());
+    transform(local_indices.begin(), local_indices.end(), points.begin(),
+        [&](point_t i){ return block_points[i]; });
 }
 
 point_t Tile::global_to_local_domain(point_t global) const
@@ -48,46 +75,332 @@ point_t Tile::global_to_local_domain(point_t global) const
     auto it = lower_bound(points.begin(), points.end(), global);
     assert(*it == global);
 
-    return (it - points.begin());
+    return local_indices[it - points.begin()];
 }
 
 /* FIXME: override == operator for tiles. */
 bool Tile::domain_equal(const shared_ptr<Tile>& another_tile) const
 {
-    return ((lis == another_tile->lis) && (lie == another_tile->lie) &&
-            (ljs == another_tile->ljs) && (lje == another_tile->lje) &&
-            (gis == another_tile->gis) && (gie == another_tile->gie) &&
+    if (blocks.size() != another_tile->blocks.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const Block& a = blocks[i];
+        const Block& b = another_tile->blocks[i];
+
+        if ((a.lis != b.lis) || (a.lie != b.lie) ||
+            (a.ljs != b.ljs) || (a.lje != b.lje)) {
+            return false;
+        }
+    }
+
+    return ((gis == another_tile->gis) && (gie == another_tile->gie) &&
             (gjs == another_tile->gjs) && (gje == another_tile->gje));
 }
 
-void Tile::pack(int *box, size_t size)
+/* Marshall the tile description onto the end of box. The layout is:
+ * id, gis, gie, gjs, gje, number of blocks, then lis, lie, ljs, lje for each
+ * block. */
+void Tile::pack(vector<int>& box) const
 {
-    assert(size == 9);
+    box.push_back(id);
+    box.push_back(gis);
+    box.push_back(gie);
+    box.push_back(gjs);
+    box.push_back(gje);
+    box.push_back(blocks.size());
+
+    for (const auto& b : blocks) {
+        box.push_back(b.lis);
+        box.push_back(b.lie);
+        box.push_back(b.ljs);
+        box.push_back(b.lje);
+    }
+}
 
-    box[0] = id;
-    box[1] = lis;
-    box[2] = lie;
-    box[3] = ljs;
-    box[4] = lje;
-    box[5] = gis;
-    box[6] = gie;
-    box[7] = gjs;
-    box[8] = gje;
+/* A tile on the same proc and global domain but with different blocks. */
+Tile *Tile::with_blocks(const vector<Block>& new_blocks) const
+{
+    return new Tile(id, new_blocks, gis, gie, gjs, gje);
 }
 
-Router::Router(const Config& config,
-               unsigned int lis, unsigned int lie, unsigned int ljs,
-               unsigned int lje, unsigned int gis, unsigned int gie,
-               unsigned int gjs, unsigned int gje)
-    : config(config)
+/* The layout of an array covering all the blocks of the tile, with halo_i
+ * rows and halo_j columns of halo on each side. j varies fastest, as it does
+ * for dense fields, or with i_fastest i does, as for a Fortran array
+ * a(isd:ied, jsd:jed). */
+FieldLayout Tile::halo_layout(unsigned int halo_i, unsigned int halo_j,
+                              bool i_fastest) const
+{
+    assert(!blocks.empty());
+    unsigned int is = blocks[0].lis, ie = blocks[0].lie;
+    unsigned int js = blocks[0].ljs, je = blocks[0].lje;
+
+    for (const auto& b : blocks) {
+        is = min(is, b.lis);
+        ie = max(ie, b.lie);
+        js = min(js, b.ljs);
+        je = max(je, b.lje);
+    }
+
+    if (i_fastest) {
+        long column = (ie - is) + (2 * (long)halo_i);
+        return {(halo_j * column) + halo_i, 1, column};
+    }
+    long row = (je - js) + (2 * (long)halo_j);
+    return {(halo_i * row) + halo_j, row, 1};
+}
+
+/* The offset in an array with the given layout of each local point, in the
+ * order of a dense field. Returns false if any of them is negative or too
+ * big for a point_t. */
+bool Tile::get_layout_offsets(const FieldLayout& layout,
+                              counted_vector<point_t, MEMORY_TILES>& offsets)
+    const
+{
+    assert(!blocks.empty());
+    unsigned int is = blocks[0].lis, js = blocks[0].ljs;
+
+    for (const auto& b : blocks) {
+        is = min(is, b.lis);
+        js = min(js, b.ljs);
+    }
+
+    offsets.clear();
+    offsets.reserve(points.size());
+    for (const auto& b : blocks) {
+        for (unsigned int i = b.lis; i < b.lie; i++) {
+            for (unsigned int j = b.ljs; j < b.lje; j++) {
+                long offset = layout.offset +
+                              ((long)(i - is) * layout.stride_i) +
+                              ((long)(j - js) * layout.stride_j);
+                if (offset < 0 || offset > numeric_limits<point_t>::max()) {
+                    return false;
+                }
+                offsets.push_back(offset);
+            }
+        }
+    }
+    return true;
+}
+
+/* Make a new tile from a description created with pack(). The number of ints
+ * used is returned in size. */
+shared_ptr<Tile> Tile::unpack(const int *box, size_t *size)
+{
+    vector<Block> blocks(box[5]);
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const int *b = &box[6 + (4 * i)];
+        blocks[i] = {(unsigned int)b[0], (unsigned int)b[1],
+                     (unsigned int)b[2], (unsigned int)b[3]};
+    }
+    *size = 6 + (4 * blocks.size());
+
+    return shared_ptr<Tile>(new Tile(box[0], blocks,
+                                     box[1], box[2], box[3], box[4]));
+}
+
+/* Turn the links added so far into buckets of rows, see rows in router.h,
+ * and free the sets they were collected in.
+ *
+ * Rows are ordered by their number of links and then by the first side B
+ * point they use. The first gives buckets of rows that a kernel of fixed
+ * width can go through, see apply(). The second means that within a bucket
+ * packing reads through the local field from start to end rather than
+ * jumping about, which matters once a tile no longer fits in cache. Both
+ * ends of a mapping have the same links, so they come up with the same
+ * order and agree on the layout of messages. Within a row the side B points
+ * stay in ascending order, so sums don't depend on the layout. */
+void Mapping::compile(void)
+{
+    if (side_A_points.empty()) {
+        return;
+    }
+
+    vector<tuple<unsigned int, point_t, point_t> > order;
+    for (auto a : side_A_points) {
+        const auto& side_B = get_side_B(a);
+        order.push_back(make_tuple(side_B.size(), side_B.begin()->first, a));
+    }
+    sort(order.begin(), order.end());
+
+    rows.clear();
+    buckets.clear();
+    cols.clear();
+    weights.clear();
+    for (size_t i = 0; i < order.size(); i++) {
+        unsigned int width = get<0>(order[i]);
+        if (buckets.empty() || buckets.back().width != width) {
+            buckets.push_back({width, (unsigned int)i, 0, cols.size()});
+        }
+        buckets.back().num_rows++;
+        rows.push_back(get<2>(order[i]));
+        cols.resize(cols.size() + width);
+        weights.resize(weights.size() + width);
+    }
+
+    for (const auto& b : buckets) {
+        for (unsigned int r = 0; r < b.num_rows; r++) {
+            unsigned int k = 0;
+            for (const auto& b_and_w : get_side_B(rows[b.first_row + r])) {
+                size_t link = b.offset + ((size_t)k * b.num_rows) + r;
+                cols[link] = b_and_w.first;
+                weights[link] = b_and_w.second;
+                k++;
+            }
+        }
+    }
+
+    side_A_points.clear();
+#if defined(IMPROVED_RUNTIME_SPEED)
+    counted_vector<Links, MEMORY_MAPPINGS>().swap(side_A_to_B_map);
+#else
+    side_A_to_B_map.clear();
+#endif
+}
+
+/* Where a side B point is in the field. For the usual dense fields it is the
+ * local index itself, otherwise it is looked up, see FieldLayout. */
+struct DenseIndex {
+    point_t operator()(point_t p) const { return p; }
+};
+
+struct LayoutIndex {
+    const point_t *offsets;
+    point_t operator()(point_t p) const { return offsets[p]; }
+};
+
+/* Apply the weights of rows start to end of a bucket of n rows, each with W
+ * links. The width is known at compile time so the inner loop is unrolled.
+ * The rows are done KERNEL_ROWS at a time, with the k'th link of every row
+ * in the chunk before the k+1'th, so that cols and weights are read in the
+ * order they are stored and the compiler is free to vectorise over the rows.
+ * Each row still adds up its links in order, so the result is the same as
+ * the generic kernel below. */
+template <unsigned int W, typename Index>
+static void apply_bucket(unsigned int n, unsigned int start, unsigned int end,
+                         const point_t *cols, const weight_t *weights,
+                         const double *in, double *out, Index index)
+{
+    double sums[KERNEL_ROWS];
+
+    for (unsigned int first = start; first < end; first += KERNEL_ROWS) {
+        unsigned int rows = min(KERNEL_ROWS, end - first);
+
+        for (unsigned int r = 0; r < rows; r++) {
+            sums[r] = 0;
+        }
+        for (unsigned int k = 0; k < W; k++) {
+            const point_t *c = cols + (k * n) + first;
+            const weight_t *w = weights + (k * n) + first;
+            for (unsigned int r = 0; r < rows; r++) {
+                sums[r] += in[index(c[r])] * w[r];
+            }
+        }
+        for (unsigned int r = 0; r < rows; r++) {
+            out[first + r] = sums[r];
+        }
+    }
+}
+
+/* As above for any width, one row at a time. */
+template <typename Index>
+static void apply_bucket(unsigned int width, unsigned int n,
+                         unsigned int start, unsigned int end,
+                         const point_t *cols, const weight_t *weights,
+                         const double *in, double *out, Index index)
 {
+    for (unsigned int r = start; r < end; r++) {
+        double sum = 0;
+        for (unsigned int k = 0; k < width; k++) {
+            sum += in[index(cols[(k * n) + r])] * weights[(k * n) + r];
+        }
+        out[r] = sum;
+    }
+}
+
+template <typename Index>
+void Mapping::apply_buckets(const double *side_B_values, double *rows_out,
+                            unsigned int first_row, unsigned int end_row,
+                            bool generic, Index index) const
+{
+    for (const auto& b : buckets) {
+        /* The rows of this bucket that are wanted. */
+        if (b.first_row + b.num_rows <= first_row || b.first_row >= end_row) {
+            continue;
+        }
+        unsigned int n = b.num_rows;
+        unsigned int s = max(first_row, b.first_row) - b.first_row;
+        unsigned int e = min(end_row, b.first_row + n) - b.first_row;
+        const point_t *c = cols.data() + b.offset;
+        const weight_t *w = weights.data() + b.offset;
+        const double *in = side_B_values;
+        double *out = rows_out + b.first_row;
+
+        if (generic) {
+            apply_bucket(b.width, n, s, e, c, w, in, out, index);
+            continue;
+        }
+
+        switch (b.width) {
+        case 1:
+            apply_bucket<1>(n, s, e, c, w, in, out, index);
+            break;
+        case 4:
+            apply_bucket<4>(n, s, e, c, w, in, out, index);
+            break;
+        case 9:
+            apply_bucket<9>(n, s, e, c, w, in, out, index);
+            break;
+        case 16:
+            apply_bucket<16>(n, s, e, c, w, in, out, index);
+            break;
+        default:
+            apply_bucket(b.width, n, s, e, c, w, in, out, index);
+        }
+    }
+}
 
-    tile_id_t tile_id;
+/* Work out the value of rows first_row to end_row from the side B values,
+ * into rows_out in message order. Other rows of rows_out are left alone, so
+ * several threads can work on different rows of one message. The common
+ * widths, e.g. 4 for bilinear and 16 for patch remapping, have their own
+ * kernels. generic uses the same kernel for everything, it's only there for
+ * comparison, see tango_benchmark.cc. offsets, if given, says where each
+ * local point is in side_B_values, see Tile::get_layout_offsets(). */
+void Mapping::apply_rows(const double *side_B_values, double *rows_out,
+                         unsigned int first_row, unsigned int end_row,
+                         const point_t *offsets, bool generic) const
+{
+    if (offsets == nullptr) {
+        apply_buckets(side_B_values, rows_out, first_row, end_row, generic,
+                      DenseIndex());
+    } else {
+        apply_buckets(side_B_values, rows_out, first_row, end_row, generic,
+                      LayoutIndex{offsets});
+    }
+}
 
-    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
-    MPI_Comm_rank(MPI_COMM_WORLD, &tile_id);
+const Mapping::Links& Mapping::get_side_B(point_t p) const
+{
+#if defined(IMPROVED_RUNTIME_SPEED)
+    return side_A_to_B_map[p];
+#else
+    auto it = side_A_to_B_map.find(p);
+    assert(it != side_A_to_B_map.end());
+    return it->second;
+#endif
+}
 
-    unique_ptr<Tile> tmp(new Tile(tile_id, lis, lie, ljs, lje, gis, gie, gjs, gje));
+/* The tile id is the rank of this proc. */
+Router::Router(const Config& config, tile_id_t tile_id,
+               const vector<Block>& blocks,
+               unsigned int gis, unsigned int gie,
+               unsigned int gjs, unsigned int gje)
+    : config(config)
+{
+    unique_ptr<Tile> tmp(new Tile(tile_id, blocks, gis, gie, gjs, gje));
     local_tile = move(tmp);
 
     unsigned int grid_size = ((gie - gis) * (gje - gjs));
@@ -101,8 +414,38 @@ Router::Router(const Config& config,
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    exchange_descriptions();
-    build_routing_rules();
+    check_local_tile();
+
+    /* The routing rules are built later, once all procs know about each
+     * other. See exchange_descriptions() and build_routing_rules(). */
+}
+
+void Router::check_local_tile(void) const
+{
+    /* The blocks of the local tile must not overlap. Since the points are
+     * sorted any overlap shows up as adjacent duplicates. */
+    const auto& points = local_tile->get_points();
+    if (adjacent_find(points.begin(), points.end()) != points.end()) {
+        cerr << "Error: local blocks of grid '" << config.get_local_grid()
+             << "' overlap." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* Give the local tile new blocks, e.g. when the model rebalances its
+ * decomposition. Returns whether they are different from the old ones. The
+ * routing is out of date until update_routing_rules() has been called. */
+bool Router::set_local_blocks(const vector<Block>& blocks)
+{
+    shared_ptr<Tile> t(local_tile->with_blocks(blocks));
+
+    if (local_tile->domain_equal(t)) {
+        return false;
+    }
+    local_tile.reset(new Tile(*t));
+    check_local_tile();
+
+    return true;
 }
 
 void Router::create_send_mapping(string grid_name, shared_ptr<Tile> t)
@@ -126,67 +469,99 @@ void Router::create_recv_mapping(string grid_name, shared_ptr<Tile> t)
     recv_mappings[grid_name].push_back(new_m);
 }
 
-/* Pack a description of this proc and broadcast it to all others. They'll use
- * the information to set up their routers. */
-void Router::exchange_descriptions(void)
+/* Pack a description of the tiles on this proc and broadcast it to all
+ * others. They'll use the information to set up their routers. There is one
+ * tile for each component/router in this proc. This is a collective call
+ * over all ranks of the transport. */
+void Router::exchange_descriptions(Transport& transport,
+                                   const list<Router *>& local_routers,
+                                   TileDescriptions& descriptions)
 {
-    int description[DESCRIPTION_SIZE];
-    int *all_descs;
-    unsigned int i;
-
-    /* Marshall my description into an array. */
-    /* We waste some bytes here when sending the grid name. */
-    string local_grid_name = config.get_local_grid();
-    assert(local_grid_name.size() <= MAX_GRID_NAME_SIZE);
-    for (i = 0; i < MAX_GRID_NAME_SIZE; i++) {
-        if (i < local_grid_name.size()) {
-            description[i] = local_grid_name[i];
-            assert(description[i] != '\0');
-        } else {
-            description[i] = '\0';
+    vector<int> description;
+
+    /* Marshall my descriptions into an array, one after the other. */
+    for (const auto& router : local_routers) {
+        /* We waste some bytes here when sending the grid name. */
+        string local_grid_name = router->get_local_grid();
+        assert(local_grid_name.size() <= MAX_GRID_NAME_SIZE);
+        for (unsigned int i = 0; i < MAX_GRID_NAME_SIZE; i++) {
+            if (i < local_grid_name.size()) {
+                description.push_back(local_grid_name[i]);
+                assert(description.back() != '\0');
+            } else {
+                description.push_back('\0');
+            }
         }
-    }
 
-    local_tile->pack(&(description[i]), DESCRIPTION_SIZE - MAX_GRID_NAME_SIZE);
+        router->local_tile->pack(description);
+    }
 
     /* Distribute all_descriptions. There is a big design decision here. The
      * domain information of each PE/tile is distributed to all others, it is
      * then the responsibility of each PE to calculate the mappings that it is
      * involved in. This increases computation overall but saves a lot on
      * communication. */
-    all_descs = new int[DESCRIPTION_SIZE * num_ranks];
-    MPI_Gather(description, DESCRIPTION_SIZE, MPI_INT, all_descs,
-               DESCRIPTION_SIZE, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
-    MPI_Bcast(all_descs, DESCRIPTION_SIZE * num_ranks, MPI_INT,
-              0, MPI_COMM_WORLD);
-
-    /* Unmarshall into Tile objects. */
-    for (int i = 0; i < num_ranks * DESCRIPTION_SIZE; i += DESCRIPTION_SIZE) {
-
-        int j = i;
+    /* Descriptions are different sizes because procs can have any number of
+     * tiles and tiles any number of blocks. */
+    vector<int> all_descs;
+    vector<int> all_sizes;
+    transport.allgatherv(description, all_descs, all_sizes);
+    int total_size = all_descs.size();
+
+    /* Split into a description per tile, keyed by grid. These are only
+     * unmarshalled into Tile objects by the routers that need them. */
+    int i = 0;
+    while (i < total_size) {
         string grid_name;
 
-        for (; j < (i + MAX_GRID_NAME_SIZE); j++) {
+        for (int j = i; j < (i + MAX_GRID_NAME_SIZE); j++) {
             if (all_descs[j] != '\0') {
                 grid_name.push_back((char)all_descs[j]);
             }
         }
+        i += MAX_GRID_NAME_SIZE;
+
+        /* See Tile::pack() for the layout. */
+        int tile_size = 6 + (4 * all_descs[i + 5]);
+        descriptions[grid_name].push_back(vector<int>(&all_descs[i],
+                                                      &all_descs[i + tile_size]));
+        i += tile_size;
+    }
+    assert(i == total_size);
+}
+
+/* Create the tiles of peer grids and the (empty) mappings to them. */
+void Router::create_mappings(const TileDescriptions& descriptions)
+{
+    /* Number the grids. Sort the names so that all procs agree. */
+    vector<string> grid_names;
+    for (const auto& kv : descriptions) {
+        grid_names.push_back(kv.first);
+    }
+    sort(grid_names.begin(), grid_names.end());
+    for (size_t i = 0; i < grid_names.size(); i++) {
+        grid_ids[grid_names[i]] = i;
+    }
 
-        if (all_descs[j] == local_tile->get_id()) {
-            /* This is us. */
+    for (const auto& kv : descriptions) {
+        const string& grid_name = kv.first;
+
+        /* Note that below no tiles are kept for grids that we don't
+         * communicate with, including ourselves. Tiles of peer grids may be
+         * on this proc, i.e. in another component. */
+        if (!config.is_peer_grid(grid_name)) {
             continue;
         }
 
-        /* Note that below no tiles are kept for grids that we don't
-         * communicate with, including ourselves. */
+        for (const auto& desc : kv.second) {
 
-        /* Make a new tile and mappings to grid_name. Any tile that we don't
-         * actually communicate with will be deleted. */
-        if (config.is_peer_grid(grid_name)) {
+            /* Make a new tile and mappings to grid_name. Any tile that we
+             * don't actually communicate with will be deleted. */
             /* A tile could get big, so we make pointers and avoid copying. */
-            shared_ptr<Tile> t(new Tile(all_descs[j], all_descs[j+1], all_descs[j+2],
-                               all_descs[j+3], all_descs[j+4], all_descs[j+5],
-                               all_descs[j+6], all_descs[j+7], all_descs[j+8]));
+            size_t tile_size;
+            shared_ptr<Tile> t = Tile::unpack(desc.data(), &tile_size);
+            assert(tile_size == desc.size());
+            peer_tiles[grid_name].push_back(t);
 
             /* Now create the mappings from the local tile to this remote tile.
              * These will be populated later. Note that there can be both send
@@ -202,144 +577,251 @@ void Router::exchange_descriptions(void)
     }
 
     /* FIXME: check that the domains of remote procs don't overlap. */
-    delete[] all_descs;
 }
 
-
-void Router::add_link_to_send_mapping(string grid, unsigned int src_point,
-                                      unsigned int dest_point, double weight)
+/* The MPI tag used for messages from src_grid to dest_grid. */
+int Router::get_message_tag(string src_grid, string dest_grid) const
 {
-    for (auto& mapping : get_send_mappings(grid)) {
-
-        /* The tile that this mapping leads to. */
-        const shared_ptr<Tile>& remote_tile = mapping->get_remote_tile();
-        if (remote_tile->has_point(dest_point)) {
-
-            /* So we have found a remote tile which is responsible for our
-             * destination point. We need populate the mapping object with
-             * this src_point -> dest_point relationship. */
+    auto src = grid_ids.find(src_grid);
+    auto dest = grid_ids.find(dest_grid);
+    assert(src != grid_ids.end() && dest != grid_ids.end());
 
-            /* We name the remote point as a 'side A' point. This is a
-             * convention used to keep the Mapping agnostic re the send and
-             * receive sides. 'side A' is the one that has it's points sent
-             * between tiles. Presently in a tango put/send side A is the
-             * remote side and in a get/receive it is the local side. In the
-             * future we may allow for the sender to have it's point sent over
-             * the wire. In that case side A would be the local side in a
-             * put/send. */
+    return TANGO_TAG + (src->second * grid_ids.size()) + dest->second;
+}
 
-            /* One more thing: all points are on the global domain by default
-             * (that's how they're stored in the mapping weights file of
-             * course), but to be useful on the local PE they need to be
-             * converted to the local coordinate system. Essentially to an
-             * array index in the local domain. */
+/* The MPI tag used for messages from src_grid to dest_grid that have been
+ * aggregated over a node. These come after all the tags from
+ * get_message_tag(). */
+int Router::get_aggregate_tag(string src_grid, string dest_grid) const
+{
+    return get_message_tag(src_grid, dest_grid) +
+           (grid_ids.size() * grid_ids.size());
+}
 
-            point_t side_A = remote_tile->global_to_local_domain(dest_point);
-            point_t side_B = local_tile->global_to_local_domain(src_point);
-            mapping->add_link(side_A, side_B, weight);
+int Router::get_grid_id(string grid) const
+{
+    auto it = grid_ids.find(grid);
+    assert(it != grid_ids.end());
+    return it->second;
+}
 
-            /* Break now because there can be only one remote tile that has
-             * this destination point. */
-            break;
+string Router::get_grid_name(int id) const
+{
+    for (const auto& kv : grid_ids) {
+        if (kv.second == id) {
+            return kv.first;
         }
     }
+    assert(false);
+    return "";
 }
 
-void Router::add_link_to_recv_mapping(string grid, unsigned int src_point,
-                                      unsigned int dest_point, double weight) 
+/* Describe the messages that this router sends, for write_traffic_report().
+ * For each send mapping six ints are added to entries: the source and
+ * destination grid ids, the source and destination ranks, the number of
+ * points sent and the number of weights applied to make them. */
+void Router::get_traffic(vector<int>& entries) const
 {
-    /* See comments above for explanation of this function. */
-    for (auto& mapping : get_recv_mappings(grid)) {
-
-        const shared_ptr<Tile>& remote_tile = mapping->get_remote_tile();
-        if (remote_tile->has_point(src_point)) {
-
-            point_t side_A = local_tile->global_to_local_domain(dest_point);
-            point_t side_B = remote_tile->global_to_local_domain(src_point);
-            mapping->add_link(side_A, side_B, weight);
-            break;
+    int local_id = get_grid_id(get_local_grid());
+
+    for (const auto& kv : send_mappings) {
+        int peer_id = get_grid_id(kv.first);
+
+        for (const auto& mapping : kv.second) {
+            entries.push_back(local_id);
+            entries.push_back(peer_id);
+            entries.push_back(get_tile_id());
+            entries.push_back(mapping->get_remote_tile_id());
+            entries.push_back(mapping->get_num_points());
+            entries.push_back(mapping->get_num_links());
         }
     }
 }
 
-void Router::build_routing_rules(void)
+/* The MPI tag used for messages that bundle the data of several pairs of
+ * grids going to the same proc. Within a bundle each part is labelled with
+ * its tag from get_message_tag(). */
+int Router::get_bundle_tag(void)
 {
-    /* Now open the grid remapping files created with ESMF. Use this to
-     * populate the mapping graph. */
+    return TANGO_TAG - 1;
+}
 
-    /* Iterate over all the grids that we send to. */
-    for (const auto& grid : config.get_send_grids()) {
-        vector<unsigned int> src_points;
-        vector<unsigned int> dest_points;
-        vector<double> weights;
-
-        config.read_weights(config.get_local_grid(), grid,
-                            src_points, dest_points, weights, true);
-
-        /* For all points that the local tile is responsible for set up a
-         * mapping to a tile on the grid that we are sending to. */
-        unsigned int src_idx = 0;
-        for (const auto point : local_tile->get_points()) {
-            /* We don't start searching from src_idx == 0, due to sorting lower
-             * points have already been consumed. */
-            for (; src_idx < src_points.size(); src_idx++) {
-
-                unsigned int src_point = src_points[src_idx];
-                unsigned int dest_point = dest_points[src_idx];
-                double weight = weights[src_idx];
-
-                /* Since local_tile points and src_points are both sorted in
-                 * ascending order. if src_point > local point then there's no
-                 * use continuing to search, won't find anything. */
-                if (src_point > point) {
-                    break;
-                }
+/* The MPI tag used to compare clocks between ranks when tracing, see
+ * Tracer::sync_clocks(). */
+int Router::get_trace_tag(void)
+{
+    return TANGO_TAG - 2;
+}
 
-                if ((src_point == point) && (weight > WEIGHT_THRESHOLD)) {
-                    /* So this source points exists on the local tile, also the
-                     * weight is large enough to care about. */
 
-                    /* Set up a mapping between this source point and the
-                     * destination. */
-                    add_link_to_send_mapping(grid, src_point, dest_point, weight);
-               }
-            }
-        }
+/* The weights for sending to (send is true) or receiving from grid. They
+ * are read the first time and kept until clear_weights(). */
+const RemapWeights& Router::get_weights(string grid, bool send)
+{
+    auto& cache = send ? send_weights : recv_weights;
+    auto it = cache.find(grid);
+    if (it != cache.end()) {
+        return it->second;
     }
 
-    /* Iterate over all the grids that we receive from. */
-    for (const auto& grid : config.get_recv_grids()) {
-        vector<unsigned int> src_points;
-        vector<unsigned int> dest_points;
-        vector<double> weights;
+    RemapWeights& w = cache[grid];
+    if (send) {
+        config.read_weights(config.get_local_grid(), grid, w.src_points,
+                            w.dest_points, w.weights, true);
+    } else {
+        config.read_weights(grid, config.get_local_grid(), w.src_points,
+                            w.dest_points, w.weights, false);
+    }
+    return w;
+}
 
-        config.read_weights(grid, config.get_local_grid(),
-                            src_points, dest_points, weights, false);
+/* The weights are only kept if cache_weights is set in config.yaml. */
+void Router::clear_weights(void)
+{
+    if (!config.is_cache_weights()) {
+        send_weights.clear();
+        recv_weights.clear();
+    }
+}
 
-        /* For all points that this tile is responsible for, figure out which
-         * remote tiles it needs to receive from. */
-        unsigned int dest_idx = 0;
-        for (const auto point : local_tile->get_points()) {
-            for (; dest_idx < dest_points.size(); dest_idx++) {
+/* A link found by add_links(). */
+struct FoundLink {
+    point_t side_A;
+    point_t side_B;
+    weight_t weight;
+};
+
+/* Add the links between the local tile and the remote tiles of mappings,
+ * which are all on grid, sending to them if send is set and otherwise
+ * receiving from them.
+ *
+ * A link goes from a 'side B' point to a 'side A' point. This is a
+ * convention used to keep the Mapping agnostic re the send and receive
+ * sides. 'side A' is the one that has its points sent between tiles, so in
+ * a put/send side A is the remote side and in a get/receive it is the local
+ * side. Points in the weights are on the global domain, and are converted
+ * to indices into the arrays of the local domain of their tile.
+ *
+ * The weights are shared out over the thread team, each thread finding the
+ * links in its part. The remote tile of each point is looked up in a table
+ * rather than searched for. The links are then added to each mapping on
+ * its own thread, from the parts in order, so the mappings don't depend on
+ * the number of threads. It can be called for several grids at once as long
+ * as their weights have already been read, see build_routing_rules(). */
+void Router::add_links(string grid, list<shared_ptr<Mapping> >& mappings,
+                       bool send)
+{
+    /* Masked points are dropped from the mappings altogether. Both sides
+     * of a mapping use the same masks so they agree on the points being
+     * sent. */
+    const vector<bool>& local_mask = config.get_mask(config.get_local_grid());
+    const vector<bool>& remote_mask = config.get_mask(grid);
+    const RemapWeights& w = get_weights(grid, send);
+    const auto& local_points = send ? w.src_points : w.dest_points;
+    const auto& remote_points = send ? w.dest_points : w.src_points;
+    const auto& weights = w.weights;
+
+    /* The mapping, and local index on its tile, of each remote point. There
+     * can be only one remote tile that has a point. */
+    vector<Mapping *> maps;
+    point_t max_point = 0;
+    for (const auto& m : mappings) {
+        const auto& points = m->get_remote_tile()->get_points();
+        if (!points.empty()) {
+            max_point = max(max_point, points.back());
+        }
+        maps.push_back(m.get());
+    }
+    counted_vector<pair<int, point_t>, MEMORY_MAPPINGS>
+        owners(max_point + 1, make_pair(-1, 0));
+    for (int m = maps.size() - 1; m >= 0; m--) {
+        const Tile& tile = *maps[m]->get_remote_tile();
+        const auto& points = tile.get_points();
+        const auto& local_indices = tile.get_local_indices();
+        for (size_t k = 0; k < points.size(); k++) {
+            owners[points[k]] = make_pair(m, local_indices[k]);
+        }
+    }
 
-                unsigned int src_point = src_points[dest_idx];
-                unsigned int dest_point = dest_points[dest_idx];
-                double weight = weights[dest_idx];
+    /* The links that each part of the weights has for each mapping. */
+    size_t num_parts = num_init_threads();
+    size_t num_weights = weights.size();
+    vector<vector<FoundLink> > found(num_parts * maps.size());
+
+#pragma omp parallel for schedule(static)
+    for (size_t part = 0; part < num_parts; part++) {
+        size_t start = (num_weights * part) / num_parts;
+        size_t end = (num_weights * (part + 1)) / num_parts;
+
+        for (size_t i = start; i < end; i++) {
+            point_t local_point = local_points[i];
+            point_t remote_point = remote_points[i];
+
+            /* The weight must be large enough to care about and neither end
+             * of the link masked. */
+            if (weights[i] <= WEIGHT_THRESHOLD ||
+                !local_tile->has_point(local_point) ||
+                is_masked(local_mask, local_point) ||
+                is_masked(remote_mask, remote_point) ||
+                remote_point > max_point ||
+                owners[remote_point].first < 0) {
+                continue;
+            }
 
-                if (dest_point > point) {
-                    break;
-                }
+            point_t local = local_tile->global_to_local_domain(local_point);
+            point_t remote = owners[remote_point].second;
+            FoundLink link = {send ? remote : local, send ? local : remote,
+                              weights[i]};
+            found[(part * maps.size()) + owners[remote_point].first]
+                .push_back(link);
+        }
+    }
 
-                if ((dest_point == point) && (weight > WEIGHT_THRESHOLD)) {
-                    add_link_to_recv_mapping(grid, src_point, dest_point, weight);
-                }
+#pragma omp parallel for schedule(dynamic)
+    for (size_t m = 0; m < maps.size(); m++) {
+        for (size_t part = 0; part < num_parts; part++) {
+            for (const auto& link : found[(part * maps.size()) + m]) {
+                maps[m]->add_link(link.side_A, link.side_B, link.weight);
             }
         }
     }
+}
+
+void Router::build_routing_rules(const TileDescriptions& descriptions)
+{
+    create_mappings(descriptions);
+
+    /* Now open the grid remapping files created with ESMF. Use this to
+     * populate the mapping graph. netCDF isn't thread safe so the weights
+     * are read one grid at a time, the links of the grids are then found
+     * at once, one grid to a thread. Each grid's links don't depend on the
+     * number of threads, see add_links(). If there is only one grid the
+     * thread team is left to add_links() instead. */
+    struct LinkJob {
+        string grid;
+        list<shared_ptr<Mapping> > *mappings;
+        bool send;
+    };
+    vector<LinkJob> jobs;
+    for (const auto& grid : config.get_send_grids()) {
+        get_weights(grid, true);
+        jobs.push_back({grid, &send_mappings[grid], true});
+    }
+    for (const auto& grid : config.get_recv_grids()) {
+        get_weights(grid, false);
+        jobs.push_back({grid, &recv_mappings[grid], false});
+    }
+
+#pragma omp parallel for schedule(dynamic) if (jobs.size() > 1)
+    for (size_t i = 0; i < jobs.size(); i++) {
+        add_links(jobs[i].grid, *jobs[i].mappings, jobs[i].send);
+    }
+    clear_weights();
 
     /* Now clean up all the unused mappings that were inserted in
-     * exchange_descriptions(). Further description at function. */
+     * create_mappings(). Further description at function. */
     remove_unused_mappings();
+    compile_mappings();
 
     /* FIXME: Check that all our local points are covered get mapped to
      * somewhere. */
@@ -349,12 +831,102 @@ void Router::build_routing_rules(void)
      * to be sent/received to/from each remote tile. */
 }
 
+/* Bring the routing up to date after tiles have changed, see
+ * tango_redecompose(). changed holds the new descriptions of the tiles that
+ * changed, it doesn't have to include the local tile. If the local tile has
+ * changed, see set_local_blocks(), all mappings are rebuilt, otherwise only
+ * those to changed tiles. Mappings to other tiles are left alone, including
+ * their compression history. */
+void Router::update_routing_rules(const TileDescriptions& changed,
+                                  bool local_changed)
+{
+    for (const auto& kv : changed) {
+        if (!config.is_peer_grid(kv.first)) {
+            continue;
+        }
+
+        auto& tiles = peer_tiles[kv.first];
+        for (const auto& desc : kv.second) {
+            size_t tile_size;
+            shared_ptr<Tile> t = Tile::unpack(desc.data(), &tile_size);
+            assert(tile_size == desc.size());
+
+            auto it = find_if(tiles.begin(), tiles.end(),
+                              [&](const shared_ptr<Tile>& old)
+                              { return old->get_id() == t->get_id(); });
+            assert(it != tiles.end());
+            *it = t;
+        }
+    }
+
+    auto by_tile = [](const shared_ptr<Mapping>& a,
+                      const shared_ptr<Mapping>& b)
+                   { return a->get_remote_tile_id() < b->get_remote_tile_id(); };
+
+    for (const auto& kv : peer_tiles) {
+        const string& grid = kv.first;
+
+        /* The tiles whose mappings are rebuilt. */
+        set<tile_id_t> ids;
+        auto c = changed.find(grid);
+        if (local_changed) {
+            for (const auto& t : kv.second) {
+                ids.insert(t->get_id());
+            }
+        } else if (c != changed.end()) {
+            for (const auto& desc : c->second) {
+                /* See Tile::pack(). */
+                ids.insert(desc[0]);
+            }
+        }
+        if (ids.empty()) {
+            continue;
+        }
+
+        list<shared_ptr<Mapping> > fresh_send, fresh_recv;
+        for (const auto& t : kv.second) {
+            if (ids.count(t->get_id()) != 0) {
+                fresh_send.push_back(make_shared<Mapping>(t));
+                fresh_recv.push_back(make_shared<Mapping>(t));
+            }
+        }
+
+        auto rebuilt = [&](const shared_ptr<Mapping>& m)
+                       { return ids.count(m->get_remote_tile_id()) != 0; };
+        auto unused = [](const shared_ptr<Mapping>& m)
+                      { return m->not_in_use(); };
+
+        if (config.is_send_grid(grid)) {
+            auto& mappings = send_mappings[grid];
+            add_links(grid, fresh_send, true);
+            fresh_send.remove_if(unused);
+            for (auto& m : fresh_send) {
+                m->compile();
+            }
+            mappings.remove_if(rebuilt);
+            mappings.merge(fresh_send, by_tile);
+        }
+        if (config.is_recv_grid(grid)) {
+            auto& mappings = recv_mappings[grid];
+            add_links(grid, fresh_recv, false);
+            fresh_recv.remove_if(unused);
+            for (auto& m : fresh_recv) {
+                m->compile();
+            }
+            mappings.remove_if(rebuilt);
+            mappings.merge(fresh_recv, by_tile);
+        }
+    }
+    clear_weights();
+}
+
 /* To begin with the router created mappings (and tiles) to represent all tiles
  * on the grids that this grid commuicates with. These were necessary because
  * we needed to know the domains/points of peer grids. However after actually
  * calculating the mappings many of these are empty, i.e. there are no points
  * on the local tile that map to a particaular remote tile. So remove all these
- * unused mappings. */
+ * unused mappings. This includes mappings to tiles which are entirely masked,
+ * e.g. land-only ocean tiles, so no messages are exchanged with them. */
 void Router::remove_unused_mappings(void)
 {
     auto clean_func = [](list<shared_ptr<Mapping> >& mappings) {
@@ -371,11 +943,35 @@ void Router::remove_unused_mappings(void)
         //assert(!mappings.empty());
     };
 
-    for (auto kv : send_mappings) {
+    /* Note that these need to be references, otherwise only a copy of the
+     * mappings is cleaned. */
+    for (auto& kv : send_mappings) {
         clean_func(kv.second);
     }
 
-    for (auto kv : recv_mappings) {
+    for (auto& kv : recv_mappings) {
         clean_func(kv.second);
     }
 }
+
+/* The mappings of all peer grids are compiled at once, shared out over the
+ * thread team. */
+void Router::compile_mappings(void)
+{
+    vector<Mapping *> all;
+    for (auto& kv : send_mappings) {
+        for (auto& m : kv.second) {
+            all.push_back(m.get());
+        }
+    }
+    for (auto& kv : recv_mappings) {
+        for (auto& m : kv.second) {
+            all.push_back(m.get());
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < all.size(); i++) {
+        all[i]->compile();
+    }
+}
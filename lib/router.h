@@ -5,8 +5,12 @@
 #include <list>
 #include <vector>
 #include <algorithm>
+#include <tuple>
 
+#include "accounting.h"
+#include "compression.h"
 #include "config.h"
+#include "transport.h"
 
 #define GROWTH_NUMBER (1024)
 
@@ -16,31 +20,62 @@ typedef unsigned int point_t;
 typedef double weight_t;
 typedef int tile_id_t;
 
-/* A per-rank tile represents a subdomain of a particular grid. */
+/* A rectangular block of a grid, given as i, j extents. */
+struct Block {
+    unsigned int lis, lie, ljs, lje;
+};
+
+/* Where the points of the local domain are in a model array that isn't just
+ * the points one after the other, e.g. one with halos or one level of a 3-D
+ * array. Point (i, j) is at offset + (i - is) * stride_i + (j - js) *
+ * stride_j, where is and js are the smallest lis and ljs of the blocks. */
+struct FieldLayout {
+    long offset;
+    long stride_i;
+    long stride_j;
+    bool operator<(const FieldLayout& other) const
+        {
+            return tie(offset, stride_i, stride_j) <
+                   tie(other.offset, other.stride_i, other.stride_j);
+        }
+};
+
+/* A per-rank tile represents a subdomain of a particular grid. It is made up
+ * of one or more blocks, e.g. for a block-cyclic decomposition. Since there is
+ * one tile per rank all the blocks on a rank share a single mapping to each
+ * remote tile and hence a single message. */
 class Tile {
 private:
 
     /* Id of the tile is the MPI_COMM_WORLD rank on which the tile exists. */
     tile_id_t id;
 
-    /* i, j extent of domain this tile contains. */
-    unsigned int lis, lie, ljs, lje;
+    /* i, j extents of the blocks that this tile contains. */
+    vector<Block> blocks;
     /* A different representation of the above. It is a 1-D array of global
      * indices. e.g. on a 2x2 grid the indices would be:
      * | 3 | 4 |
      * | 1 | 2 |
      * This is how the ESMF remapping files index points.
      * This is kept sorted for performance reasons. */
-    vector<point_t> points;
+    counted_vector<point_t, MEMORY_TILES> points;
+    /* The local index of each entry in points. Local arrays hold the blocks
+     * one after the other, each block in row-major order. With a single block
+     * this is just 0, 1, 2, ... */
+    counted_vector<point_t, MEMORY_TILES> local_indices;
 
     /* Global extent domain that this tile is a part of. */
     unsigned int gis, gie, gjs, gje;
 
 public:
-    Tile(tile_id_t tile_id, int lis, int lie, int ljs, int lje,
+    Tile(tile_id_t tile_id, const vector<Block>& blocks,
          int gis, int gie, int gjs, int gje);
     point_t global_to_local_domain(point_t global) const;
-    const vector<point_t>& get_points(void) const { return points; }
+    const counted_vector<point_t, MEMORY_TILES>& get_points(void) const
+        { return points; }
+    const counted_vector<point_t, MEMORY_TILES>& get_local_indices(void) const
+        { return local_indices; }
+    const vector<Block>& get_blocks(void) const { return blocks; }
     bool domain_equal(const shared_ptr<Tile>& another_tile) const;
     tile_id_t get_id(void) const { return id; }
     bool has_point(point_t p) const
@@ -48,7 +83,14 @@ public:
             /* Since points is sorted we can do this. */
             return binary_search(points.begin(), points.end(), p);
         }
-    void pack(int *box, size_t size);
+    void pack(vector<int>& box) const;
+    static shared_ptr<Tile> unpack(const int *box, size_t *size);
+    Tile *with_blocks(const vector<Block>& new_blocks) const;
+    FieldLayout halo_layout(unsigned int halo_i, unsigned int halo_j,
+                            bool i_fastest = false) const;
+    bool get_layout_offsets(const FieldLayout& layout,
+                            counted_vector<point_t, MEMORY_TILES>& offsets)
+        const;
 };
 
 /* This represents a mapping between the local tile (proc) to a remote tile in
@@ -58,22 +100,57 @@ public:
 class Mapping {
 private:
 
+    /* Everything below is counted as MEMORY_MAPPINGS. */
+    typedef pair<point_t, weight_t> Link;
+    typedef set<Link, less<Link>,
+                CountingAllocator<Link, MEMORY_MAPPINGS> > Links;
+
     shared_ptr<Tile> remote_tile;
 
     /* Ordered set of 'side A' points in the mapping. They are the keys to the map
      * below. It's a convenience and also provides necessary ordering. */
-    set<point_t> side_A_points;
+    set<point_t, less<point_t>,
+        CountingAllocator<point_t, MEMORY_MAPPINGS> > side_A_points;
 
     /* This map represents a graph structure. It maps individial 'side A'
      * points to a list of peer points ('side B' points) with an associated
      * weight. The ordering of the side B points is the order in which the
      * weights get applied. The ordering is for numerical consistency. */
 #if defined(IMPROVED_RUNTIME_SPEED)
-    vector< set< pair<point_t, weight_t> > > side_A_to_B_map;
+    counted_vector<Links, MEMORY_MAPPINGS> side_A_to_B_map;
 #else
-    unordered_map<point_t, set< pair<point_t, weight_t> > > side_A_to_B_map;
+    unordered_map<point_t, Links, hash<point_t>, equal_to<point_t>,
+                  CountingAllocator<pair<const point_t, Links>,
+                                    MEMORY_MAPPINGS> > side_A_to_B_map;
 #endif
 
+    const Links& get_side_B(point_t p) const;
+    template <typename Index>
+    void apply_buckets(const double *side_B_values, double *rows_out,
+                       unsigned int first_row, unsigned int end_row,
+                       bool generic, Index index) const;
+
+    /* The links in sliced ELLPACK form, made from the above by compile().
+     * Row r is the r'th value in a message and goes to side A point
+     * rows[r]. Rows with the same number of links are next to each other
+     * and make up a bucket. Within a bucket the k'th link of every row comes
+     * before the k+1'th, so that a kernel can work on many rows at once. */
+    struct Bucket {
+        unsigned int width;
+        unsigned int first_row;
+        unsigned int num_rows;
+        /* Of the first link in cols and weights. */
+        size_t offset;
+    };
+    counted_vector<point_t, MEMORY_MAPPINGS> rows;
+    counted_vector<Bucket, MEMORY_MAPPINGS> buckets;
+    counted_vector<point_t, MEMORY_MAPPINGS> cols;
+    counted_vector<weight_t, MEMORY_MAPPINGS> weights;
+
+    /* The last message that went through this mapping, for delta
+     * compression. */
+    XorHistory history;
+
 public:
     Mapping(shared_ptr<Tile> remote_tile) : remote_tile(remote_tile) {}
     void add_link(point_t side_A_point, point_t side_B_point, weight_t weight)
@@ -90,56 +167,101 @@ public:
         }
     const shared_ptr<Tile>&  get_remote_tile(void) const { return remote_tile; }
 
-    const set<point_t>& get_side_A_points(void) const { return side_A_points; }
-    const set< pair<point_t, weight_t> >& get_side_B(point_t p) const
+    void compile(void);
+    unsigned int get_num_points(void) const { return rows.size(); }
+    unsigned int get_num_links(void) const { return cols.size(); }
+    const counted_vector<point_t, MEMORY_MAPPINGS>& get_rows(void) const
+        { return rows; }
+    void apply_rows(const double *side_B_values, double *rows_out,
+                    unsigned int first_row, unsigned int end_row,
+                    const point_t *offsets = nullptr,
+                    bool generic = false) const;
+    /* All the rows, see apply_rows(). */
+    void apply(const double *side_B_values, double *rows_out,
+               bool generic = false, const point_t *offsets = nullptr) const
         {
-#if defined(IMPROVED_RUNTIME_SPEED)
-            return side_A_to_B_map[p];
-#else
-            auto it = side_A_to_B_map.find(p);
-            assert(it != side_A_to_B_map.end());
-            return it->second;
-#endif
+            apply_rows(side_B_values, rows_out, 0, rows.size(), offsets,
+                       generic);
         }
 
-    bool not_in_use(void) const { return side_A_points.empty(); }
+    XorHistory& get_history(void) { return history; }
+    bool not_in_use(void) const
+        { return side_A_points.empty() && rows.empty(); }
     tile_id_t get_remote_tile_id(void) const { return remote_tile->get_id(); }
 };
 
+/* The remapping weights between two grids, see Config::read_weights(). */
+struct RemapWeights {
+    counted_vector<unsigned int, MEMORY_WEIGHTS> src_points;
+    counted_vector<unsigned int, MEMORY_WEIGHTS> dest_points;
+    counted_vector<double, MEMORY_WEIGHTS> weights;
+};
+
+/* Packed descriptions of the tiles of every grid on every proc, keyed by
+ * grid name. See Tile::pack(). */
+typedef unordered_map<string, list<vector<int> > > TileDescriptions;
+
 class Router {
 private:
 
     unique_ptr<Tile> local_tile;
     const Config& config;
 
-    int num_ranks;
+    /* Every grid in the coupled system is numbered, the numbering is the same
+     * on all procs. It is used to keep apart messages between different pairs
+     * of grids, e.g. when two components share a proc. */
+    unordered_map<string, int> grid_ids;
 
     /* Mappings that the local_tile participates in. */
     unordered_map<string, list<shared_ptr<Mapping> > > send_mappings;
     unordered_map<string, list<shared_ptr<Mapping> > > recv_mappings;
 
+    /* All the tiles of the grids that we communicate with, including those
+     * without a mapping, in case the local tile changes. */
+    unordered_map<string, list<shared_ptr<Tile> > > peer_tiles;
+
+    /* Weights to and from each peer grid, see get_weights(). */
+    unordered_map<string, RemapWeights> send_weights;
+    unordered_map<string, RemapWeights> recv_weights;
+    const RemapWeights& get_weights(string grid, bool send);
+    void clear_weights(void);
+
+    void check_local_tile(void) const;
     void remove_unused_mappings(void);
+    void compile_mappings(void);
     bool is_peer_grid(string grid);
     bool is_send_grid(string grid);
     bool is_recv_grid(string grid);
 
-    void add_link_to_send_mapping(string grid, point_t src_point,
-                                  point_t dest_point, weight_t weight);
-    void add_link_to_recv_mapping(string grid, point_t src_point,
-                                  point_t dest_point, weight_t weight);
+    void add_links(string grid, list<shared_ptr<Mapping> >& mappings,
+                   bool send);
 
     void create_send_mapping(string grid, shared_ptr<Tile> t);
     void create_recv_mapping(string grid, shared_ptr<Tile> t);
+    void create_mappings(const TileDescriptions& descriptions);
 
 public:
-    Router(const Config& config,
-           unsigned int lis, unsigned int lie, unsigned int ljs,
-           unsigned int lje, unsigned int gis, unsigned int gie,
+    Router(const Config& config, tile_id_t tile_id, const vector<Block>& blocks,
+           unsigned int gis, unsigned int gie,
            unsigned int gjs, unsigned int gje);
-    void build_routing_rules(void);
-    void exchange_descriptions(void);
+    void build_routing_rules(const TileDescriptions& descriptions);
+    bool set_local_blocks(const vector<Block>& blocks);
+    void update_routing_rules(const TileDescriptions& changed,
+                              bool local_changed);
+    static void exchange_descriptions(Transport& transport,
+                                      const list<Router *>& local_routers,
+                                      TileDescriptions& descriptions);
     int get_tile_id(void) const
         { assert(local_tile != nullptr); return local_tile->get_id(); }
+    string get_local_grid(void) const { return config.get_local_grid(); }
+    int get_message_tag(string src_grid, string dest_grid) const;
+    static int get_bundle_tag(void);
+    static int get_trace_tag(void);
+    int get_aggregate_tag(string src_grid, string dest_grid) const;
+    int get_num_grids(void) const { return grid_ids.size(); }
+    int get_grid_id(string grid) const;
+    string get_grid_name(int id) const;
+    void get_traffic(vector<int>& entries) const;
     const list<shared_ptr<Mapping> >& get_send_mappings(string grid) const
         {
             auto v = send_mappings.find(grid);
@@ -152,4 +274,6 @@ public:
             assert(v != recv_mappings.end());
             return v->second;
         }
+    const Tile& get_local_tile(void) const
+        { assert(local_tile != nullptr); return *local_tile; }
 };
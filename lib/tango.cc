@@ -1,19 +1,57 @@
 
 #include <mpi.h>
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "tango.h"
 #include "tango_internal.h"
 #include "router.h"
-
-#define TANGO_TAG 0x7A960
+#include "accounting.h"
+#include "compression.h"
+#include "report.h"
 
 using namespace std;
 
-static Transfer *transfer;
-static Router *router;
-static Config *config;
+/* The context of the calling thread. By default all threads share a single
+ * context which uses MPI. When threads act as ranks each has its own. */
+static thread_local Context *context = nullptr;
+static Context *mpi_context = nullptr;
+
+/* Protects the creation of mpi_context. */
+static mutex mpi_context_lock;
+
+/* Shared by all threads acting as ranks, see tango_thread_rank_init(). */
+static mutex thread_world_lock;
+static ThreadWorld *thread_world = nullptr;
+static int thread_world_users = 0;
+
+static Context *get_context(void)
+{
+    if (context == nullptr) {
+        lock_guard<mutex> guard(mpi_context_lock);
+        if (mpi_context == nullptr) {
+            mpi_context = new Context(new MpiTransport());
+        }
+        context = mpi_context;
+    }
+    return context;
+}
+
+static void start_progress_thread(Context *ctx);
+static void init_node_aggregation(Context *ctx);
+
+/* Masks given with tango_set_mask(), these are handed to the config in
+ * tango_init(). */
+static thread_local unordered_map<string, vector<bool> > api_masks;
 
 /* FIXME: Need to force user to use API according to the config file. */
 
@@ -30,43 +68,501 @@ void tango_init(const char *config_dir, const char *grid_name,
                unsigned int gis, unsigned int gie,
                unsigned int gjs, unsigned int gje)
 {
-    transfer = nullptr;
+    unsigned int block[] = {lis, lie, ljs, lje};
+
+    tango_init_blocks(config_dir, grid_name, 1, block, gis, gie, gjs, gje);
+}
+
+/* As above but the local domain is made up of several blocks. blocks holds
+ * lis, lie, ljs, lje for each block. Local fields passed to tango_put() and
+ * tango_get() hold the blocks one after the other, in the order given here,
+ * each block in the same layout as a single block domain. Data going to the
+ * same remote proc from all blocks is sent as one message. */
+void tango_init_blocks(const char *config_dir, const char *grid_name,
+                       unsigned int num_blocks, const unsigned int blocks[],
+                       /* Global domain */
+                       unsigned int gis, unsigned int gie,
+                       unsigned int gjs, unsigned int gje)
+{
+    tango_add_component(config_dir, grid_name, num_blocks, blocks,
+                        gis, gie, gjs, gje);
+    tango_init_components();
+}
+
+/* Add a component (i.e. a grid) to this process. This does not communicate,
+ * once all components in the process have been added call
+ * tango_init_components(). Arguments are as for tango_init_blocks(). */
+void tango_add_component(const char *config_dir, const char *grid_name,
+                         unsigned int num_blocks, const unsigned int blocks[],
+                         /* Global domain */
+                         unsigned int gis, unsigned int gie,
+                         unsigned int gjs, unsigned int gje)
+{
+    Context *ctx = get_context();
+    int64_t start = trace_now();
+
+    for (const auto& c : ctx->components) {
+        if (c->config->get_local_grid() == string(grid_name)) {
+            cerr << "Error: component " << grid_name
+                 << " has already been added." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
 
-    config = new Config(string(config_dir), string(grid_name));
+    Config *config = new Config(string(config_dir), string(grid_name));
     config->parse_config();
-    config->read_grid_info();
 
-    router = new Router(*config, lis, lie, ljs, lje, gis, gie, gjs, gje);
+    /* The first component that asks for a trace starts it, so this is
+     * recorded after the fact. */
+    if (ctx->tracer == nullptr && !config->get_trace().empty()) {
+        ctx->tracer = new Tracer(config->get_trace(),
+                                 config->get_trace_events());
+    }
+    if (ctx->tracer != nullptr) {
+        ctx->tracer->record("parse_config", start, trace_now(), grid_name);
+    }
+
+    /* Masks passed through the API override those from config.yaml. */
+    for (const auto& kv : api_masks) {
+        config->set_mask(kv.first, kv.second);
+    }
+
+    {
+        TraceScope scope(ctx->tracer, "read_grid_info", grid_name);
+        config->read_grid_info();
+    }
+
+    vector<Block> local_blocks(num_blocks);
+    for (unsigned int i = 0; i < num_blocks; i++) {
+        const unsigned int *b = &blocks[4 * i];
+        local_blocks[i] = {b[0], b[1], b[2], b[3]};
+    }
+
+    TraceScope scope(ctx->tracer, "create_router", grid_name);
+    Router *router = new Router(*config, ctx->transport->get_rank(),
+                                local_blocks, gis, gie, gjs, gje);
+    ctx->components.push_back(new Component(config, router));
+}
+
+/* Set up the routing for all the components in this process. This is
+ * collective over all procs. Afterwards the first component added is the
+ * current one, see tango_set_component(). */
+void tango_init_components(void)
+{
+    Context *ctx = get_context();
+    list<Router *> routers;
+    TileDescriptions descriptions;
+
+    api_masks.clear();
+
+    for (const auto& c : ctx->components) {
+        routers.push_back(c->router);
+    }
+
+    /* Tracing is collective, so every proc needs to know if any traces. */
+    vector<int> tracing = {ctx->tracer != nullptr}, all_tracing, sizes;
+    ctx->transport->allgatherv(tracing, all_tracing, sizes);
+    ctx->tracing = count(all_tracing.begin(), all_tracing.end(), 1) > 0;
+    if (ctx->tracing) {
+        TraceScope scope(ctx->tracer, "sync_clocks");
+        Tracer::sync_clocks(*ctx->transport, ctx->tracer,
+                            Router::get_trace_tag());
+    }
+
+    {
+        TraceScope scope(ctx->tracer, "exchange_descriptions");
+        Router::exchange_descriptions(*ctx->transport, routers, descriptions);
+    }
+    for (const auto& r : routers) {
+        TraceScope scope(ctx->tracer, "build_routing_rules",
+                         r->get_local_grid());
+        r->build_routing_rules(descriptions);
+    }
+
+    /* Every proc takes part in the reports, asked for in config.yaml. */
+    string report, placement;
+    unsigned int ranks_per_node = 0;
+    for (const auto& c : ctx->components) {
+        if (report.empty()) {
+            report = c->config->get_traffic_report();
+        }
+        if (placement.empty()) {
+            placement = c->config->get_rank_placement();
+            ranks_per_node = c->config->get_ranks_per_node();
+        }
+    }
+    if (!report.empty()) {
+        TraceScope scope(ctx->tracer, "traffic_report");
+        write_traffic_report(*ctx->transport, routers, report);
+    }
+    if (!placement.empty()) {
+        TraceScope scope(ctx->tracer, "rank_placement");
+        write_rank_placement(*ctx->transport, routers, ranks_per_node,
+                             placement, ctx == mpi_context);
+    }
+
+    assert(!ctx->components.empty());
+
+    {
+        TraceScope scope(ctx->tracer, "node_aggregation");
+        init_node_aggregation(ctx);
+    }
+    start_progress_thread(ctx);
+}
+
+/* Make the component with grid_name the one that subsequent transfers apply
+ * to. This is only needed when there is more than one component in a
+ * process. */
+void tango_set_component(const char *grid_name)
+{
+    Context *ctx = get_context();
+
+    for (const auto& c : ctx->components) {
+        if (c->config->get_local_grid() == string(grid_name)) {
+            ctx->set_component(c);
+            return;
+        }
+    }
+
+    cerr << "Error: no component " << grid_name << " in this process."
+         << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+/* Set the land/sea mask of a grid. This must be called before tango_init() or
+ * tango_add_component().
+ * The mask covers the global domain of the grid and uses the SCRIP convention,
+ * a non-zero value means the point is active. Points that are not active are
+ * not coupled. All procs that couple with this grid need to use the same mask,
+ * so setting it in config.yaml is usually easier. */
+void tango_set_mask(const char *grid_name, const int mask[], int size)
+{
+    vector<bool>& m = api_masks[string(grid_name)];
+
+    m.resize(size);
+    for (int i = 0; i < size; i++) {
+        m[i] = (mask[i] != 0);
+    }
+}
+
+/* Change the local domain of the current component, e.g. when the model
+ * rebalances its decomposition. This is collective over all procs, those
+ * that don't change pass their current domain. Only the descriptions of
+ * tiles that have changed are exchanged and only the mappings to and from
+ * them are rebuilt, see Router::update_routing_rules(). The weights are read
+ * again unless cache_weights is set in config.yaml. There must be no
+ * transfer in progress. Arguments are as for tango_init(). */
+void tango_redecompose(unsigned int lis, unsigned int lie,
+                       unsigned int ljs, unsigned int lje)
+{
+    unsigned int block[] = {lis, lie, ljs, lje};
+
+    tango_redecompose_blocks(1, block);
+}
+
+/* As above with several blocks, see tango_init_blocks(). */
+void tango_redecompose_blocks(unsigned int num_blocks,
+                              const unsigned int blocks[])
+{
+    Context *ctx = get_context();
+    Component *component = ctx->get_component();
+    assert(component != nullptr);
+
+    vector<Block> local_blocks(num_blocks);
+    for (unsigned int i = 0; i < num_blocks; i++) {
+        const unsigned int *b = &blocks[4 * i];
+        local_blocks[i] = {b[0], b[1], b[2], b[3]};
+    }
+
+    for (const auto& c : ctx->components) {
+        lock_guard<mutex> guard(c->lock);
+        for (const auto& kv : c->get_all_epochs()) {
+            if (kv.second->in_progress) {
+                cerr << "Error: tango_redecompose() called during a "
+                     << "transfer." << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+
+        /* Lagged receives and node aggregation are set up for the
+         * mappings made at initialisation. */
+        bool lagged = false;
+        for (const auto& grid : c->config->get_send_grids()) {
+            lagged = lagged || c->config->is_send_lagged(grid);
+        }
+        for (const auto& grid : c->config->get_recv_grids()) {
+            lagged = lagged || c->config->is_recv_lagged(grid);
+        }
+        if (lagged || c->node_comm != MPI_COMM_NULL) {
+            cerr << "Error: tango_redecompose() doesn't work with lag or "
+                 << "node_aggregation." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    bool local_changed = component->router->set_local_blocks(local_blocks);
+    if (local_changed) {
+        /* Sums over the old domain are no use. */
+        for (const auto& kv : component->accumulated_steps) {
+            if (kv.second != 0) {
+                cerr << "Error: tango_redecompose() called part way through "
+                     << "a coupling interval." << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        component->accumulators.clear();
+        component->layouts.clear();
+    }
+
+    list<Router *> changed_routers;
+    if (local_changed) {
+        changed_routers.push_back(component->router);
+    }
+    TileDescriptions changed;
+    Router::exchange_descriptions(*ctx->transport, changed_routers, changed);
+
+    for (const auto& c : ctx->components) {
+        c->router->update_routing_rules(changed,
+                                        local_changed && c == component);
+    }
+}
+
+/* Free the buffers of any sends of c that have completed. This doesn't
+ * block, see wait_for_sends() for where sends are waited for. */
+static void progress_component(Context *ctx, Component *c)
+{
+    lock_guard<mutex> guard(c->lock);
+
+    if (c->pending_sends.empty()) {
+        return;
+    }
+
+    vector<SendRequest *> requests;
+    for (const auto& ps : c->pending_sends) {
+        requests.push_back(ps.request);
+    }
+
+    ctx->transport->test_some(requests);
+
+    auto it = c->pending_sends.begin();
+    for (const auto& r : requests) {
+        if (r == nullptr) {
+            delete_buffer(it->buffer);
+            it = c->pending_sends.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* Wait for and free the sends of c for which waiting(send) is true. Other
+ * threads can carry on with the component while this one waits. */
+template <typename Pred>
+static void wait_for_sends(Context *ctx, Component *c, Pred waiting)
+{
+    list<PendingSend> sends;
+
+    {
+        lock_guard<mutex> guard(c->lock);
+        auto it = c->pending_sends.begin();
+        while (it != c->pending_sends.end()) {
+            auto ps = it++;
+            if (waiting(*ps)) {
+                sends.splice(sends.end(), c->pending_sends, ps);
+            }
+        }
+    }
+
+    for (auto &ps : sends) {
+        ctx->transport->wait(ps.request);
+        delete_buffer(ps.buffer);
+    }
+}
+
+static void complete_comms(Context *ctx, Component *c)
+{
+    for (auto &ps : c->pending_sends) {
+        ctx->transport->wait(ps.request);
+        delete_buffer(ps.buffer);
+    }
+    c->pending_sends.clear();
+}
+
+/* Transfers can be done from several threads at once, each thread has its
+ * own epoch. With MPI this needs MPI_THREAD_MULTIPLE. The component lock must
+ * be held. */
+static void check_concurrent_epochs(Context *ctx, Component *component)
+{
+    if (ctx != mpi_context) {
+        return;
+    }
+
+    for (const auto& kv : component->get_all_epochs()) {
+        Epoch *other = kv.second;
+
+        if (kv.first == this_thread::get_id() || other == nullptr ||
+            !other->in_progress) {
+            continue;
+        }
+
+        int provided;
+        MPI_Query_thread(&provided);
+        if (provided < MPI_THREAD_MULTIPLE) {
+            cerr << "Error: transfers from several threads at once need "
+                 << "MPI to be initialised with MPI_THREAD_MULTIPLE." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        /* The ranks on a node would get their collectives mixed up. */
+        if (component->node_comm != MPI_COMM_NULL) {
+            cerr << "Error: node_aggregation can't be used with transfers "
+                 << "from several threads at once." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
 }
 
-static void complete_comms(void)
+/* Two threads can't transfer with the same grid at the same time since their
+ * messages would get mixed up. The component lock must be held. */
+static void check_peer_in_use(Component *component, const string& peer_grid)
 {
-    if (transfer != nullptr) {
-        /* A transfer object can be left over from a previous tango call. In
-         * that case the MPI comms are not complete. */
-        for (auto &ps : transfer->pending_sends) {
-            MPI_Wait(ps.request, MPI_STATUS_IGNORE);
-            delete ps.request;
-            delete[] ps.buffer;
+    for (const auto& kv : component->get_all_epochs()) {
+        Epoch *other = kv.second;
+
+        if (kv.first == this_thread::get_id() || other == nullptr ||
+            !other->in_progress) {
+            continue;
         }
-        delete transfer;
-        transfer = nullptr;
+
+        for (const auto& t : other->transfers) {
+            if (t->get_peer_grid() == peer_grid) {
+                cerr << "Error: another thread is already doing a transfer "
+                     << "with " << peer_grid << " grid." << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+    }
+}
+
+static void begin_epoch(const char *timestamp, const string& grid)
+{
+    Context *ctx = get_context();
+    Component *component = ctx->get_component();
+    Epoch *previous;
+
+    assert(component != nullptr);
+
+    /* Some callers don't bother with a timestamp. */
+    if (timestamp == nullptr) {
+        timestamp = "";
+    }
+    TraceScope scope(ctx->tracer, "begin_transfer",
+                     grid + " " + timestamp);
+
+    /* An epoch can be left over from a previous tango call. */
+    {
+        lock_guard<mutex> guard(component->lock);
+        Epoch *& e = component->get_all_epochs()[this_thread::get_id()];
+        previous = e;
+        e = nullptr;
     }
+    delete previous;
+
+    /* A sender waits for the sends of its previous transfer so that it is
+     * never more than one transfer ahead of its receivers, otherwise the
+     * send buffers pile up. Sends with a lag are waited for in
+     * send_transfer(). */
+    wait_for_sends(ctx, component, [](const PendingSend& ps) {
+        return ps.owner == this_thread::get_id() && ps.lagged_peer.empty();
+    });
+    progress_component(ctx, component);
+
+    Epoch *epoch = new Epoch(timestamp, grid);
+
+    lock_guard<mutex> guard(component->lock);
+    check_concurrent_epochs(ctx, component);
+    component->get_all_epochs()[this_thread::get_id()] = epoch;
 }
 
+/* Start a transfer with grid. Each thread has its own transfer, so several
+ * threads can transfer with different grids at the same time. With MPI this
+ * needs MPI_THREAD_MULTIPLE. The setup and teardown calls are not thread
+ * safe. */
 void tango_begin_transfer(const char* timestamp, const char* grid)
 {
-    complete_comms();
-    transfer = new Transfer(timestamp, string(grid));
+    begin_epoch(timestamp, string(grid));
+}
+
+/* Start a transfer with several grids. Fields are put and got with
+ * tango_put_to() and tango_get_from(), which say which grid they go to or
+ * come from. Everything is sent together at tango_end_transfer(), with the
+ * data for different grids that goes to the same remote proc merged into one
+ * message. The gets are done after all the sends. */
+void tango_begin_multi_transfer(const char* timestamp)
+{
+    begin_epoch(timestamp, "");
+}
+
+/* The epoch of the calling thread, which must have been started. */
+static Epoch *current_epoch(Component *component)
+{
+    Epoch *epoch = component->get_epoch();
+
+    if (epoch == nullptr || !epoch->in_progress) {
+        cerr << "Error: no transfer has been started, call "
+             << "tango_begin_transfer() first." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return epoch;
+}
+
+/* The grid given to tango_begin_transfer(). */
+static string default_peer_grid(const Epoch *epoch)
+{
+    if (epoch->get_peer_grid().empty()) {
+        cerr << "Error: a transfer started with tango_begin_multi_transfer() "
+             << "needs tango_put_to() and tango_get_from()." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return epoch->get_peer_grid();
+}
+
+/* The transfer of epoch with grid in the given direction, it is created the
+ * first time it is used. */
+static Transfer *get_transfer(Component *component, Epoch *epoch,
+                              const string& grid, bool send)
+{
+    Transfer *transfer = epoch->find_transfer(grid, send);
+
+    if (transfer == nullptr) {
+        lock_guard<mutex> guard(component->lock);
+        check_peer_in_use(component, grid);
+        transfer = new Transfer(epoch->get_time(), grid, send);
+        epoch->transfers.push_back(transfer);
+    }
+    return transfer;
 }
 
 /* Use int instead of size_t here to suite Fortran interfaces. */
 void tango_put(const char *field_name, double array[], int size)
 {
+    tango_put_ensemble(field_name, array, size, 1);
+}
+
+void tango_get(const char *field_name, double array[], int size)
+{
+    tango_get_ensemble(field_name, array, size, 1);
+}
+
+static void put_field(Component *component, Epoch *epoch, const string& grid,
+                      const char *field_name, double array[], int size,
+                      int num_members, const point_t *offsets = nullptr)
+{
+    TraceScope scope(get_context()->tracer, "put", field_name);
     string field = string(field_name);
+    Transfer *transfer = get_transfer(component, epoch, grid, true);
+    Config *config = component->config;
 
-    assert(transfer != NULL);
-    assert(transfer->total_recv_size == 0);
     if (!config->can_send_field_to_grid(field,
                                         transfer->get_peer_grid())) {
         cerr << "Error: according to config.yaml field " << field
@@ -74,6 +570,11 @@ void tango_put(const char *field_name, double array[], int size)
              << " grid" << endl;
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    if (transfer->accumulating) {
+        cerr << "Error: can't put and accumulate in the same transfer."
+             << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
     /* Check that the field size is correct. */
     /*
@@ -85,16 +586,125 @@ void tango_put(const char *field_name, double array[], int size)
     }
     */
 
-    transfer->total_send_size += size;
-    transfer->fields.push_back(Field(array, size));
+    double tolerance = config->get_tolerance(field, transfer->get_peer_grid());
+    double relative_tolerance =
+        config->get_relative_tolerance(field, transfer->get_peer_grid());
+    if (tolerance > 0 || relative_tolerance > 0) {
+        transfer->lossy = true;
+    }
+
+    assert(num_members > 0);
+    transfer->total_size += size * num_members;
+    transfer->total_members += num_members;
+    transfer->fields.push_back(Field(array, size, num_members, tolerance,
+                                     relative_tolerance, offsets));
 }
 
-void tango_get(const char *field_name, double array[], int size)
+/* Put a field for several ensemble members at once. The members are stored
+ * one after the other in array and each has size points. All members share the
+ * routing tables and are sent in the same message to each remote tile. */
+void tango_put_ensemble(const char *field_name, double array[], int size,
+                        int num_members)
+{
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
+
+    put_field(component, epoch, default_peer_grid(epoch), field_name, array,
+              size, num_members);
+}
+
+/* Put a field to grid in a transfer started with
+ * tango_begin_multi_transfer(). */
+void tango_put_to(const char *grid, const char *field_name, double array[],
+                  int size)
+{
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
+
+    put_field(component, epoch, string(grid), field_name, array, size, 1);
+}
+
+/* Add a field to a running sum kept by Tango, instead of putting it. The sum
+ * is only sent every coupling_interval transfers, as set for the mapping in
+ * config.yaml, and the average over the interval is what gets sent. Until
+ * then tango_end_transfer() doesn't communicate. The weights are applied once
+ * per interval. All fields of a transfer must be accumulated, and the same
+ * fields must be accumulated each time. The receiver does a normal get, once
+ * per interval. */
+void tango_accumulate(const char *field_name, double array[], int size)
+{
+    TraceScope scope(get_context()->tracer, "accumulate", field_name);
+    string field = string(field_name);
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
+    Transfer *transfer = get_transfer(component, epoch,
+                                      default_peer_grid(epoch), true);
+    Config *config = component->config;
+
+    if (!config->can_send_field_to_grid(field,
+                                        transfer->get_peer_grid())) {
+        cerr << "Error: according to config.yaml field " << field
+             << " can't be put to " << transfer->get_peer_grid()
+             << " grid" << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (!transfer->fields.empty() && !transfer->accumulating) {
+        cerr << "Error: can't put and accumulate in the same transfer."
+             << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    transfer->accumulating = true;
+
+    Accumulator *acc;
+    {
+        lock_guard<mutex> guard(component->lock);
+        /* References to elements stay valid as others are added. */
+        acc = &component->accumulators[transfer->get_peer_grid() + ":" + field];
+    }
+
+    if (acc->sum.empty()) {
+        acc->sum.assign(size, 0);
+    } else if (acc->sum.size() != (size_t)size) {
+        cerr << "Error: size of " << field << " changed from "
+             << acc->sum.size() << " to " << size
+             << " during accumulation." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (!transfer->get_time().empty() &&
+        transfer->get_time() == acc->last_time) {
+        cerr << "Error: " << field << " has already been accumulated at "
+             << transfer->get_time() << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    acc->last_time = transfer->get_time();
+
+    for (int i = 0; i < size; i++) {
+        acc->sum[i] += array[i];
+    }
+
+    double tolerance = config->get_tolerance(field, transfer->get_peer_grid());
+    double relative_tolerance =
+        config->get_relative_tolerance(field, transfer->get_peer_grid());
+    if (tolerance > 0 || relative_tolerance > 0) {
+        transfer->lossy = true;
+    }
+
+    transfer->total_size += size;
+    transfer->total_members += 1;
+    transfer->fields.push_back(Field(acc->sum.data(), size, 1, tolerance,
+                                     relative_tolerance));
+}
+
+static void get_field(Component *component, Epoch *epoch, const string& grid,
+                      const char *field_name, double array[], int size,
+                      int num_members, const point_t *offsets = nullptr)
 {
+    TraceScope scope(get_context()->tracer, "get", field_name);
     string field = string(field_name);
+    Transfer *transfer = get_transfer(component, epoch, grid, false);
+    Config *config = component->config;
 
-    assert(transfer != nullptr);
-    assert(transfer->total_send_size == 0);
     if (!config->can_recv_field_from_grid(field,
                                           transfer->get_peer_grid())) {
         cerr << "Error: according to config.yaml field " << field
@@ -113,144 +723,1301 @@ void tango_get(const char *field_name, double array[], int size)
     }
     */
 
+    /* The sender decides how much error there is, but both sides need to
+     * know whether the message is compressed. */
+    if (config->get_tolerance(field, transfer->get_peer_grid()) > 0 ||
+        config->get_relative_tolerance(field, transfer->get_peer_grid()) > 0) {
+        transfer->lossy = true;
+    }
+
+    assert(num_members > 0);
+
     /* Zero the receive array. The get operation will add to the values in
-     * this. */
-    for (int i = 0; i < size; i++) {
-        array[i] = 0;
+     * this. Halos and anything else between the points are left alone. */
+    if (offsets == nullptr) {
+        for (int i = 0; i < size * num_members; i++) {
+            array[i] = 0;
+        }
+    } else {
+        for (int i = 0; i < size; i++) {
+            array[offsets[i]] = 0;
+        }
     }
 
-    transfer->total_recv_size += size;
-    transfer->fields.push_back(Field(array, size));
+    transfer->total_size += size * num_members;
+    transfer->total_members += num_members;
+    transfer->fields.push_back(Field(array, size, num_members, 0, 0,
+                                     offsets));
 }
 
-void tango_end_transfer()
+/* Get a field for several ensemble members at once, see
+ * tango_put_ensemble(). */
+void tango_get_ensemble(const char *field_name, double array[], int size,
+                        int num_members)
 {
-    unsigned int offset;
-
-    assert(transfer != nullptr);
-    /* Check that this is either all send or all receive. */
-    assert(transfer->total_send_size == 0 || transfer->total_recv_size == 0);
-    assert(transfer->total_send_size != 0 || transfer->total_recv_size != 0);
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
 
-    string peer_grid = transfer->get_peer_grid();
+    get_field(component, epoch, default_peer_grid(epoch), field_name, array,
+              size, num_members);
+}
 
-    /* We are the sender */
-    if (transfer->total_send_size != 0) {
-
-        /* Iterate over the mappings to other tiles that we have. */
-        for (const auto& mapping : router->get_send_mappings(peer_grid)) {
-
-            /* Presently we only support applying interpolation weights on the
-             * send side. At some point it may make sense to support receive
-             * side weighting also. The benefit of doing this depends on things
-             * such as the relative grid sizes and cost of moving data around.
-             * Ideally the grid sizes are roughtly matched in which case it
-             * makes no difference. */
-
-            /* What we do here is:
-             * 1) name the remote points as the 'side A' points. The 'A side'
-             * can expect all weights to have already been applied. Local
-             * points are side B.
-             *
-             * 2) Go through the remote points and for each one get the
-             * associated local points and weights.
-             *
-             * 3) The local points are then used as indices into the buffer
-             * being send, the weights are applied to these.
-             *
-             * 4) Send to remote tile associated with this mapping.
-             */
-
-            const auto &remote_points = mapping->get_side_A_points();
-
-            unsigned int count = remote_points.size() * transfer->fields.size();
-            double *send_buf = new double[count];
-
-            offset = 0;
-            for (const auto& field : transfer->fields) {
-                for (auto& rp : remote_points) {
-
-                    send_buf[offset] = 0;
-
-                    /* Get local points that correspond to this remote point
-                     * and apply weights. */
-                    for (const auto& lp_and_w : mapping->get_side_B(rp)) {
-                        point_t local_point = lp_and_w.first;
-                        double weight = lp_and_w.second;
+/* Get a field from grid in a transfer started with
+ * tango_begin_multi_transfer(). */
+void tango_get_from(const char *grid, const char *field_name, double array[],
+                    int size)
+{
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
 
-#if defined(DEBUG)
-                        assert(local_point < field.size);
-                        assert(offset < count);
-#endif
-                        send_buf[offset] += field.buffer[local_point] * weight;
-                    }
-                    offset++;
-                }
-            }
+    get_field(component, epoch, string(grid), field_name, array, size, 1);
+}
 
-            /* Now do the actual send to the remote tile associated with this
-             * mapping. */
-            MPI_Request *request = new MPI_Request;
-            MPI_Isend(send_buf, count, MPI_DOUBLE, mapping->get_remote_tile_id(),
-                      TANGO_TAG, MPI_COMM_WORLD, request);
+/* The offsets of the local points in an array with the given layout, see
+ * Tile::get_layout_offsets(). Also the number of points in size. */
+static const point_t *layout_offsets(Component *component,
+                                     const char *field_name,
+                                     const FieldLayout& layout, int *size)
+{
+    lock_guard<mutex> guard(component->lock);
+    auto it = component->layouts.find(layout);
 
-            /* Keep these, they need be freed later. */
-            transfer->pending_sends.push_back(PendingSend(request, send_buf));
+    if (it == component->layouts.end()) {
+        it = component->layouts.insert(make_pair(layout,
+                counted_vector<point_t, MEMORY_TILES>())).first;
+        const Tile& tile = component->router->get_local_tile();
+        if (!tile.get_layout_offsets(layout, it->second)) {
+            cerr << "Error: the layout of field " << field_name
+                 << " puts points at negative offsets or offsets too big "
+                 << "for Tango." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
+    }
+    *size = it->second.size();
+    return it->second.data();
+}
 
-    } else {
-        /* We are the receiver. We do a blocking receive. */
-
-        for (const auto& mapping : router->get_recv_mappings(peer_grid)) {
-
-            /* What we do here:
-             *
-             * 1) name the local points as the 'side A' points.
-             *
-             * 2) receive data from remote tile associated with this mapping.
-             *
-             * 3) the data comes in as a sequential array (of course) but each
-             * array element can refer to any local point, so the data has to
-             * be 'unboxed', i.e. loaded into the correct index of the receive
-             * field.
-             *
-             * 4) Since many mappings can contribute to a single point we use
-             * += to accumulate all incoming data for that point.
-             */
-
-            const auto& local_points = mapping->get_side_A_points();
-
-            unsigned int count = local_points.size() * transfer->fields.size();
-            double *recv_buf = new double[count];
-
-            MPI_Status status;
-            MPI_Recv(recv_buf, count, MPI_DOUBLE, mapping->get_remote_tile_id(),
-                     TANGO_TAG, MPI_COMM_WORLD, &status);
-
-            offset = 0;
-            for (const auto& field : transfer->fields) {
-                for (auto& lp : local_points) {
+/* Put a field straight from a model array that has more than just the points
+ * of the local domain, e.g. one with halos or a 3-D one of which this is a
+ * single level, instead of copying it into a dense array first. Point (i, j)
+ * of the local domain is array[offset + (i - is) * stride_i + (j - js) *
+ * stride_j], where is and js are the smallest lis and ljs of the local
+ * blocks. Nothing else in array is read. Tango doesn't know how long array
+ * is, so it can't check that the points are within it. */
+void tango_put_strided(const char *field_name, double array[], long offset,
+                       long stride_i, long stride_j)
+{
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
+    int size;
 
-#if defined(DEBUG)
-                    assert(lp < field.size);
-                    assert(offset < count);
-#endif
-                    field.buffer[lp] += recv_buf[offset];
-                    offset++;
-                }
-            }
+    const point_t *offsets = layout_offsets(component, field_name,
+                                            {offset, stride_i, stride_j},
+                                            &size);
+    put_field(component, epoch, default_peer_grid(epoch), field_name, array,
+              size, 1, offsets);
+}
 
-            delete[] recv_buf;
-        }
-    }
+/* Get a field straight into a model array, see tango_put_strided(). Only the
+ * points of the local domain are written. */
+void tango_get_strided(const char *field_name, double array[], long offset,
+                       long stride_i, long stride_j)
+{
+    Component *component = get_context()->get_component();
+    Epoch *epoch = current_epoch(component);
+    int size;
+
+    const point_t *offsets = layout_offsets(component, field_name,
+                                            {offset, stride_i, stride_j},
+                                            &size);
+    get_field(component, epoch, default_peer_grid(epoch), field_name, array,
+              size, 1, offsets);
 }
 
-void tango_finalize()
+static void put_halo(const char *field_name, double array[], int halo_i,
+                     int halo_j, bool i_fastest)
+{
+    Router *router = get_context()->get_component()->router;
+    FieldLayout layout = router->get_local_tile().halo_layout(halo_i, halo_j,
+                                                              i_fastest);
+
+    tango_put_strided(field_name, array, layout.offset, layout.stride_i,
+                      layout.stride_j);
+}
+
+static void get_halo(const char *field_name, double array[], int halo_i,
+                     int halo_j, bool i_fastest)
+{
+    Router *router = get_context()->get_component()->router;
+    FieldLayout layout = router->get_local_tile().halo_layout(halo_i, halo_j,
+                                                              i_fastest);
+
+    tango_get_strided(field_name, array, layout.offset, layout.stride_i,
+                      layout.stride_j);
+}
+
+/* As tango_put_strided() for an array that covers the local blocks with
+ * halo_i rows and halo_j columns of halo on each side, with j varying
+ * fastest, as for dense fields. */
+void tango_put_halo(const char *field_name, double array[], int halo_i,
+                    int halo_j)
+{
+    put_halo(field_name, array, halo_i, halo_j, false);
+}
+
+void tango_get_halo(const char *field_name, double array[], int halo_i,
+                    int halo_j)
+{
+    get_halo(field_name, array, halo_i, halo_j, false);
+}
+
+/* As tango_put_halo() with i varying fastest, as for a Fortran array
+ * a(isd:ied, jsd:jed). The Fortran tango_put_halo() and tango_get_halo() are
+ * these. */
+void tango_put_halo_column_major(const char *field_name, double array[],
+                                 int halo_i, int halo_j)
+{
+    put_halo(field_name, array, halo_i, halo_j, true);
+}
+
+void tango_get_halo_column_major(const char *field_name, double array[],
+                                 int halo_i, int halo_j)
 {
-    complete_comms();
-    assert(transfer == nullptr);
+    get_halo(field_name, array, halo_i, halo_j, true);
+}
+
+/* Lagged messages start with the timestamp, as a 32 bit length followed by
+ * the characters. */
+#define MAX_TIMESTAMP_LENGTH (256)
+
+/* Rows of a mapping that a thread packs or unpacks at a time. */
+#define ROWS_PER_CHUNK (4096u)
+
+/* Upper bound on the size, in bytes, of the data of a message sent as bytes,
+ * i.e. without any timestamp. n is the number of points in the mapping. */
+static size_t max_payload_size(const Transfer *transfer, bool compress,
+                               unsigned int n, unsigned int num_members)
+{
+    if (transfer->lossy) {
+        return num_members * quantize_compress_bound(n);
+    } else if (compress) {
+        return xor_compress_bound(n * num_members);
+    }
+    return n * num_members * sizeof(double);
+}
+
+/* Make a message to be sent as bytes from the packed data of a mapping,
+ * compressing it and adding the timestamp as needed. The message is kept in
+ * a buffer of doubles so it is freed like any other. size is set to its
+ * length in bytes. */
+static double *encode_message(const Transfer *transfer,
+                              const vector<Field>& members, Mapping& mapping,
+                              bool compress, bool lagged, const double *data,
+                              size_t& size)
+{
+    unsigned int n = mapping.get_num_points();
+    unsigned int count = n * members.size();
+    string time = transfer->get_time();
+
+    size_t header_size = 0;
+    if (lagged) {
+        if (time.size() > MAX_TIMESTAMP_LENGTH) {
+            cerr << "Error: timestamp " << time << " is too long." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        header_size = sizeof(uint32_t) + time.size();
+    }
+
+    size_t bound = header_size + max_payload_size(transfer, compress, n,
+                                                  members.size());
+    double *buf = new_buffer((bound / sizeof(double)) + 1,
+                             MEMORY_SEND_BUFFERS);
+    unsigned char *out = reinterpret_cast<unsigned char *>(buf);
+
+    if (lagged) {
+        uint32_t length = time.size();
+        memcpy(out, &length, sizeof(length));
+        memcpy(out + sizeof(length), time.data(), length);
+    }
+    size = header_size;
+
+    if (transfer->lossy) {
+        /* Lossy fields are compressed one member at a time, the rest are
+         * just stored. */
+        for (size_t m = 0; m < members.size(); m++) {
+            size += quantize_compress(data + (m * n), n, members[m].tolerance,
+                                      members[m].relative_tolerance,
+                                      out + size);
+        }
+    } else if (compress) {
+        size += xor_compress(data, count, mapping.get_history(), out + size);
+    } else {
+        memcpy(out + size, data, count * sizeof(double));
+        size += count * sizeof(double);
+    }
+
+    return buf;
+}
+
+/* The reverse of the above, for the data after any timestamp. */
+static void decode_message(const Transfer *transfer, Mapping& mapping,
+                           bool compress, const unsigned char *in, size_t size,
+                           double *data)
+{
+    unsigned int n = mapping.get_num_points();
+    unsigned int count = n * transfer->total_members;
+
+    if (transfer->lossy) {
+        size_t offset = 0;
+        for (size_t m = 0; m < transfer->total_members; m++) {
+            offset += quantize_decompress(in + offset, size - offset, n,
+                                          data + (m * n));
+        }
+        assert(offset == size);
+    } else if (compress) {
+        xor_decompress(in, size, count, mapping.get_history(), data);
+    } else {
+        if (size != count * sizeof(double)) {
+            cerr << "Error: expected message of " << count * sizeof(double)
+                 << " bytes but got " << size << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        memcpy(data, in, size);
+    }
+}
+
+/* Receive the data that was sent for the previous transfer through a
+ * mapping with a lag, and start receiving that of this transfer. At the first
+ * transfer there is no previous data and the result is all zeros. */
+static double *receive_lagged(Context *ctx, Component *component,
+                              const Transfer *transfer, Mapping& mapping,
+                              bool compress, int tag)
+{
+    unsigned int n = mapping.get_num_points();
+    unsigned int count = n * transfer->total_members;
+    double *data = new_buffer(count, MEMORY_RECV_BUFFERS, true);
+    LaggedReceive *lr;
+
+    {
+        lock_guard<mutex> guard(component->lock);
+        lr = &component->lagged_receives[&mapping];
+    }
+
+    if (lr->request != nullptr) {
+        size_t size = ctx->transport->wait_recv(lr->request);
+        lr->request = nullptr;
+
+        uint32_t length = 0;
+        if (size >= sizeof(length)) {
+            memcpy(&length, lr->buf.data(), sizeof(length));
+        }
+        if (size < sizeof(length) + length) {
+            cerr << "Error: bad lagged message of " << size << " bytes."
+                 << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        const unsigned char *in = lr->buf.data() + sizeof(length);
+        string time(reinterpret_cast<const char *>(in), length);
+        if (time != lr->time) {
+            cerr << "Error: expected data from " << lr->time
+                 << " but got data from " << time << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        decode_message(transfer, mapping, compress, in + length,
+                       size - sizeof(length) - length, data);
+    }
+
+    /* The data for this transfer is used next time. */
+    size_t max_size = sizeof(uint32_t) + MAX_TIMESTAMP_LENGTH +
+                      max_payload_size(transfer, compress, n,
+                                       transfer->total_members);
+    lr->buf.resize(max_size);
+    lr->time = transfer->get_time();
+    lr->request = ctx->transport->irecv_bytes(lr->buf.data(), max_size,
+                                              mapping.get_remote_tile_id(),
+                                              tag);
+    return data;
+}
+
+/* Ensemble members are laid out one after the other in the messages. Beyond
+ * that they are treated just like separate fields. */
+static vector<Field> get_members(const Transfer *transfer)
+{
+    vector<Field> members;
+
+    for (const auto& field : transfer->fields) {
+        for (unsigned int m = 0; m < field.num_members; m++) {
+            members.push_back(Field(field.buffer + (m * field.size), field.size,
+                                    1, field.tolerance,
+                                    field.relative_tolerance, field.offsets));
+        }
+    }
+    assert(members.size() == transfer->total_members);
+    return members;
+}
+
+/* Pack and send the fields of a transfer. Messages to remote procs are added
+ * to bundles, keyed by rank, except with a lag where they are sent right
+ * away. */
+static void send_transfer(Context *ctx, Component *component,
+                          Transfer *transfer,
+                          map<int, list<Segment> >& bundles,
+                          list<PendingSend>& pending_sends)
+{
+    Router *router = component->router;
+    string peer_grid = transfer->get_peer_grid();
+    string local_grid = router->get_local_grid();
+
+    /* Accumulated fields are only sent at the end of the interval, as an
+     * average. */
+    if (transfer->accumulating) {
+        unsigned int interval =
+            component->config->get_coupling_interval(peer_grid);
+        unsigned int steps;
+        {
+            lock_guard<mutex> guard(component->lock);
+            steps = ++component->accumulated_steps[peer_grid];
+            if (steps == interval) {
+                component->accumulated_steps[peer_grid] = 0;
+            }
+        }
+
+        if (steps < interval) {
+            return;
+        }
+
+        for (auto& field : transfer->fields) {
+            for (unsigned int i = 0; i < field.size; i++) {
+                field.buffer[i] /= interval;
+            }
+        }
+    }
+
+    vector<Field> members = get_members(transfer);
+
+    /* The mappings to other tiles that we have. */
+    const auto& mapping_list = router->get_send_mappings(peer_grid);
+    vector<shared_ptr<Mapping> > mappings(mapping_list.begin(),
+                                          mapping_list.end());
+    vector<double *> send_bufs(mappings.size());
+    /* Size in bytes of each message to a remote tile. */
+    vector<size_t> message_sizes(mappings.size());
+    bool compress = component->config->is_send_compressed(peer_grid);
+    bool lagged = component->config->is_send_lagged(peer_grid);
+    /* Otherwise messages are just the packed doubles. */
+    bool encode = compress || transfer->lossy || lagged;
+
+    /* A lagged message is received at the receiver's next transfer, so the
+     * previous one can still be on its way. Wait for any before that, so at
+     * most one lagged transfer is outstanding. */
+    unsigned int step = 0;
+    if (lagged) {
+        {
+            lock_guard<mutex> guard(component->lock);
+            step = component->lagged_sends[peer_grid]++;
+        }
+        wait_for_sends(ctx, component, [&](const PendingSend& ps) {
+            return ps.lagged_peer == peer_grid && ps.step + 1 < step;
+        });
+    }
+
+    int64_t pack_start = trace_now();
+
+    /* Presently we only support applying interpolation weights on the
+     * send side. At some point it may make sense to support receive
+     * side weighting also. The benefit of doing this depends on things
+     * such as the relative grid sizes and cost of moving data around.
+     * Ideally the grid sizes are roughtly matched in which case it
+     * makes no difference. */
+
+    /* What we do here is:
+     * 1) name the remote points as the 'side A' points. The 'A side'
+     * can expect all weights to have already been applied. Local
+     * points are side B.
+     *
+     * 2) Go through the remote points and for each one get the
+     * associated local points and weights.
+     *
+     * 3) The local points are then used as indices into the buffer
+     * being send, the weights are applied to these.
+     *
+     * 4) Send to remote tile associated with this mapping, see
+     * below.
+     */
+
+    /* The rows are in the order that the remote side expects, see
+     * Mapping::compile(). Every message holds n rows for each field member.
+     * The rows of each mapping are packed in chunks that are shared out over
+     * the thread team, so a transfer with only one peer tile still uses all
+     * the threads. Chunks write different rows, so the result doesn't depend
+     * on the number of threads. If we are already inside a parallel region,
+     * e.g. the model does transfers from several threads, it just runs on
+     * the calling thread. */
+    vector<pair<size_t, unsigned int> > chunks;
+    for (size_t i = 0; i < mappings.size(); i++) {
+        unsigned int n = mappings[i]->get_num_points();
+        unsigned int count = n * transfer->total_members;
+
+        send_bufs[i] = new_buffer(count, MEMORY_SEND_BUFFERS);
+        message_sizes[i] = count * sizeof(double);
+        for (unsigned int first = 0; first < n; first += ROWS_PER_CHUNK) {
+            chunks.push_back(make_pair(i, first));
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < chunks.size(); c++) {
+        const auto& mapping = mappings[chunks[c].first];
+        unsigned int n = mapping->get_num_points();
+        unsigned int first = chunks[c].second;
+        unsigned int end = min(first + ROWS_PER_CHUNK, n);
+        double *send_buf = send_bufs[chunks[c].first];
+
+        for (size_t m = 0; m < members.size(); m++) {
+            mapping->apply_rows(members[m].buffer, send_buf + (m * n), first,
+                                end, members[m].offsets);
+        }
+    }
+
+    /* Messages within this process are always plain doubles. */
+    if (encode) {
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < mappings.size(); i++) {
+            const auto& mapping = mappings[i];
+            if (mapping->get_remote_tile_id() == router->get_tile_id()) {
+                continue;
+            }
+
+            double *send_buf = send_bufs[i];
+            send_bufs[i] = encode_message(transfer, members, *mapping,
+                                          compress, lagged, send_buf,
+                                          message_sizes[i]);
+            delete_buffer(send_buf);
+        }
+    }
+    if (ctx->tracer != nullptr) {
+        ctx->tracer->record("pack", pack_start, trace_now(), peer_grid);
+    }
+
+    int tag = router->get_message_tag(local_grid, peer_grid);
+    int peer_id = router->get_grid_id(peer_grid);
+    for (size_t i = 0; i < mappings.size(); i++) {
+        const auto& mapping = mappings[i];
+        int remote_tile = mapping->get_remote_tile_id();
+
+        /* If the remote tile is in this process, i.e. belongs to
+         * another component, just hand over the buffer. */
+        if (remote_tile == router->get_tile_id()) {
+            ctx->put_local_message(local_grid, peer_grid, send_bufs[i]);
+            continue;
+        }
+
+        /* Lagged messages are received with their own tag, see
+         * receive_lagged(). */
+        if (lagged) {
+            SendRequest *request = ctx->transport->isend_bytes(
+                        reinterpret_cast<unsigned char *>(send_bufs[i]),
+                        message_sizes[i], remote_tile, tag);
+            pending_sends.push_back(PendingSend(request, send_bufs[i]));
+            pending_sends.back().lagged_peer = peer_grid;
+            pending_sends.back().step = step;
+            continue;
+        }
+
+        bundles[remote_tile].push_back(Segment(tag, peer_id, send_bufs[i],
+                                               message_sizes[i]));
+    }
+
+    /* Start the next interval. */
+    if (transfer->accumulating) {
+        for (auto& field : transfer->fields) {
+            fill(field.buffer, field.buffer + field.size, 0.0);
+        }
+    }
+}
+
+/* Send the messages going to each remote proc as one. A bundle starts with the
+ * number of segments, then each segment has its tag and size in bytes,
+ * followed by the data. */
+static void send_bundles(Context *ctx, map<int, list<Segment> >& bundles,
+                         list<PendingSend>& pending_sends)
+{
+    for (auto& kv : bundles) {
+        size_t size = sizeof(uint32_t);
+        for (const auto& seg : kv.second) {
+            size += sizeof(int32_t) + sizeof(uint32_t) + seg.size;
+        }
+
+        double *buf = new_buffer((size / sizeof(double)) + 1,
+                                 MEMORY_SEND_BUFFERS);
+        unsigned char *out = reinterpret_cast<unsigned char *>(buf);
+
+        uint32_t num_segments = kv.second.size();
+        memcpy(out, &num_segments, sizeof(num_segments));
+        size_t offset = sizeof(num_segments);
+        for (auto& seg : kv.second) {
+            int32_t tag = seg.tag;
+            uint32_t length = seg.size;
+            memcpy(out + offset, &tag, sizeof(tag));
+            offset += sizeof(tag);
+            memcpy(out + offset, &length, sizeof(length));
+            offset += sizeof(length);
+            memcpy(out + offset, seg.buffer, seg.size);
+            offset += seg.size;
+            delete_buffer(seg.buffer);
+        }
+        assert(offset == size);
+
+        SendRequest *request = ctx->transport->isend_bytes(out, size, kv.first,
+                                                   Router::get_bundle_tag());
+        pending_sends.push_back(PendingSend(request, buf));
+    }
+    bundles.clear();
+}
+
+/* Get the segment with tag from the bundles sent by rank. Bundles can hold
+ * segments for other transfers, e.g. of other components or threads, these
+ * are kept until they are asked for.
+ *
+ * Only one thread at a time receives from a rank. The others wait for it to
+ * unpack each bundle and then look for their segment again, so a thread
+ * whose segment has arrived never waits for the receiving thread's own
+ * message. When the receiver is done another waiting thread takes over. */
+static void take_segment(Context *ctx, int rank, int tag,
+                         RecvMessage& segment)
+{
+    string key = to_string(rank) + ":" + to_string(tag);
+    RecvMessage bundle;
+    unique_lock<mutex> lock(ctx->segments_lock);
+
+    while (true) {
+        auto& waiting = ctx->segments[key];
+        if (!waiting.empty()) {
+            segment.swap(waiting.front());
+            waiting.pop_front();
+            return;
+        }
+
+        if (ctx->receiving_ranks.count(rank) != 0) {
+            ctx->segments_ready.wait(lock);
+            continue;
+        }
+
+        ctx->receiving_ranks.insert(rank);
+        lock.unlock();
+        ctx->transport->recv_bytes(bundle, rank, Router::get_bundle_tag());
+        lock.lock();
+        ctx->receiving_ranks.erase(rank);
+
+        uint32_t num_segments = 0;
+        size_t offset = sizeof(num_segments);
+        if (bundle.size() >= offset) {
+            memcpy(&num_segments, bundle.data(), sizeof(num_segments));
+        }
+
+        for (uint32_t s = 0; s < num_segments; s++) {
+            int32_t seg_tag = 0;
+            uint32_t length = 0;
+            if (offset + sizeof(seg_tag) + sizeof(length) <= bundle.size()) {
+                memcpy(&seg_tag, bundle.data() + offset, sizeof(seg_tag));
+                offset += sizeof(seg_tag);
+                memcpy(&length, bundle.data() + offset, sizeof(length));
+                offset += sizeof(length);
+            }
+            if (offset + length > bundle.size()) {
+                cerr << "Error: bad message of " << bundle.size()
+                     << " bytes from rank " << rank << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+
+            const unsigned char *in = bundle.data() + offset;
+            ctx->segments[to_string(rank) + ":" + to_string(seg_tag)]
+                .push_back(RecvMessage(in, in + length));
+            offset += length;
+        }
+        ctx->segments_ready.notify_all();
+    }
+}
+
+/* With node aggregation the segments going to other nodes, counted as send
+ * buffers while they are gathered. The receiving side uses RecvMessage. */
+typedef counted_vector<unsigned char, MEMORY_SEND_BUFFERS> SendRecords;
+
+/* Gather bytes from all ranks of comm onto the first, one after the
+ * other. */
+template <typename Records>
+static void gather_bytes(MPI_Comm comm, const Records& data, Records& all)
+{
+    int rank, num_ranks, size = data.size();
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+    vector<int> sizes(num_ranks), displacements(num_ranks);
+
+    MPI_Gather(&size, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, comm);
+
+    int total = 0;
+    for (int r = 0; r < num_ranks; r++) {
+        displacements[r] = total;
+        total += sizes[r];
+    }
+    all.resize(rank == 0 ? total : 0);
+    MPI_Gatherv(data.data(), size, MPI_BYTE, all.data(), sizes.data(),
+                displacements.data(), MPI_BYTE, 0, comm);
+}
+
+/* The reverse of the above, the first rank gives parts[r] to rank r. */
+static void scatter_bytes(MPI_Comm comm, const vector<RecvMessage>& parts,
+                          RecvMessage& mine)
+{
+    int rank, num_ranks, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+    vector<int> sizes(num_ranks), displacements(num_ranks);
+    RecvMessage all;
+
+    if (rank == 0) {
+        assert(parts.size() == (size_t)num_ranks);
+        for (int r = 0; r < num_ranks; r++) {
+            sizes[r] = parts[r].size();
+            displacements[r] = all.size();
+            all.insert(all.end(), parts[r].begin(), parts[r].end());
+        }
+    }
+
+    MPI_Scatter(sizes.data(), 1, MPI_INT, &size, 1, MPI_INT, 0, comm);
+    mine.resize(size);
+    MPI_Scatterv(all.data(), sizes.data(), displacements.data(), MPI_BYTE,
+                 mine.data(), size, MPI_BYTE, 0, comm);
+}
+
+/* With node aggregation segments travel as records. Each has a header of
+ * the destination rank, source rank, tag, destination grid id and size in
+ * bytes, followed by the data. */
+#define RECORD_HEADER_INTS (5)
+
+template <typename Records>
+static void add_record(Records& out, const int32_t header[],
+                       const unsigned char *data)
+{
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(header);
+
+    out.insert(out.end(), h, h + (RECORD_HEADER_INTS * sizeof(int32_t)));
+    out.insert(out.end(), data, data + header[4]);
+}
+
+/* Read the record at offset in records and move offset past it. Returns
+ * the data. */
+template <typename Records>
+static const unsigned char *next_record(const Records& records,
+                                        size_t& offset, int32_t header[])
+{
+    size_t header_size = RECORD_HEADER_INTS * sizeof(int32_t);
+
+    if (offset + header_size > records.size()) {
+        cerr << "Error: bad aggregated message." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    memcpy(header, records.data() + offset, header_size);
+    offset += header_size;
+
+    if (header[4] < 0 || offset + header[4] > records.size()) {
+        cerr << "Error: bad aggregated message." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    const unsigned char *data = records.data() + offset;
+    offset += header[4];
+    return data;
+}
+
+/* Take the segments going to other nodes out of bundles and send them
+ * through the node leader. The leader sends one message to the leader of
+ * each destination grid on each destination node. This is collective over
+ * the ranks of the component on this node. */
+static void aggregate_sends(Context *ctx, Component *component,
+                            map<int, list<Segment> >& bundles,
+                            list<PendingSend>& pending_sends)
+{
+    Router *router = component->router;
+    int rank = ctx->transport->get_rank();
+    int node = ctx->rank_nodes[rank];
+    SendRecords mine, all;
+
+    for (auto it = bundles.begin(); it != bundles.end(); ) {
+        if (ctx->rank_nodes[it->first] == node) {
+            ++it;
+            continue;
+        }
+        for (const auto& seg : it->second) {
+            int32_t header[] = {it->first, rank, seg.tag, seg.dest_grid,
+                                (int32_t)seg.size};
+            add_record(mine, header,
+                       reinterpret_cast<unsigned char *>(seg.buffer));
+            delete_buffer(seg.buffer);
+        }
+        it = bundles.erase(it);
+    }
+
+    gather_bytes(component->node_comm, mine, all);
+    if (rank != component->node_ranks[0]) {
+        return;
+    }
+
+    /* Keyed by destination grid and node. */
+    map<pair<int, int>, SendRecords> messages;
+    size_t offset = 0;
+    while (offset < all.size()) {
+        int32_t header[RECORD_HEADER_INTS];
+        const unsigned char *data = next_record(all, offset, header);
+        add_record(messages[make_pair(header[3], ctx->rank_nodes[header[0]])],
+                   header, data);
+    }
+
+    for (const auto& kv : messages) {
+        const auto& msg = kv.second;
+        double *buf = new_buffer((msg.size() / sizeof(double)) + 1,
+                                 MEMORY_SEND_BUFFERS);
+        memcpy(buf, msg.data(), msg.size());
+
+        int tag = router->get_aggregate_tag(router->get_local_grid(),
+                                            router->get_grid_name(kv.first.first));
+        SendRequest *request = ctx->transport->isend_bytes(
+                    reinterpret_cast<unsigned char *>(buf), msg.size(),
+                    ctx->node_leaders[kv.first], tag);
+        pending_sends.push_back(PendingSend(request, buf));
+    }
+}
+
+/* The receiving side of the above. The leader receives from the leader of
+ * the peer grid on each node that sends here and hands each rank its
+ * segments, which are kept for take_segment(). This is collective over the
+ * ranks of the component on this node. */
+static void receive_aggregated(Context *ctx, Component *component,
+                               const Transfer *transfer)
+{
+    Router *router = component->router;
+    int rank = ctx->transport->get_rank();
+    const auto& node_ranks = component->node_ranks;
+    vector<RecvMessage> parts;
+    RecvMessage msg, mine;
+
+    if (rank == node_ranks[0]) {
+        parts.resize(node_ranks.size());
+        int tag = router->get_aggregate_tag(transfer->get_peer_grid(),
+                                            router->get_local_grid());
+
+        for (auto src : component->aggregation_sources[
+                                                transfer->get_peer_grid()]) {
+            ctx->transport->recv_bytes(msg, src, tag);
+
+            size_t offset = 0;
+            while (offset < msg.size()) {
+                int32_t header[RECORD_HEADER_INTS];
+                const unsigned char *data = next_record(msg, offset, header);
+                auto it = find(node_ranks.begin(), node_ranks.end(),
+                               header[0]);
+                assert(it != node_ranks.end());
+                add_record(parts[it - node_ranks.begin()], header, data);
+            }
+        }
+    }
+
+    scatter_bytes(component->node_comm, parts, mine);
+
+    lock_guard<mutex> guard(ctx->segments_lock);
+    size_t offset = 0;
+    while (offset < mine.size()) {
+        int32_t header[RECORD_HEADER_INTS];
+        const unsigned char *data = next_record(mine, offset, header);
+        assert(header[0] == rank);
+        ctx->segments[to_string(header[1]) + ":" + to_string(header[2])]
+            .push_back(RecvMessage(data, data + header[4]));
+    }
+    ctx->segments_ready.notify_all();
+}
+
+/* Receive the fields of a transfer. We do a blocking receive, or with a lag
+ * complete the one started at the last transfer. */
+static void recv_transfer(Context *ctx, Component *component,
+                          Transfer *transfer)
+{
+    Router *router = component->router;
+    string peer_grid = transfer->get_peer_grid();
+    string local_grid = router->get_local_grid();
+    vector<Field> members = get_members(transfer);
+
+    /* What we do here:
+     *
+     * 1) name the local points as the 'side A' points.
+     *
+     * 2) receive data from remote tile associated with each mapping.
+     *
+     * 3) the data comes in as a sequential array (of course) but each
+     * array element can refer to any local point, so the data has to
+     * be 'unboxed', i.e. loaded into the correct index of the receive
+     * field.
+     *
+     * 4) Since many mappings can contribute to a single point we use
+     * += to accumulate all incoming data for that point.
+     */
+
+    const auto& mapping_list = router->get_recv_mappings(peer_grid);
+    vector<shared_ptr<Mapping> > mappings(mapping_list.begin(),
+                                          mapping_list.end());
+    vector<double *> recv_bufs(mappings.size());
+    bool compressed = component->config->is_recv_compressed(peer_grid);
+    bool lagged = component->config->is_recv_lagged(peer_grid);
+    int tag = router->get_message_tag(peer_grid, local_grid);
+    RecvMessage message;
+
+    int64_t wait_start = trace_now();
+    if (!lagged && component->node_comm != MPI_COMM_NULL) {
+        receive_aggregated(ctx, component, transfer);
+    }
+
+    for (size_t i = 0; i < mappings.size(); i++) {
+        const auto& mapping = mappings[i];
+        unsigned int count = mapping->get_num_points() *
+                             transfer->total_members;
+
+        if (mapping->get_remote_tile_id() == router->get_tile_id()) {
+            /* The sender is another component in this process, it must
+             * already have done its put. With a lag its first message is
+             * left for next time. */
+            if (lagged) {
+                lock_guard<mutex> guard(component->lock);
+                LaggedReceive& lr = component->lagged_receives[mapping.get()];
+                if (!lr.started) {
+                    lr.started = true;
+                    recv_bufs[i] = new_buffer(count, MEMORY_RECV_BUFFERS,
+                                              true);
+                    continue;
+                }
+            }
+
+            recv_bufs[i] = ctx->get_local_message(peer_grid, local_grid);
+            if (recv_bufs[i] == nullptr) {
+                cerr << "Error: nothing has been sent from " << peer_grid
+                     << " to " << local_grid << " in this process. "
+                     << "The put must come before the get." << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            /* The remote path checks this in decode_message(). */
+            if (buffer_count(recv_bufs[i]) != count) {
+                cerr << "Error: expected " << count << " values from "
+                     << peer_grid << " in this process but got "
+                     << buffer_count(recv_bufs[i]) << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            continue;
+        }
+
+        if (lagged) {
+            recv_bufs[i] = receive_lagged(ctx, component, transfer, *mapping,
+                                          compressed, tag);
+        } else {
+            recv_bufs[i] = new_buffer(count, MEMORY_RECV_BUFFERS);
+            take_segment(ctx, mapping->get_remote_tile_id(), tag, message);
+            decode_message(transfer, *mapping, compressed, message.data(),
+                           message.size(), recv_bufs[i]);
+        }
+    }
+
+    int64_t unpack_start = trace_now();
+    if (ctx->tracer != nullptr) {
+        ctx->tracer->record("wait", wait_start, unpack_start, peer_grid);
+    }
+
+    /* Unboxing is shared out over the thread team in chunks of rows. The
+     * rows of a mapping go to different points, but mappings overlap, so
+     * they are done one after the other, each split over all threads. Every
+     * point then gets its contributions in the same order, so results don't
+     * depend on the number of threads. */
+#pragma omp parallel
+    for (size_t i = 0; i < mappings.size(); i++) {
+        const auto& local_points = mappings[i]->get_rows();
+        unsigned int n = local_points.size();
+        size_t num_chunks = (n + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK;
+
+#pragma omp for schedule(static)
+        for (size_t c = 0; c < num_chunks * members.size(); c++) {
+            const Field& field = members[c / num_chunks];
+            const double *values = recv_bufs[i] + ((c / num_chunks) * n);
+            unsigned int first = (c % num_chunks) * ROWS_PER_CHUNK;
+            unsigned int end = min(first + ROWS_PER_CHUNK, n);
+
+            if (field.offsets != nullptr) {
+                for (unsigned int r = first; r < end; r++) {
+                    field.buffer[field.offsets[local_points[r]]] += values[r];
+                }
+                continue;
+            }
+
+            for (unsigned int r = first; r < end; r++) {
+
+#if defined(DEBUG)
+                assert(local_points[r] < field.size);
+#endif
+                field.buffer[local_points[r]] += values[r];
+            }
+        }
+    }
+
+    for (auto buf : recv_bufs) {
+        delete_buffer(buf);
+    }
+    if (ctx->tracer != nullptr) {
+        ctx->tracer->record("unpack", unpack_start, trace_now(), peer_grid);
+    }
+}
+
+/* Do all the sends of the epoch and then all the receives. Messages to the
+ * same remote proc are sent together, even if they are for different peer
+ * grids. */
+void tango_end_transfer()
+{
+    Context *ctx = get_context();
+    Component *component = ctx->get_component();
+    Epoch *epoch = current_epoch(component);
+    map<int, list<Segment> > bundles;
+    list<PendingSend> pending_sends;
+    TraceScope scope(ctx->tracer, "end_transfer");
+
+    bool sending = false;
+    for (auto transfer : epoch->transfers) {
+        if (transfer->is_send()) {
+            send_transfer(ctx, component, transfer, bundles, pending_sends);
+            sending = true;
+        }
+    }
+    {
+        TraceScope post_scope(ctx->tracer, "post");
+        if (sending && component->node_comm != MPI_COMM_NULL) {
+            aggregate_sends(ctx, component, bundles, pending_sends);
+        }
+        send_bundles(ctx, bundles, pending_sends);
+    }
+
+    for (auto transfer : epoch->transfers) {
+        if (!transfer->is_send()) {
+            recv_transfer(ctx, component, transfer);
+        }
+    }
+
+    for (auto& ps : pending_sends) {
+        ps.owner = this_thread::get_id();
+    }
+
+    /* From here on the progress engine can see the sends. */
+    lock_guard<mutex> guard(component->lock);
+    component->pending_sends.splice(component->pending_sends.end(),
+                                    pending_sends);
+    epoch->in_progress = false;
+}
+
+/* The bytes that Tango is using for category, now and at most so far. The
+ * categories are "tiles", "mappings", "weights", "send_buffers",
+ * "recv_buffers" and "total". These are for the whole process, so when
+ * threads act as ranks they cover all of them. See also memory_report in
+ * config.yaml. */
+void tango_memory_usage(const char *category, long long *current,
+                        long long *peak)
+{
+    for (int c = 0; c <= NUM_MEMORY_CATEGORIES; c++) {
+        if (string(category) == memory_category_name(c)) {
+            *current = memory_current(c);
+            *peak = memory_peak(c);
+            return;
+        }
+    }
+
+    cerr << "Error: unknown memory category " << category << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+/* Drive outstanding sends. Sends are otherwise only checked, or waited for,
+ * at the next tango_begin_transfer(), with some MPI libraries large messages make little
+ * progress until then. Call this now and then, e.g. within the model time
+ * step, or set progress_interval in config.yaml to have a helper thread do
+ * it. */
+void tango_progress(void)
+{
+    Context *ctx = get_context();
+
+    for (auto& c : ctx->components) {
+        progress_component(ctx, c);
+    }
+}
+
+static void progress_loop(Context *ctx, unsigned int interval)
+{
+    while (!ctx->stop_progress.load()) {
+        for (auto& c : ctx->components) {
+            progress_component(ctx, c);
+        }
+        this_thread::sleep_for(chrono::microseconds(interval));
+    }
+}
+
+/* Start the helper thread if any component asks for it. */
+static void start_progress_thread(Context *ctx)
+{
+    unsigned int interval = 0;
+
+    for (const auto& c : ctx->components) {
+        if (c->config->get_progress_interval() != 0 &&
+            (interval == 0 || c->config->get_progress_interval() < interval)) {
+            interval = c->config->get_progress_interval();
+        }
+    }
+
+    if (interval == 0 || ctx->progress_thread.joinable()) {
+        return;
+    }
+
+    if (ctx == mpi_context) {
+        int provided;
+        MPI_Query_thread(&provided);
+        if (provided < MPI_THREAD_MULTIPLE) {
+            cerr << "Error: progress_interval needs MPI to be initialised "
+                 << "with MPI_THREAD_MULTIPLE." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    ctx->stop_progress = false;
+    ctx->progress_thread = thread(progress_loop, ctx, interval);
+}
+
+/* Set up node aggregation if config.yaml asks for it, see
+ * aggregate_sends(). Each component gets a communicator of its ranks on this
+ * node and the leaders find out who will send to them. This is collective
+ * over all ranks. */
+static void init_node_aggregation(Context *ctx)
+{
+    int wanted = 0, all_wanted;
+    unsigned int ranks_per_node = 0;
+
+    for (const auto& c : ctx->components) {
+        if (c->config->is_node_aggregation()) {
+            wanted = 1;
+            ranks_per_node = c->config->get_ranks_per_node();
+        }
+    }
+
+    if (ctx != mpi_context) {
+        if (wanted) {
+            cerr << "Error: node_aggregation needs MPI." << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        return;
+    }
+
+    MPI_Allreduce(&wanted, &all_wanted, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (!all_wanted) {
+        return;
+    }
+
+    int rank = ctx->transport->get_rank();
+    int num_ranks = ctx->transport->get_size();
+    MPI_Comm node_comm;
+    if (ranks_per_node > 0) {
+        MPI_Comm_split(MPI_COMM_WORLD, rank / ranks_per_node, rank,
+                       &node_comm);
+    } else {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                            MPI_INFO_NULL, &node_comm);
+    }
+
+    int node = rank;
+    MPI_Bcast(&node, 1, MPI_INT, 0, node_comm);
+    ctx->rank_nodes.resize(num_ranks);
+    MPI_Allgather(&node, 1, MPI_INT, ctx->rank_nodes.data(), 1, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    /* The leader of a grid on a node is its lowest rank there. */
+    vector<int> grids, all_grids, sizes;
+    for (const auto& c : ctx->components) {
+        grids.push_back(c->router->get_grid_id(c->router->get_local_grid()));
+    }
+    ctx->transport->allgatherv(grids, all_grids, sizes);
+    int offset = 0;
+    for (int r = 0; r < num_ranks; r++) {
+        for (int i = 0; i < sizes[r]; i++) {
+            ctx->node_leaders.insert(make_pair(
+                    make_pair(all_grids[offset + i], ctx->rank_nodes[r]), r));
+        }
+        offset += sizes[r];
+    }
+
+    /* Everyone on the node takes part in every split. */
+    Router *router = ctx->components.front()->router;
+    for (int g = 0; g < router->get_num_grids(); g++) {
+        Component *component = nullptr;
+        for (const auto& c : ctx->components) {
+            if (c->router->get_grid_id(c->router->get_local_grid()) == g) {
+                component = c;
+            }
+        }
+
+        MPI_Comm comm;
+        MPI_Comm_split(node_comm, component ? g : MPI_UNDEFINED, rank, &comm);
+        if (component != nullptr) {
+            int size;
+            MPI_Comm_size(comm, &size);
+            component->node_comm = comm;
+            component->node_ranks.resize(size);
+            MPI_Allgather(&rank, 1, MPI_INT, component->node_ranks.data(), 1,
+                          MPI_INT, comm);
+        }
+    }
+    MPI_Comm_free(&node_comm);
+
+    for (const auto& c : ctx->components) {
+        const auto& recv_grids = c->config->get_recv_grids();
+        vector<string> peers(recv_grids.begin(), recv_grids.end());
+        sort(peers.begin(), peers.end());
+
+        for (const auto& peer : peers) {
+            int peer_id = c->router->get_grid_id(peer);
+            vector<unsigned char> sources, all_sources;
+
+            for (const auto& m : c->router->get_recv_mappings(peer)) {
+                int src_node = ctx->rank_nodes[m->get_remote_tile_id()];
+                if (src_node != node) {
+                    int leader = ctx->node_leaders[make_pair(peer_id,
+                                                             src_node)];
+                    const unsigned char *b =
+                        reinterpret_cast<const unsigned char *>(&leader);
+                    sources.insert(sources.end(), b, b + sizeof(leader));
+                }
+            }
+
+            gather_bytes(c->node_comm, sources, all_sources);
+            set<int> unique;
+            for (size_t i = 0; i < all_sources.size(); i += sizeof(int)) {
+                int leader;
+                memcpy(&leader, all_sources.data() + i, sizeof(leader));
+                unique.insert(leader);
+            }
+            c->aggregation_sources[peer].assign(unique.begin(), unique.end());
+        }
+    }
+}
+
+void tango_finalize()
+{
+    Context *ctx = get_context();
+    int64_t start = trace_now();
+    string trace_label = "rank " + to_string(ctx->transport->get_rank());
+
+    for (const auto& c : ctx->components) {
+        trace_label += (c == ctx->components.front() ? ": " : ", ") +
+                       c->config->get_local_grid();
+    }
+
+    if (ctx->progress_thread.joinable()) {
+        ctx->stop_progress = true;
+        ctx->progress_thread.join();
+    }
+
+    /* Every proc takes part in the report, see tango_init_components(). */
+    string memory_report;
+    for (const auto& c : ctx->components) {
+        if (memory_report.empty()) {
+            memory_report = c->config->get_memory_report();
+        }
+    }
+    if (!memory_report.empty()) {
+        write_memory_report(*ctx->transport, memory_report);
+    }
+
+    /* The data sent at the last transfer of a lagged mapping is never used,
+     * but it still has to be received. Do this before waiting for our own
+     * sends, the sender may be waiting for this. */
+    for (auto& c : ctx->components) {
+        for (auto& kv : c->lagged_receives) {
+            if (kv.second.request != nullptr) {
+                ctx->transport->wait_recv(kv.second.request);
+            }
+        }
+        c->lagged_receives.clear();
+    }
+
+    for (auto& c : ctx->components) {
+        complete_comms(ctx, c);
+        if (c->node_comm != MPI_COMM_NULL) {
+            MPI_Comm_free(&c->node_comm);
+        }
+        for (auto& kv : c->get_all_epochs()) {
+            delete kv.second;
+        }
+        c->get_all_epochs().clear();
+
+        delete c->router;
+        delete c->config;
+        delete c;
+    }
+    ctx->clear_components();
+
+    /* Anything left here was never received. */
+    for (auto& kv : ctx->local_messages) {
+        for (auto buf : kv.second) {
+            delete_buffer(buf);
+        }
+    }
+    ctx->local_messages.clear();
+    ctx->segments.clear();
+    ctx->receiving_ranks.clear();
+    ctx->rank_nodes.clear();
+    ctx->node_leaders.clear();
+
+    /* Compare clocks again to allow for drift over the run. */
+    if (ctx->tracing) {
+        if (ctx->tracer != nullptr) {
+            ctx->tracer->record("finalize", start, trace_now());
+        }
+        Tracer::sync_clocks(*ctx->transport, ctx->tracer,
+                            Router::get_trace_tag());
+        Tracer::write(*ctx->transport, ctx->tracer, trace_label);
+    }
+    delete ctx->tracer;
+    ctx->tracer = nullptr;
+    ctx->tracing = false;
+
+    /* A thread acting as a rank is done with its context. The last one out
+     * cleans up the shared state. */
+    if (ctx != mpi_context) {
+        delete ctx->transport;
+        delete ctx;
+        context = nullptr;
+
+        lock_guard<mutex> guard(thread_world_lock);
+        thread_world_users--;
+        if (thread_world_users == 0) {
+            delete thread_world;
+            thread_world = nullptr;
+        }
+    }
+}
+
+/* Run Tango with threads acting as ranks within a single process, without
+ * using MPI at all. Each of num_ranks threads calls this, with its own rank,
+ * before any other Tango call. Every rank must be driven by one thread only.
+ * Messages between ranks are handed over through lock-free queues. This is
+ * useful on a single node and for benchmarking without an MPI job. */
+void tango_thread_rank_init(int rank, int num_ranks)
+{
+    assert(context == nullptr);
+    assert(rank >= 0 && rank < num_ranks);
+
+    lock_guard<mutex> guard(thread_world_lock);
+    if (thread_world == nullptr) {
+        thread_world = new ThreadWorld(num_ranks);
+    }
+    assert(thread_world->get_size() == num_ranks);
+    thread_world_users++;
 
-    delete router;
-    delete config;
-    router = nullptr;
+    context = new Context(new ThreadTransport(*thread_world, rank));
 }
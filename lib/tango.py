@@ -1,55 +1,284 @@
 
 import ctypes as ct
 import os
+import sys
 import resource
 import numpy as np
 
+build_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                         '../', 'build')
+
+def load_native():
+    """
+    The native module, see lib/tango_module.cc, or None if it hasn't been
+    built.
+    """
+
+    sys.path.insert(0, build_dir)
+    try:
+        import _tango
+    except ImportError:
+        return None
+    finally:
+        sys.path.pop(0)
+    return _tango
+
 class Tango:
 
-    def __init__(self, config, grid, lis, lie, ljs, lje, gis, gie, gjs, gje):
+    def __init__(self, config, grid, lis, lie, ljs, lje, gis, gie, gjs, gje,
+                 masks=None, blocks=None, native=True):
+        """
+        masks is an optional dictionary of grid name to a global mask array
+        for that grid. Non-zero means that the point is active.
+
+        blocks is an optional list of (lis, lie, ljs, lje) tuples for a local
+        domain made up of several blocks. If it is given then lis, lie, ljs
+        and lje are ignored.
+
+        With native the calls made every transfer go through the native
+        module if it has been built. It takes any buffer of float64 in
+        place, keeps the fields alive until end_transfer() and lets other
+        threads run during end_transfer(). Otherwise they go through
+        ctypes.
+        """
 
         # FIXME: this doesn't appear to work.
         resource.setrlimit(resource.RLIMIT_STACK, (resource.RLIM_INFINITY,
                                                    resource.RLIM_INFINITY))
 
-        my_dir = os.path.dirname(os.path.realpath(__file__))
-        build_dir = os.path.join(my_dir, '../', 'build')
         self.lib = ct.cdll.LoadLibrary(os.path.join(build_dir, 'libtango.so'))
+        self.native = load_native() if native else None
 
         self.lib.tango_init.argtypes = [ct.c_char_p, ct.c_char_p,
                                         ct.c_uint, ct.c_uint, ct.c_uint,
                                         ct.c_uint, ct.c_uint, ct.c_uint,
                                         ct.c_uint, ct.c_uint]
+        self.lib.tango_init_blocks.argtypes = [ct.c_char_p, ct.c_char_p,
+                                               ct.c_uint, ct.POINTER(ct.c_uint),
+                                               ct.c_uint, ct.c_uint,
+                                               ct.c_uint, ct.c_uint]
+        self.lib.tango_set_mask.argtypes = [ct.c_char_p,
+                                            ct.POINTER(ct.c_int), ct.c_int]
+        self.lib.tango_redecompose_blocks.argtypes = [ct.c_uint,
+                                                      ct.POINTER(ct.c_uint)]
         self.lib.tango_begin_transfer.argtypes = [ct.c_char_p, ct.c_char_p]
+        self.lib.tango_begin_multi_transfer.argtypes = [ct.c_char_p]
+        self.lib.tango_put_to.argtypes = [ct.c_char_p, ct.c_char_p,
+                                          ct.POINTER(ct.c_double), ct.c_int]
+        self.lib.tango_get_from.argtypes = [ct.c_char_p, ct.c_char_p,
+                                            ct.POINTER(ct.c_double), ct.c_int]
         self.lib.tango_put.argtypes = [ct.c_char_p,
                                        ct.POINTER(ct.c_double), ct.c_int]
         self.lib.tango_get.argtypes = [ct.c_char_p,
                                        ct.POINTER(ct.c_double), ct.c_int]
+        self.lib.tango_accumulate.argtypes = [ct.c_char_p,
+                                              ct.POINTER(ct.c_double), ct.c_int]
+        self.lib.tango_put_ensemble.argtypes = [ct.c_char_p,
+                                                ct.POINTER(ct.c_double),
+                                                ct.c_int, ct.c_int]
+        self.lib.tango_get_ensemble.argtypes = [ct.c_char_p,
+                                                ct.POINTER(ct.c_double),
+                                                ct.c_int, ct.c_int]
+        for name in ['tango_put_strided', 'tango_get_strided']:
+            getattr(self.lib, name).argtypes = [ct.c_char_p,
+                                                ct.POINTER(ct.c_double),
+                                                ct.c_long, ct.c_long,
+                                                ct.c_long]
+        self.lib.tango_memory_usage.argtypes = [ct.c_char_p,
+                                                ct.POINTER(ct.c_longlong),
+                                                ct.POINTER(ct.c_longlong)]
+
+        if masks is not None:
+            for grid_name, mask in masks.items():
+                mask = np.ascontiguousarray(mask, dtype=np.intc)
+                self.lib.tango_set_mask(grid_name.encode('ascii'),
+                                        mask.ctypes.data_as(ct.POINTER(ct.c_int)),
+                                        mask.size)
 
-        self.lib.tango_init(config.encode('ascii'), grid.encode('ascii'),
-                            lis, lie, ljs, lje, gis, gie, gjs, gje)
+        if blocks is not None:
+            extents = np.array(blocks, dtype=np.uintc).flatten()
+            self.lib.tango_init_blocks(config.encode('ascii'),
+                                       grid.encode('ascii'), len(blocks),
+                                       extents.ctypes.data_as(ct.POINTER(ct.c_uint)),
+                                       gis, gie, gjs, gje)
+        else:
+            self.lib.tango_init(config.encode('ascii'), grid.encode('ascii'),
+                                lis, lie, ljs, lje, gis, gie, gjs, gje)
+
+    def redecompose(self, lis, lie, ljs, lje, blocks=None):
+        """
+        Change the local domain, blocks is as for __init__(). All procs take
+        part, those that don't change pass their current domain.
+        """
+        if blocks is None:
+            blocks = [(lis, lie, ljs, lje)]
+        extents = np.array(blocks, dtype=np.uintc).flatten()
+        self.lib.tango_redecompose_blocks(len(blocks),
+                                          extents.ctypes.data_as(ct.POINTER(ct.c_uint)))
 
     def begin_transfer(self, timestamp, grid_name):
+        if self.native:
+            self.native.begin_transfer(timestamp, grid_name)
+            return
         self.lib.tango_begin_transfer(timestamp.encode('ascii'),
                                       grid_name.encode('ascii'))
 
+    def begin_multi_transfer(self, timestamp):
+        """
+        Start a transfer with several grids, see put_to() and get_from().
+        """
+        if self.native:
+            self.native.begin_multi_transfer(timestamp)
+            return
+        self.lib.tango_begin_multi_transfer(timestamp.encode('ascii'))
+
     def put(self, field_name, array):
+        if self.native:
+            self.native.put(field_name, array)
+            return
         assert(array.flags['C_CONTIGUOUS'])
         assert(array.dtype == 'float64')
         self.lib.tango_put(field_name.encode('ascii'),
                            array.ctypes.data_as(ct.POINTER(ct.c_double)),
                            array.size)
 
+    def accumulate(self, field_name, array):
+        if self.native:
+            self.native.accumulate(field_name, array)
+            return
+        assert(array.flags['C_CONTIGUOUS'])
+        assert(array.dtype == 'float64')
+        self.lib.tango_accumulate(field_name.encode('ascii'),
+                                  array.ctypes.data_as(ct.POINTER(ct.c_double)),
+                                  array.size)
+
     def get(self, field_name, array):
+        if self.native:
+            self.native.get(field_name, array)
+            return
         assert(array.flags['C_CONTIGUOUS'])
         assert(array.dtype == 'float64')
         self.lib.tango_get(field_name.encode('ascii'),
                            array.ctypes.data_as(ct.POINTER(ct.c_double)),
                            array.size)
 
+    def put_ensemble(self, field_name, array):
+        """
+        The first dimension of array is the ensemble member.
+        """
+        if self.native:
+            self.native.put_ensemble(field_name, array)
+            return
+        assert(array.flags['C_CONTIGUOUS'])
+        assert(array.dtype == 'float64')
+        assert(array.ndim >= 2)
+        num_members = array.shape[0]
+        self.lib.tango_put_ensemble(field_name.encode('ascii'),
+                                    array.ctypes.data_as(ct.POINTER(ct.c_double)),
+                                    array.size // num_members, num_members)
+
+    def get_ensemble(self, field_name, array):
+        if self.native:
+            self.native.get_ensemble(field_name, array)
+            return
+        assert(array.flags['C_CONTIGUOUS'])
+        assert(array.dtype == 'float64')
+        assert(array.ndim >= 2)
+        num_members = array.shape[0]
+        self.lib.tango_get_ensemble(field_name.encode('ascii'),
+                                    array.ctypes.data_as(ct.POINTER(ct.c_double)),
+                                    array.size // num_members, num_members)
+
+    def put_to(self, grid_name, field_name, array):
+        if self.native:
+            self.native.put_to(grid_name, field_name, array)
+            return
+        assert(array.flags['C_CONTIGUOUS'])
+        assert(array.dtype == 'float64')
+        self.lib.tango_put_to(grid_name.encode('ascii'),
+                              field_name.encode('ascii'),
+                              array.ctypes.data_as(ct.POINTER(ct.c_double)),
+                              array.size)
+
+    def get_from(self, grid_name, field_name, array):
+        if self.native:
+            self.native.get_from(grid_name, field_name, array)
+            return
+        assert(array.flags['C_CONTIGUOUS'])
+        assert(array.dtype == 'float64')
+        self.lib.tango_get_from(grid_name.encode('ascii'),
+                                field_name.encode('ascii'),
+                                array.ctypes.data_as(ct.POINTER(ct.c_double)),
+                                array.size)
+
+    def put_strided(self, field_name, array):
+        """
+        Put a 2-D view of the local domain, e.g. a[1:-1, 1:-1] of an array
+        with a halo of one, without copying it.
+        """
+        self._strided(self.lib.tango_put_strided, field_name, array)
+
+    def get_strided(self, field_name, array):
+        """
+        Get into a 2-D view of the local domain, see put_strided().
+        """
+        self._strided(self.lib.tango_get_strided, field_name, array)
+
+    def _strided(self, call, field_name, array):
+        assert(array.ndim == 2)
+        assert(array.dtype == 'float64')
+        call(field_name.encode('ascii'),
+             array.ctypes.data_as(ct.POINTER(ct.c_double)), 0,
+             array.strides[0] // array.itemsize,
+             array.strides[1] // array.itemsize)
+
+    def put_fields(self, fields):
+        """
+        Put every field of a dict of field name to array.
+        """
+        if self.native:
+            self.native.put_fields(fields)
+            return
+        for field_name, array in fields.items():
+            self.put(field_name, array)
+
+    def get_fields(self, fields):
+        """
+        Get every field of a dict of field name to array.
+        """
+        if self.native:
+            self.native.get_fields(fields)
+            return
+        for field_name, array in fields.items():
+            self.get(field_name, array)
+
     def end_transfer(self):
+        if self.native:
+            self.native.end_transfer()
+            return
         self.lib.tango_end_transfer()
 
+    def progress(self):
+        if self.native:
+            self.native.progress()
+            return
+        self.lib.tango_progress()
+
+    def memory_usage(self, category='total'):
+        """
+        The bytes Tango is using for category, e.g. 'mappings', now and at
+        its peak, as a tuple.
+        """
+
+        current = ct.c_longlong()
+        peak = ct.c_longlong()
+        self.lib.tango_memory_usage(category.encode('ascii'),
+                                    ct.byref(current), ct.byref(peak))
+        return current.value, peak.value
+
     def finalize(self):
-        self.lib.tango_finalize()
+        if self.native:
+            self.native.finalize()
+        else:
+            self.lib.tango_finalize()
         self.lib = None
@@ -1,45 +1,330 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <list>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <mpi.h>
 
+#include "accounting.h"
+#include "router.h"
+#include "trace.h"
+#include "transport.h"
+
 using namespace std;
 
 class Field {
 public:
     double *buffer;
+    /* Size of a single ensemble member. */
     unsigned int size;
-    Field(double *buf, unsigned int buf_size);
+    /* Number of ensemble members, these are stored one after the other in
+     * buffer. All members share the same mappings. */
+    unsigned int num_members;
+    /* Acceptable absolute and relative error when sending, zero if the field
+     * is sent exactly. */
+    double tolerance;
+    double relative_tolerance;
+    /* Where each point is in buffer if it isn't dense, see
+     * tango_put_strided(). nullptr for a dense field. */
+    const point_t *offsets;
+    Field(double *buf, unsigned int buf_size, unsigned int members = 1,
+          double tolerance = 0, double relative_tolerance = 0,
+          const point_t *offsets = nullptr);
 };
 
-Field::Field(double *buf, unsigned int buf_size)
-    : buffer(buf), size(buf_size) {}
+Field::Field(double *buf, unsigned int buf_size, unsigned int members,
+             double tolerance, double relative_tolerance,
+             const point_t *offsets)
+    : buffer(buf), size(buf_size), num_members(members),
+      tolerance(tolerance), relative_tolerance(relative_tolerance),
+      offsets(offsets) {}
 
 class PendingSend {
 public:
-    MPI_Request *request;
+    SendRequest *request;
     double *buffer;
-    PendingSend(MPI_Request *request, double *buffer);
+    /* The thread that sent it, set at the end of the transfer. */
+    thread::id owner;
+    /* With a lag, the peer grid and the number of lagged transfers to it
+     * before this one. Empty without a lag. */
+    string lagged_peer;
+    unsigned int step;
+    PendingSend(SendRequest *request, double *buffer);
 };
 
-PendingSend::PendingSend(MPI_Request *request, double *buffer)
-    : request(request), buffer(buffer) {}
+PendingSend::PendingSend(SendRequest *request, double *buffer)
+    : request(request), buffer(buffer), step(0) {}
 
+/* The fields going to or coming from one peer grid within an epoch. */
 class Transfer {
 private:
     string curr_time;
     /* Name of grid that this transfer is sending/recieving to/from. */
     string peer_grid;
+    bool send;
 public:
-    unsigned int total_send_size;
-    unsigned int total_recv_size;
+    unsigned int total_size;
+    /* Number of field members in the transfer, an ensemble field counts once
+     * for each member. */
+    unsigned int total_members;
+    /* Some fields are sent lossy, see quantize_compress(). */
+    bool lossy;
+    /* The fields are running sums, see tango_accumulate(). */
+    bool accumulating;
     string get_peer_grid(void) const { return peer_grid; }
+    string get_time(void) const { return curr_time; }
+    bool is_send(void) const { return send; }
     list<Field> fields;
+    Transfer(string timestamp, string peer, bool send);
+};
+
+Transfer::Transfer(string timestamp, string peer, bool send)
+    : curr_time(timestamp), peer_grid(peer), send(send), total_size(0),
+      total_members(0), lossy(false), accumulating(false) {}
+
+/* Everything between tango_begin_transfer() and tango_end_transfer(). An
+ * epoch started with tango_begin_multi_transfer() can put to and get from
+ * several peer grids, each has its own transfer. */
+class Epoch {
+private:
+    string curr_time;
+    /* The grid given to tango_begin_transfer(), used by tango_put() and
+     * tango_get(). Empty for a multi-peer epoch. */
+    string peer_grid;
+public:
+    /* Between tango_begin_transfer() and tango_end_transfer(). */
+    bool in_progress;
+    /* One for each peer grid and direction, in the order of first use. Only
+     * added to with the component lock held. */
+    list<Transfer *> transfers;
+    string get_peer_grid(void) const { return peer_grid; }
+    string get_time(void) const { return curr_time; }
+    Transfer *find_transfer(const string& peer, bool send) const;
+    Epoch(string timestamp, string peer);
+    ~Epoch();
+};
+
+Epoch::Epoch(string timestamp, string peer)
+    : curr_time(timestamp), peer_grid(peer), in_progress(true) {}
+
+Epoch::~Epoch()
+{
+    for (auto t : transfers) {
+        delete t;
+    }
+}
+
+/* Returns nullptr if nothing has been put to/got from peer yet. */
+Transfer *Epoch::find_transfer(const string& peer, bool send) const
+{
+    for (auto t : transfers) {
+        if (t->get_peer_grid() == peer && t->is_send() == send) {
+            return t;
+        }
+    }
+    return nullptr;
+}
+
+/* The message of a mapping on its way to a remote proc. Messages going to
+ * the same proc are sent together in one bundle, each labelled with the tag
+ * it would be sent with on its own. */
+class Segment {
+public:
+    int tag;
+    /* Id of the grid it is going to, see Router::get_grid_id(). */
+    int dest_grid;
+    double *buffer;
+    /* In bytes. */
+    size_t size;
+    Segment(int tag, int dest_grid, double *buffer, size_t size);
+};
+
+Segment::Segment(int tag, int dest_grid, double *buffer, size_t size)
+    : tag(tag), dest_grid(dest_grid), buffer(buffer), size(size) {}
+
+/* The running sum of a field, see tango_accumulate(). */
+class Accumulator {
+public:
+    vector<double> sum;
+    /* When the field was last added, to catch adding the same step twice. */
+    string last_time;
+};
+
+/* The receive of a mapping with a lag, see the lag option in config.yaml.
+ * The data for one transfer is received while the data of the previous one is
+ * used. */
+class LaggedReceive {
+public:
+    /* The receive posted at the last transfer, nullptr at the start. */
+    RecvRequest *request;
+    RecvMessage buf;
+    /* The timestamp of the last transfer, which should come with the data. */
+    string time;
+    /* Whether there has been a transfer yet. */
+    bool started;
+    LaggedReceive() : request(nullptr), started(false) {}
+};
+
+/* A model component, i.e. a grid, that lives in this process. There can be
+ * several components in a process, each with its own routing. */
+class Component {
+private:
+    /* Each thread has its own epoch so that different threads can do
+     * transfers at the same time. */
+    unordered_map<thread::id, Epoch *> epochs;
+public:
+    Config *config;
+    Router *router;
+    /* Running sums keyed by "peer_grid:field" and the number of steps summed
+     * for each peer grid. */
+    unordered_map<string, Accumulator> accumulators;
+    unordered_map<string, unsigned int> accumulated_steps;
+    /* Sends from all threads that may not have completed yet. */
     list<PendingSend> pending_sends;
-    Transfer(string timestamp, string peer);
+    /* Receives of mappings with a lag, and the number of transfers sent to
+     * each peer grid with a lag. */
+    unordered_map<Mapping *, LaggedReceive> lagged_receives;
+    unordered_map<string, unsigned int> lagged_sends;
+    /* With node aggregation, the ranks of this component on this node, the
+     * first is the leader. MPI_COMM_NULL without node aggregation. */
+    MPI_Comm node_comm;
+    vector<int> node_ranks;
+    /* The leaders that send to this node's leader, for each peer grid. */
+    unordered_map<string, vector<int> > aggregation_sources;
+    /* Offsets of the local points for each layout of strided fields, kept
+     * until the local domain changes. */
+    map<FieldLayout, counted_vector<point_t, MEMORY_TILES> > layouts;
+    /* Protects epochs, pending sends, accumulators, lagged receives and
+     * layouts. The config and router are read only once the component has
+     * been initialised. */
+    mutex lock;
+    /* The current epoch of the calling thread, or the one left over from its
+     * last tango call. */
+    Epoch *get_epoch(void);
+    /* Needs lock to be held. */
+    unordered_map<thread::id, Epoch *>& get_all_epochs(void)
+        { return epochs; }
+    Component(Config *config, Router *router);
+};
+
+Component::Component(Config *config, Router *router)
+    : config(config), router(router), node_comm(MPI_COMM_NULL) {}
+
+Epoch *Component::get_epoch(void)
+{
+    lock_guard<mutex> guard(lock);
+    auto it = epochs.find(this_thread::get_id());
+
+    if (it == epochs.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+/* Everything that belongs to a rank. Normally there is one of these in a
+ * process, when threads act as ranks there is one per thread. */
+class Context {
+public:
+    Transport *transport;
+    /* All the components of this rank. */
+    list<Component *> components;
+    /* Packed messages between components of this rank, keyed by source and
+     * destination grid. These never go through the transport. */
+    unordered_map<string, list<double *> > local_messages;
+    /* Protects local_messages, which can be used by several threads. */
+    mutex local_messages_lock;
+    void put_local_message(const string& src, const string& dest,
+                           double *buf);
+    double *get_local_message(const string& src, const string& dest);
+    /* Parts of bundled messages that have been received but not used yet,
+     * keyed by "rank:tag", see take_segment() in tango.cc. */
+    unordered_map<string, list<RecvMessage> > segments;
+    /* The ranks that a thread is receiving bundles from, only one thread at
+     * a time does this for each rank. */
+    set<int> receiving_ranks;
+    /* Protects segments and receiving_ranks. */
+    mutex segments_lock;
+    /* Signalled whenever segments are added or a thread stops receiving. */
+    condition_variable segments_ready;
+    /* With node aggregation, the node of each rank, numbered by its lowest
+     * rank, and the leader of each grid id on each node. */
+    vector<int> rank_nodes;
+    map<pair<int, int>, int> node_leaders;
+    /* Optional helper thread that completes sends in the background. */
+    thread progress_thread;
+    atomic<bool> stop_progress;
+    /* Records a timeline if the config of a component asks for it, nullptr
+     * otherwise. tracing is true if any rank has a tracer, then all ranks
+     * take part in comparing clocks and writing the traces. */
+    Tracer *tracer;
+    bool tracing;
+    /* The component that API calls of the calling thread apply to, see
+     * tango_set_component(). Threads that haven't chosen one get the first,
+     * nullptr before there are any. */
+    Component *get_component(void);
+    void set_component(Component *c);
+    void clear_components(void);
+    Context(Transport *transport);
+private:
+    /* Each thread has its own current component, like its own epochs, so
+     * that threads working on different components don't get in each
+     * other's way. */
+    unordered_map<thread::id, Component *> current_components;
+    mutex current_components_lock;
 };
 
-Transfer::Transfer(string timestamp, string peer)
-    : curr_time(timestamp), peer_grid(peer), total_send_size(0), total_recv_size(0) {}
+Context::Context(Transport *transport)
+    : transport(transport), stop_progress(false), tracer(nullptr),
+      tracing(false) {}
+
+Component *Context::get_component(void)
+{
+    lock_guard<mutex> guard(current_components_lock);
+    auto it = current_components.find(this_thread::get_id());
+
+    if (it != current_components.end()) {
+        return it->second;
+    }
+    return components.empty() ? nullptr : components.front();
+}
+
+void Context::set_component(Component *c)
+{
+    lock_guard<mutex> guard(current_components_lock);
+    current_components[this_thread::get_id()] = c;
+}
+
+void Context::clear_components(void)
+{
+    lock_guard<mutex> guard(current_components_lock);
+    current_components.clear();
+    components.clear();
+}
+
+void Context::put_local_message(const string& src, const string& dest,
+                                double *buf)
+{
+    lock_guard<mutex> guard(local_messages_lock);
+    local_messages[src + ":" + dest].push_back(buf);
+}
+
+/* Returns nullptr if there is no message waiting. */
+double *Context::get_local_message(const string& src, const string& dest)
+{
+    lock_guard<mutex> guard(local_messages_lock);
+    auto& msgs = local_messages[src + ":" + dest];
 
+    if (msgs.empty()) {
+        return nullptr;
+    }
+    double *buf = msgs.front();
+    msgs.pop_front();
+    return buf;
+}
@@ -0,0 +1,304 @@
+/* A native Python module, _tango, for the calls that are made every
+ * transfer. lib/tango.py uses it when it has been built, see the Makefile,
+ * and falls back to ctypes otherwise. Setup and other rare calls always go
+ * through ctypes, both end up in the same libtango.so.
+ *
+ * Fields can be anything with the buffer protocol holding C contiguous
+ * doubles, e.g. NumPy arrays, and are used in place. Tango keeps a pointer
+ * to each field until tango_end_transfer(), so the module holds on to the
+ * buffers until then. The GIL is released while a transfer begins, which
+ * waits for the sends of the previous one, and while it packs, sends, waits
+ * and unpacks, so other Python threads keep running.
+ */
+
+#include <Python.h>
+#include <string.h>
+#include <vector>
+
+#include "tango.h"
+
+using namespace std;
+
+/* Buffers of the fields of the current transfer of each thread. */
+static thread_local vector<Py_buffer> held_buffers;
+
+static void release_buffers(void)
+{
+    for (auto& view : held_buffers) {
+        PyBuffer_Release(&view);
+    }
+    held_buffers.clear();
+}
+
+/* Get the buffer of doubles of obj, a writable one for a get. The buffer is
+ * held until the end of the transfer. Returns nullptr with an exception set
+ * if obj isn't suitable. */
+static Py_buffer *get_field(PyObject *obj, bool writable)
+{
+    Py_buffer view;
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+
+    if (writable) {
+        flags |= PyBUF_WRITABLE;
+    }
+    if (PyObject_GetBuffer(obj, &view, flags) != 0) {
+        return nullptr;
+    }
+
+    /* NumPy gives "d" for native float64, others may say the byte order. */
+    const char *format = view.format == nullptr ? "B" : view.format;
+    if (view.itemsize != sizeof(double) ||
+        (strcmp(format, "d") != 0 && strcmp(format, "=d") != 0 &&
+         strcmp(format, "@d") != 0)) {
+        PyErr_Format(PyExc_TypeError,
+                     "a field must hold float64, not format '%s'", format);
+        PyBuffer_Release(&view);
+        return nullptr;
+    }
+
+    held_buffers.push_back(view);
+    return &held_buffers.back();
+}
+
+static int field_size(const Py_buffer *view)
+{
+    return view->len / sizeof(double);
+}
+
+static PyObject *begin_transfer(PyObject *self, PyObject *args)
+{
+    const char *timestamp, *grid;
+
+    if (!PyArg_ParseTuple(args, "ss", &timestamp, &grid)) {
+        return nullptr;
+    }
+    release_buffers();
+    Py_BEGIN_ALLOW_THREADS
+    tango_begin_transfer(timestamp, grid);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *begin_multi_transfer(PyObject *self, PyObject *args)
+{
+    const char *timestamp;
+
+    if (!PyArg_ParseTuple(args, "s", &timestamp)) {
+        return nullptr;
+    }
+    release_buffers();
+    Py_BEGIN_ALLOW_THREADS
+    tango_begin_multi_transfer(timestamp);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+/* The calls that take a field name and a field. */
+typedef void (*FieldCall)(const char *, double *, int);
+
+static PyObject *field_call(PyObject *args, FieldCall call, bool writable)
+{
+    const char *name;
+    PyObject *obj;
+
+    if (!PyArg_ParseTuple(args, "sO", &name, &obj)) {
+        return nullptr;
+    }
+    Py_buffer *view = get_field(obj, writable);
+    if (view == nullptr) {
+        return nullptr;
+    }
+    call(name, static_cast<double *>(view->buf), field_size(view));
+    Py_RETURN_NONE;
+}
+
+static PyObject *put(PyObject *self, PyObject *args)
+{
+    return field_call(args, tango_put, false);
+}
+
+static PyObject *get(PyObject *self, PyObject *args)
+{
+    return field_call(args, tango_get, true);
+}
+
+static PyObject *accumulate(PyObject *self, PyObject *args)
+{
+    return field_call(args, tango_accumulate, false);
+}
+
+/* The first dimension of the field is the ensemble member, so it needs at
+ * least two. */
+static PyObject *ensemble_call(PyObject *args, bool put)
+{
+    const char *name;
+    PyObject *obj;
+
+    if (!PyArg_ParseTuple(args, "sO", &name, &obj)) {
+        return nullptr;
+    }
+    Py_buffer *view = get_field(obj, !put);
+    if (view == nullptr) {
+        return nullptr;
+    }
+    if (view->ndim < 2 || view->shape[0] == 0) {
+        PyErr_Format(PyExc_TypeError,
+                     "an ensemble field needs at least two dimensions, the "
+                     "first being the member, not %d", view->ndim);
+        PyBuffer_Release(view);
+        held_buffers.pop_back();
+        return nullptr;
+    }
+    int num_members = view->shape[0];
+    int size = field_size(view) / num_members;
+    double *data = static_cast<double *>(view->buf);
+    if (put) {
+        tango_put_ensemble(name, data, size, num_members);
+    } else {
+        tango_get_ensemble(name, data, size, num_members);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *put_ensemble(PyObject *self, PyObject *args)
+{
+    return ensemble_call(args, true);
+}
+
+static PyObject *get_ensemble(PyObject *self, PyObject *args)
+{
+    return ensemble_call(args, false);
+}
+
+static PyObject *peer_call(PyObject *args, bool put)
+{
+    const char *grid, *name;
+    PyObject *obj;
+
+    if (!PyArg_ParseTuple(args, "ssO", &grid, &name, &obj)) {
+        return nullptr;
+    }
+    Py_buffer *view = get_field(obj, !put);
+    if (view == nullptr) {
+        return nullptr;
+    }
+    double *data = static_cast<double *>(view->buf);
+    if (put) {
+        tango_put_to(grid, name, data, field_size(view));
+    } else {
+        tango_get_from(grid, name, data, field_size(view));
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *put_to(PyObject *self, PyObject *args)
+{
+    return peer_call(args, true);
+}
+
+static PyObject *get_from(PyObject *self, PyObject *args)
+{
+    return peer_call(args, false);
+}
+
+/* Put or get every field of a dict of field name to field, in the order of
+ * the dict. */
+static PyObject *fields_call(PyObject *args, bool put)
+{
+    PyObject *fields, *key, *value;
+    Py_ssize_t pos = 0;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &fields)) {
+        return nullptr;
+    }
+    while (PyDict_Next(fields, &pos, &key, &value)) {
+        const char *name = PyUnicode_AsUTF8(key);
+
+        if (name == nullptr) {
+            return nullptr;
+        }
+        Py_buffer *view = get_field(value, !put);
+        if (view == nullptr) {
+            return nullptr;
+        }
+        double *data = static_cast<double *>(view->buf);
+        if (put) {
+            tango_put(name, data, field_size(view));
+        } else {
+            tango_get(name, data, field_size(view));
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *put_fields(PyObject *self, PyObject *args)
+{
+    return fields_call(args, true);
+}
+
+static PyObject *get_fields(PyObject *self, PyObject *args)
+{
+    return fields_call(args, false);
+}
+
+static PyObject *end_transfer(PyObject *self, PyObject *args)
+{
+    Py_BEGIN_ALLOW_THREADS
+    tango_end_transfer();
+    Py_END_ALLOW_THREADS
+    release_buffers();
+    Py_RETURN_NONE;
+}
+
+static PyObject *progress(PyObject *self, PyObject *args)
+{
+    Py_BEGIN_ALLOW_THREADS
+    tango_progress();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *finalize(PyObject *self, PyObject *args)
+{
+    Py_BEGIN_ALLOW_THREADS
+    tango_finalize();
+    Py_END_ALLOW_THREADS
+    release_buffers();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = {
+    {"begin_transfer", begin_transfer, METH_VARARGS,
+     "begin_transfer(timestamp, grid)"},
+    {"begin_multi_transfer", begin_multi_transfer, METH_VARARGS,
+     "begin_multi_transfer(timestamp)"},
+    {"put", put, METH_VARARGS, "put(name, field)"},
+    {"get", get, METH_VARARGS, "get(name, field)"},
+    {"accumulate", accumulate, METH_VARARGS, "accumulate(name, field)"},
+    {"put_ensemble", put_ensemble, METH_VARARGS,
+     "put_ensemble(name, field), the first dimension is the member"},
+    {"get_ensemble", get_ensemble, METH_VARARGS,
+     "get_ensemble(name, field), the first dimension is the member"},
+    {"put_to", put_to, METH_VARARGS, "put_to(grid, name, field)"},
+    {"get_from", get_from, METH_VARARGS, "get_from(grid, name, field)"},
+    {"put_fields", put_fields, METH_VARARGS,
+     "put_fields(fields), fields is a dict of name to field"},
+    {"get_fields", get_fields, METH_VARARGS,
+     "get_fields(fields), fields is a dict of name to field"},
+    {"end_transfer", end_transfer, METH_NOARGS,
+     "end_transfer(), without the GIL"},
+    {"progress", progress, METH_NOARGS, "progress(), without the GIL"},
+    {"finalize", finalize, METH_NOARGS, "finalize(), without the GIL"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "_tango",
+    "Per transfer calls of Tango, see lib/tango.py.", -1, methods,
+    nullptr, nullptr, nullptr, nullptr
+};
+
+PyMODINIT_FUNC PyInit__tango(void)
+{
+    return PyModule_Create(&module);
+}
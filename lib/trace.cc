@@ -0,0 +1,223 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "trace.h"
+
+/* Round trips to rank 0 when comparing clocks, the quickest is used. */
+#define SYNC_ROUNDS (8)
+
+/* Threads are numbered in the order that they first record something. */
+static atomic<uint32_t> num_threads(0);
+static thread_local uint32_t thread_number = numeric_limits<uint32_t>::max();
+
+int64_t trace_now(void)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer::Tracer(const string& path, unsigned int max_events)
+    : path(path), capacity(1), next_event(0), num_syncs(0)
+{
+    while (capacity < max_events) {
+        capacity *= 2;
+    }
+    events.reset(new TraceEvent[capacity]);
+    for (uint64_t i = 0; i < capacity; i++) {
+        events[i].sequence = 0;
+    }
+}
+
+void Tracer::record(const char *name, int64_t start, int64_t end,
+                    const string& detail)
+{
+    if (thread_number == numeric_limits<uint32_t>::max()) {
+        thread_number = num_threads++;
+    }
+
+    uint64_t n = next_event++;
+    TraceEvent& e = events[n & (capacity - 1)];
+
+    /* Mark the slot as being written, in case the buffer wraps around onto
+     * a thread that is still busy with it. */
+    e.sequence.store(0, memory_order_relaxed);
+    e.name = name;
+    e.start = start;
+    e.end = end;
+    e.thread = thread_number;
+    size_t length = min(detail.size(), (size_t)MAX_TRACE_DETAIL - 1);
+    memcpy(e.detail, detail.data(), length);
+    e.detail[length] = '\0';
+    e.sequence.store(n + 1, memory_order_release);
+}
+
+/* Convert a time on our clock to one on rank 0's. The offset between the
+ * clocks is taken to change linearly between the two syncs. */
+int64_t Tracer::to_rank_0_time(int64_t t) const
+{
+    if (num_syncs == 0) {
+        return t;
+    }
+    if (num_syncs == 1 || sync_times[1] == sync_times[0]) {
+        return t + offsets[0];
+    }
+
+    double drift = (double)(offsets[1] - offsets[0]) /
+                   (sync_times[1] - sync_times[0]);
+    return t + offsets[0] + (int64_t)(drift * (t - sync_times[0]));
+}
+
+/* Find the offset of rank 0's clock from that of every other rank. Each rank
+ * in turn asks rank 0 for the time, assuming that the answer was given half
+ * way through the round trip, and keeps the estimate from the quickest
+ * round trip. The first call is made at initialisation and the second at
+ * the end. */
+void Tracer::sync_clocks(Transport& transport, Tracer *tracer, int tag)
+{
+    int rank = transport.get_rank();
+    unsigned char ask = 0;
+    int64_t now;
+
+    if (rank == 0) {
+        RecvMessage buf;
+        for (int r = 1; r < transport.get_size(); r++) {
+            for (int i = 0; i < SYNC_ROUNDS; i++) {
+                transport.recv_bytes(buf, r, tag);
+                now = trace_now();
+                transport.wait(transport.isend_bytes(
+                    reinterpret_cast<unsigned char *>(&now), sizeof(now),
+                    r, tag));
+            }
+        }
+    }
+
+    int64_t best_round_trip = numeric_limits<int64_t>::max();
+    int64_t offset = 0, sync_time = trace_now();
+    if (rank != 0) {
+        RecvMessage buf;
+        for (int i = 0; i < SYNC_ROUNDS; i++) {
+            int64_t sent = trace_now();
+            transport.wait(transport.isend_bytes(&ask, sizeof(ask), 0, tag));
+            transport.recv_bytes(buf, 0, tag);
+            int64_t received = trace_now();
+
+            assert(buf.size() == sizeof(now));
+            memcpy(&now, buf.data(), sizeof(now));
+            if (received - sent < best_round_trip) {
+                best_round_trip = received - sent;
+                sync_time = sent + ((received - sent) / 2);
+                offset = now - sync_time;
+            }
+        }
+    }
+
+    if (tracer != nullptr && tracer->num_syncs < 2) {
+        tracer->sync_times[tracer->num_syncs] = sync_time;
+        tracer->offsets[tracer->num_syncs] = offset;
+        tracer->num_syncs++;
+    }
+}
+
+/* Write s as a quoted JSON string. Field names and timestamps come from the
+ * user, so they may need escaping. */
+static void write_json_string(ostream& out, const char *s)
+{
+    out << '"';
+    for (const char *c = s; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            out << '\\' << *c;
+        } else if ((unsigned char)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out << escaped;
+        } else {
+            out << *c;
+        }
+    }
+    out << '"';
+}
+
+/* Write the events of this rank as Chrome trace JSON to path.<rank>.json.
+ * Times are in microseconds from the first event of any rank. label names
+ * the rank in the timeline. Collective, like sync_clocks(). */
+void Tracer::write(Transport& transport, Tracer *tracer, const string& label)
+{
+    int rank = transport.get_rank();
+    vector<TraceEvent *> recorded;
+
+    if (tracer != nullptr) {
+        uint64_t last = tracer->next_event;
+        uint64_t first = last > tracer->capacity ? last - tracer->capacity : 0;
+        for (uint64_t n = first; n < last; n++) {
+            TraceEvent *e = &tracer->events[n & (tracer->capacity - 1)];
+            if (e->sequence.load(memory_order_acquire) == n + 1) {
+                recorded.push_back(e);
+            }
+        }
+    }
+
+    /* The earliest event of any rank is time zero. It is passed around as
+     * two ints, in milliseconds to leave room. */
+    int64_t earliest = numeric_limits<int64_t>::max() / 2;
+    for (auto e : recorded) {
+        earliest = min(earliest, tracer->to_rank_0_time(e->start));
+    }
+    int64_t earliest_ms = earliest / 1000000;
+    vector<int> mine = {(int)(earliest_ms >> 31),
+                        (int)(earliest_ms & 0x7FFFFFFF)};
+    vector<int> all, sizes;
+    transport.allgatherv(mine, all, sizes);
+
+    int64_t zero = numeric_limits<int64_t>::max();
+    for (size_t i = 0; i < all.size(); i += 2) {
+        zero = min(zero, ((int64_t)all[i] << 31) + all[i + 1]);
+    }
+    zero *= 1000000;
+
+    if (tracer == nullptr) {
+        return;
+    }
+
+    string file_name = tracer->path + "." + to_string(rank) + ".json";
+    ofstream out(file_name);
+    if (!out) {
+        cerr << "Error: can't write trace " << file_name << endl;
+        return;
+    }
+
+    out.precision(3);
+    out << fixed;
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << rank
+        << ", \"args\": {\"name\": ";
+    write_json_string(out, label.c_str());
+    out << "}}";
+    out << "," << endl
+        << "{\"name\": \"process_sort_index\", \"ph\": \"M\", \"pid\": "
+        << rank << ", \"args\": {\"sort_index\": " << rank << "}}";
+
+    for (auto e : recorded) {
+        double start = (tracer->to_rank_0_time(e->start) - zero) / 1e3;
+        double duration = (e->end - e->start) / 1e3;
+
+        out << "," << endl << "{\"name\": ";
+        write_json_string(out, e->name);
+        out << ", \"ph\": \"X\", \"ts\": " << start << ", \"dur\": "
+            << duration << ", \"pid\": " << rank << ", \"tid\": "
+            << e->thread;
+        if (e->detail[0] != '\0') {
+            out << ", \"args\": {\"detail\": ";
+            write_json_string(out, e->detail);
+            out << "}";
+        }
+        out << "}";
+    }
+    out << endl << "]}" << endl;
+}
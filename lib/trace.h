@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "transport.h"
+
+using namespace std;
+
+/* Longest detail, e.g. a field name, kept with an event. Longer ones are cut
+ * short. */
+#define MAX_TRACE_DETAIL (40)
+
+/* Monotonic time in nanoseconds on this rank. */
+int64_t trace_now(void);
+
+/* An event in the ring buffer, see Tracer. sequence is zero while the slot
+ * has never been written, otherwise one more than the number of the event
+ * in it. */
+struct TraceEvent {
+    atomic<uint64_t> sequence;
+    const char *name;
+    int64_t start;
+    int64_t end;
+    uint32_t thread;
+    char detail[MAX_TRACE_DETAIL];
+};
+
+/* Records what a rank spends its time on, for a timeline of a whole run. See
+ * trace in config.yaml.
+ *
+ * Events go into a fixed size ring buffer, when it is full the oldest are
+ * overwritten. Recording doesn't take a lock so that several threads of a
+ * rank can record at once. The clocks of all ranks are compared with that of
+ * rank 0 at initialisation and again at the end, see sync_clocks(), so
+ * events line up across ranks. At the end each rank writes its events as
+ * Chrome trace JSON, which can be loaded into Perfetto or chrome://tracing
+ * one file at a time or merged. */
+class Tracer {
+private:
+    string path;
+    unique_ptr<TraceEvent[]> events;
+    /* A power of two. */
+    uint64_t capacity;
+    atomic<uint64_t> next_event;
+    /* The offset of rank 0's clock from ours, at two local times. */
+    int64_t sync_times[2];
+    int64_t offsets[2];
+    int num_syncs;
+    int64_t to_rank_0_time(int64_t t) const;
+public:
+    Tracer(const string& path, unsigned int max_events);
+    /* name must be a string literal or otherwise outlive the tracer. */
+    void record(const char *name, int64_t start, int64_t end,
+                const string& detail = "");
+    /* Collective over all ranks of the transport, whether or not they have a
+     * tracer. */
+    static void sync_clocks(Transport& transport, Tracer *tracer, int tag);
+    static void write(Transport& transport, Tracer *tracer,
+                      const string& label);
+};
+
+/* Records an event from its construction to the end of the scope. Does
+ * nothing if tracer is nullptr, i.e. tracing is off. */
+class TraceScope {
+private:
+    Tracer *tracer;
+    const char *name;
+    string detail;
+    int64_t start;
+public:
+    TraceScope(Tracer *tracer, const char *name, const string& detail = "")
+        : tracer(tracer), name(name)
+        {
+            if (tracer != nullptr) {
+                this->detail = detail;
+                start = trace_now();
+            }
+        }
+    ~TraceScope()
+        {
+            if (tracer != nullptr) {
+                tracer->record(name, start, trace_now(), detail);
+            }
+        }
+};
@@ -0,0 +1,403 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#include "transport.h"
+
+/* An MPI send in progress. */
+class MpiSendRequest : public SendRequest {
+public:
+    MPI_Request request;
+};
+
+int MpiTransport::get_rank(void) const
+{
+    int rank;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+}
+
+int MpiTransport::get_size(void) const
+{
+    int size;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+}
+
+SendRequest *MpiTransport::isend(const double *buf, unsigned int count,
+                                 int dest, int tag)
+{
+    MpiSendRequest *request = new MpiSendRequest;
+
+    MPI_Isend(const_cast<double *>(buf), count, MPI_DOUBLE, dest, tag,
+              MPI_COMM_WORLD, &request->request);
+    return request;
+}
+
+void MpiTransport::wait(SendRequest *request)
+{
+    MpiSendRequest *r = static_cast<MpiSendRequest *>(request);
+
+    MPI_Wait(&r->request, MPI_STATUS_IGNORE);
+    delete r;
+}
+
+void MpiTransport::test_some(vector<SendRequest *>& requests)
+{
+    vector<MPI_Request> mpi_requests(requests.size());
+    vector<int> indices(requests.size());
+    int count;
+
+    if (requests.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        mpi_requests[i] = static_cast<MpiSendRequest *>(requests[i])->request;
+    }
+
+    MPI_Testsome(mpi_requests.size(), mpi_requests.data(), &count,
+                 indices.data(), MPI_STATUSES_IGNORE);
+    if (count == MPI_UNDEFINED) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        delete requests[indices[i]];
+        requests[indices[i]] = nullptr;
+    }
+}
+
+void MpiTransport::recv(double *buf, unsigned int count, int src, int tag)
+{
+    MPI_Status status;
+
+    MPI_Recv(buf, count, MPI_DOUBLE, src, tag, MPI_COMM_WORLD, &status);
+}
+
+SendRequest *MpiTransport::isend_bytes(const unsigned char *buf,
+                                       unsigned int size, int dest, int tag)
+{
+    MpiSendRequest *request = new MpiSendRequest;
+
+    MPI_Isend(const_cast<unsigned char *>(buf), size, MPI_BYTE, dest, tag,
+              MPI_COMM_WORLD, &request->request);
+    return request;
+}
+
+void MpiTransport::recv_bytes(RecvMessage& buf, int src, int tag)
+{
+    MPI_Status status;
+    int size;
+
+    MPI_Probe(src, tag, MPI_COMM_WORLD, &status);
+    MPI_Get_count(&status, MPI_BYTE, &size);
+
+    buf.resize(size);
+    MPI_Recv(buf.data(), size, MPI_BYTE, src, tag, MPI_COMM_WORLD, &status);
+}
+
+/* An MPI receive in progress. */
+class MpiRecvRequest : public RecvRequest {
+public:
+    MPI_Request request;
+};
+
+RecvRequest *MpiTransport::irecv_bytes(unsigned char *buf,
+                                       unsigned int max_size, int src, int tag)
+{
+    MpiRecvRequest *request = new MpiRecvRequest;
+
+    MPI_Irecv(buf, max_size, MPI_BYTE, src, tag, MPI_COMM_WORLD,
+              &request->request);
+    return request;
+}
+
+unsigned int MpiTransport::wait_recv(RecvRequest *request)
+{
+    MpiRecvRequest *r = static_cast<MpiRecvRequest *>(request);
+    MPI_Status status;
+    int size;
+
+    MPI_Wait(&r->request, &status);
+    MPI_Get_count(&status, MPI_BYTE, &size);
+    delete r;
+    return size;
+}
+
+void MpiTransport::allgatherv(const vector<int>& data, vector<int>& all_data,
+                              vector<int>& all_sizes)
+{
+    int size = data.size();
+    int num_ranks = get_size();
+    vector<int> displacements(num_ranks);
+
+    all_sizes.resize(num_ranks);
+    MPI_Allgather(&size, 1, MPI_INT, all_sizes.data(), 1, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    int total_size = 0;
+    for (int r = 0; r < num_ranks; r++) {
+        displacements[r] = total_size;
+        total_size += all_sizes[r];
+    }
+
+    all_data.resize(total_size);
+    MPI_Allgatherv(data.data(), size, MPI_INT, all_data.data(),
+                   all_sizes.data(), displacements.data(), MPI_INT,
+                   MPI_COMM_WORLD);
+}
+
+void MpiTransport::gatherv(const vector<int>& data, vector<int>& all_data,
+                           vector<int>& all_sizes)
+{
+    int size = data.size();
+    int num_ranks = get_size();
+    bool root = (get_rank() == 0);
+    vector<int> displacements;
+
+    all_data.clear();
+    all_sizes.clear();
+    if (root) {
+        all_sizes.resize(num_ranks);
+        displacements.resize(num_ranks);
+    }
+    MPI_Gather(&size, 1, MPI_INT, all_sizes.data(), 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+
+    if (root) {
+        int total_size = 0;
+        for (int r = 0; r < num_ranks; r++) {
+            displacements[r] = total_size;
+            total_size += all_sizes[r];
+        }
+        all_data.resize(total_size);
+    }
+    MPI_Gatherv(data.data(), size, MPI_INT, all_data.data(),
+                all_sizes.data(), displacements.data(), MPI_INT, 0,
+                MPI_COMM_WORLD);
+}
+
+/* Only the producer moves the tail and only the consumer moves the head, so
+ * no locks are needed. */
+void MessageQueue::push(ThreadMessage *msg)
+{
+    size_t t = tail.load(memory_order_relaxed);
+
+    /* Wait for space. This only happens if the receiver is a long way
+     * behind. */
+    while ((t - head.load(memory_order_acquire)) == capacity) {
+        this_thread::yield();
+    }
+
+    slots[t % capacity] = msg;
+    tail.store(t + 1, memory_order_release);
+}
+
+ThreadMessage *MessageQueue::pop(void)
+{
+    size_t h = head.load(memory_order_relaxed);
+
+    if (h == tail.load(memory_order_acquire)) {
+        return nullptr;
+    }
+
+    ThreadMessage *msg = slots[h % capacity];
+    head.store(h + 1, memory_order_release);
+    return msg;
+}
+
+ThreadWorld::ThreadWorld(int size)
+    : size(size), queues(size * size), arrived(0), generation(0),
+      slots(size) {}
+
+void ThreadWorld::barrier(void)
+{
+    unique_lock<mutex> guard(lock);
+    unsigned long my_generation = generation;
+
+    arrived++;
+    if (arrived == size) {
+        arrived = 0;
+        generation++;
+        cond.notify_all();
+    } else {
+        cond.wait(guard, [&]{ return generation != my_generation; });
+    }
+}
+
+void ThreadWorld::allgatherv(int rank, const vector<int>& data,
+                             vector<int>& all_data, vector<int>& all_sizes)
+{
+    slots[rank] = data;
+    barrier();
+
+    all_data.clear();
+    all_sizes.resize(size);
+    for (int r = 0; r < size; r++) {
+        all_sizes[r] = slots[r].size();
+        all_data.insert(all_data.end(), slots[r].begin(), slots[r].end());
+    }
+
+    /* Nobody can reuse the slots until everyone has read them. */
+    barrier();
+}
+
+ThreadTransport::ThreadTransport(ThreadWorld& world, int rank)
+    : world(world), rank(rank), unexpected(world.get_size()) {}
+
+SendRequest *ThreadTransport::isend(const double *buf, unsigned int count,
+                                    int dest, int tag)
+{
+    return isend_bytes(reinterpret_cast<const unsigned char *>(buf),
+                       count * sizeof(double), dest, tag);
+}
+
+SendRequest *ThreadTransport::isend_bytes(const unsigned char *buf,
+                                          unsigned int size, int dest, int tag)
+{
+    ThreadMessage *msg = new ThreadMessage(buf, size, tag);
+
+    world.get_queue(rank, dest).push(msg);
+    return msg;
+}
+
+void ThreadTransport::wait(SendRequest *request)
+{
+    ThreadMessage *msg = static_cast<ThreadMessage *>(request);
+
+    while (!msg->done.load(memory_order_acquire)) {
+        this_thread::yield();
+    }
+    delete msg;
+}
+
+void ThreadTransport::test_some(vector<SendRequest *>& requests)
+{
+    for (auto& request : requests) {
+        ThreadMessage *msg = static_cast<ThreadMessage *>(request);
+
+        if (msg->done.load(memory_order_acquire)) {
+            delete msg;
+            request = nullptr;
+        }
+    }
+}
+
+/* Wait for the next message from src with tag. */
+ThreadMessage *ThreadTransport::match(int src, int tag)
+{
+    ThreadMessage *msg = nullptr;
+
+    /* Messages from one source with the same tag arrive in order, like MPI.
+     * Check for one that has already arrived first. */
+    auto& early = unexpected[src];
+    for (auto it = early.begin(); it != early.end(); ++it) {
+        if ((*it)->tag == tag) {
+            msg = *it;
+            early.erase(it);
+            break;
+        }
+    }
+
+    MessageQueue& queue = world.get_queue(src, rank);
+    while (msg == nullptr) {
+        ThreadMessage *m = queue.pop();
+        if (m == nullptr) {
+            this_thread::yield();
+        } else if (m->tag == tag) {
+            msg = m;
+        } else {
+            early.push_back(m);
+        }
+    }
+
+    return msg;
+}
+
+void ThreadTransport::recv(double *buf, unsigned int count, int src, int tag)
+{
+    ThreadMessage *msg = match(src, tag);
+
+    if (msg->size != count * sizeof(double)) {
+        cerr << "Error: expected message of size " << count << " from rank "
+             << src << " but got " << msg->size / sizeof(double) << endl;
+        abort();
+    }
+
+    /* Copy straight out of the sender's buffer and hand it back. */
+    copy(msg->buf, msg->buf + msg->size,
+         reinterpret_cast<unsigned char *>(buf));
+    msg->done.store(true, memory_order_release);
+}
+
+void ThreadTransport::recv_bytes(RecvMessage& buf, int src, int tag)
+{
+    ThreadMessage *msg = match(src, tag);
+
+    buf.assign(msg->buf, msg->buf + msg->size);
+    msg->done.store(true, memory_order_release);
+}
+
+/* A receive between thread ranks. Nothing happens until it is waited on. */
+class ThreadRecvRequest : public RecvRequest {
+public:
+    unsigned char *buf;
+    unsigned int max_size;
+    int src;
+    int tag;
+};
+
+RecvRequest *ThreadTransport::irecv_bytes(unsigned char *buf,
+                                          unsigned int max_size,
+                                          int src, int tag)
+{
+    ThreadRecvRequest *request = new ThreadRecvRequest;
+
+    request->buf = buf;
+    request->max_size = max_size;
+    request->src = src;
+    request->tag = tag;
+    return request;
+}
+
+unsigned int ThreadTransport::wait_recv(RecvRequest *request)
+{
+    ThreadRecvRequest *r = static_cast<ThreadRecvRequest *>(request);
+    ThreadMessage *msg = match(r->src, r->tag);
+    unsigned int size = msg->size;
+
+    if (size > r->max_size) {
+        cerr << "Error: message of " << size << " bytes from rank " << r->src
+             << " is larger than the " << r->max_size << " expected." << endl;
+        abort();
+    }
+
+    copy(msg->buf, msg->buf + size, r->buf);
+    msg->done.store(true, memory_order_release);
+    delete r;
+    return size;
+}
+
+void ThreadTransport::allgatherv(const vector<int>& data,
+                                 vector<int>& all_data,
+                                 vector<int>& all_sizes)
+{
+    world.allgatherv(rank, data, all_data, all_sizes);
+}
+
+/* Only used at initialisation, so just do an allgatherv. */
+void ThreadTransport::gatherv(const vector<int>& data, vector<int>& all_data,
+                              vector<int>& all_sizes)
+{
+    world.allgatherv(rank, data, all_data, all_sizes);
+    if (rank != 0) {
+        all_data.clear();
+        all_sizes.clear();
+    }
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <vector>
+#include <mpi.h>
+
+#include "accounting.h"
+
+using namespace std;
+
+/* Received data that hasn't been unpacked yet. */
+typedef counted_vector<unsigned char, MEMORY_RECV_BUFFERS> RecvMessage;
+
+/* A handle to a send that has been started, see Transport::isend(). */
+class SendRequest {
+public:
+    virtual ~SendRequest() {}
+};
+
+/* A handle to a receive that has been started, see
+ * Transport::irecv_bytes(). */
+class RecvRequest {
+public:
+    virtual ~RecvRequest() {}
+};
+
+/* The layer that moves coupling data between ranks. Everything above this
+ * deals in ranks and tags so it doesn't care whether the ranks are MPI
+ * processes or threads. */
+class Transport {
+public:
+    virtual ~Transport() {}
+    virtual int get_rank(void) const = 0;
+    virtual int get_size(void) const = 0;
+
+    /* Start sending count doubles to dest. The buffer must not be touched
+     * until wait() has been called on the returned request. */
+    virtual SendRequest *isend(const double *buf, unsigned int count,
+                               int dest, int tag) = 0;
+    /* Wait for a send to complete. This also deletes the request. */
+    virtual void wait(SendRequest *request) = 0;
+    /* Check some sends without blocking. Those that are complete are
+     * deleted and set to nullptr. */
+    virtual void test_some(vector<SendRequest *>& requests) = 0;
+    /* Blocking receive of count doubles from src. */
+    virtual void recv(double *buf, unsigned int count, int src, int tag) = 0;
+
+    /* As above but for messages of bytes, e.g. compressed data. The receiver
+     * doesn't need to know the size, buf is resized to fit. */
+    virtual SendRequest *isend_bytes(const unsigned char *buf,
+                                     unsigned int size, int dest, int tag) = 0;
+    virtual void recv_bytes(RecvMessage& buf, int src, int tag) = 0;
+    /* Start receiving a message of at most max_size bytes. buf must not be
+     * touched until wait_recv() has been called on the returned request. */
+    virtual RecvRequest *irecv_bytes(unsigned char *buf, unsigned int max_size,
+                                     int src, int tag) = 0;
+    /* Wait for a receive to complete and return the size of the message.
+     * This also deletes the request. */
+    virtual unsigned int wait_recv(RecvRequest *request) = 0;
+
+    /* Collective. Gather a variable length array of ints from every rank
+     * onto every rank. The arrays are concatenated in rank order into
+     * all_data, the size of each is put into all_sizes. */
+    virtual void allgatherv(const vector<int>& data, vector<int>& all_data,
+                            vector<int>& all_sizes) = 0;
+    /* Collective. As above but only rank 0 gets the result, on the others
+     * all_data and all_sizes are left empty. */
+    virtual void gatherv(const vector<int>& data, vector<int>& all_data,
+                         vector<int>& all_sizes) = 0;
+};
+
+/* The usual transport, between MPI_COMM_WORLD ranks. */
+class MpiTransport : public Transport {
+public:
+    int get_rank(void) const;
+    int get_size(void) const;
+    SendRequest *isend(const double *buf, unsigned int count,
+                       int dest, int tag);
+    void wait(SendRequest *request);
+    void test_some(vector<SendRequest *>& requests);
+    void recv(double *buf, unsigned int count, int src, int tag);
+    SendRequest *isend_bytes(const unsigned char *buf, unsigned int size,
+                             int dest, int tag);
+    void recv_bytes(RecvMessage& buf, int src, int tag);
+    RecvRequest *irecv_bytes(unsigned char *buf, unsigned int max_size,
+                             int src, int tag);
+    unsigned int wait_recv(RecvRequest *request);
+    void allgatherv(const vector<int>& data, vector<int>& all_data,
+                    vector<int>& all_sizes);
+    void gatherv(const vector<int>& data, vector<int>& all_data,
+                 vector<int>& all_sizes);
+};
+
+/* A message in flight between two thread ranks. The receiver copies straight
+ * out of the sender's buffer, then sets done to hand the buffer back. */
+class ThreadMessage : public SendRequest {
+public:
+    const unsigned char *buf;
+    /* In bytes. */
+    unsigned int size;
+    int tag;
+    atomic<bool> done;
+    ThreadMessage(const unsigned char *buf, unsigned int size, int tag)
+        : buf(buf), size(size), tag(tag), done(false) {}
+};
+
+/* A lock-free single-producer/single-consumer queue of messages. There is one
+ * of these for each ordered pair of thread ranks. */
+class MessageQueue {
+private:
+    static const size_t capacity = 1024;
+    ThreadMessage *slots[capacity];
+    atomic<size_t> head;
+    atomic<size_t> tail;
+public:
+    MessageQueue() : head(0), tail(0) {}
+    void push(ThreadMessage *msg);
+    ThreadMessage *pop(void);
+};
+
+/* Shared state for a set of threads that act as ranks within a single
+ * process. */
+class ThreadWorld {
+private:
+    int size;
+    /* queues[src * size + dest] */
+    vector<MessageQueue> queues;
+
+    /* For collectives, which only happen during initialisation. */
+    mutex lock;
+    condition_variable cond;
+    int arrived;
+    unsigned long generation;
+    vector<vector<int> > slots;
+
+    void barrier(void);
+public:
+    ThreadWorld(int size);
+    int get_size(void) const { return size; }
+    MessageQueue& get_queue(int src, int dest)
+        { return queues[(src * size) + dest]; }
+    void allgatherv(int rank, const vector<int>& data, vector<int>& all_data,
+                    vector<int>& all_sizes);
+};
+
+/* A transport between threads acting as ranks, see tango_thread_rank_init().
+ * No MPI is used at all. Each rank must only be driven by a single thread. */
+class ThreadTransport : public Transport {
+private:
+    ThreadWorld& world;
+    int rank;
+    /* Messages that have arrived but not yet been matched by tag, one list
+     * for each source rank. */
+    vector<list<ThreadMessage *> > unexpected;
+
+    ThreadMessage *match(int src, int tag);
+public:
+    ThreadTransport(ThreadWorld& world, int rank);
+    int get_rank(void) const { return rank; }
+    int get_size(void) const { return world.get_size(); }
+    SendRequest *isend(const double *buf, unsigned int count,
+                       int dest, int tag);
+    void wait(SendRequest *request);
+    void test_some(vector<SendRequest *>& requests);
+    void recv(double *buf, unsigned int count, int src, int tag);
+    SendRequest *isend_bytes(const unsigned char *buf, unsigned int size,
+                             int dest, int tag);
+    void recv_bytes(RecvMessage& buf, int src, int tag);
+    RecvRequest *irecv_bytes(unsigned char *buf, unsigned int max_size,
+                             int src, int tag);
+    unsigned int wait_recv(RecvRequest *request);
+    void allgatherv(const vector<int>& data, vector<int>& all_data,
+                    vector<int>& all_sizes);
+    void gatherv(const vector<int>& data, vector<int>& all_data,
+                 vector<int>& all_sizes);
+};
@@ -0,0 +1,130 @@
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "compression.h"
+
+using namespace std;
+
+/* A slowly varying field should come back bit for bit and compress well. */
+TEST(Compression, xor_round_trip)
+{
+    const unsigned int size = 1000;
+    const int num_steps = 10;
+    XorHistory send_history, recv_history;
+    vector<double> field(size), result(size);
+    vector<unsigned char> buf(xor_compress_bound(size));
+    size_t total = 0;
+
+    for (int t = 0; t < num_steps; t++) {
+        for (unsigned int i = 0; i < size; i++) {
+            /* Most points don't change at all. */
+            field[i] = 280.0 + sin(i * 0.01) + ((i % 10 == 0) ? t * 0.1 : 0);
+        }
+
+        size_t compressed = xor_compress(field.data(), size, send_history,
+                                         buf.data());
+        xor_decompress(buf.data(), compressed, size, recv_history,
+                       result.data());
+
+        for (unsigned int i = 0; i < size; i++) {
+            EXPECT_EQ(field[i], result[i]);
+        }
+        if (t > 0) {
+            total += compressed;
+        }
+    }
+
+    EXPECT_LT(total * 4, size * sizeof(double) * (num_steps - 1));
+}
+
+/* Special values go through unchanged. */
+TEST(Compression, xor_special_values)
+{
+    vector<double> field = {0.0, -0.0, INFINITY, -INFINITY, NAN, 1e-310, 1.0};
+    vector<double> result(field.size());
+    XorHistory send_history, recv_history;
+    vector<unsigned char> buf(xor_compress_bound(field.size()));
+
+    size_t compressed = xor_compress(field.data(), field.size(), send_history,
+                                     buf.data());
+    xor_decompress(buf.data(), compressed, field.size(), recv_history,
+                   result.data());
+
+    for (unsigned int i = 0; i < field.size(); i++) {
+        EXPECT_EQ(0, memcmp(&field[i], &result[i], sizeof(double)));
+    }
+}
+
+/* Check the error bound on a few kinds of field and report how well each
+ * compresses. */
+TEST(Compression, quantize_error_and_ratio)
+{
+    const unsigned int size = 10000;
+    struct {
+        const char *name;
+        double tolerance, relative_tolerance;
+        double (*f)(unsigned int);
+    } fields[] = {
+        {"sst", 1e-3, 0,
+         [](unsigned int i) { return 273.0 + 30 * sin(i * 1e-3); }},
+        {"lw_flux", 0, 1e-5,
+         [](unsigned int i) { return 300.0 * cos(i * 1e-2); }},
+        {"ice_fraction", 1e-4, 0,
+         [](unsigned int i) { return (i % 1000) < 300 ? 1.0 : 0.0; }},
+        {"noise", 1e-6, 0,
+         [](unsigned int i) { return fmod(i * 0.618033988749, 1.0); }},
+    };
+
+    for (const auto& field : fields) {
+        vector<double> data(size), result(size);
+        vector<unsigned char> buf(quantize_compress_bound(size));
+
+        for (unsigned int i = 0; i < size; i++) {
+            data[i] = field.f(i);
+        }
+
+        size_t compressed = quantize_compress(data.data(), size,
+                                              field.tolerance,
+                                              field.relative_tolerance,
+                                              buf.data());
+        size_t used = quantize_decompress(buf.data(), compressed, size,
+                                          result.data());
+        EXPECT_EQ(compressed, used);
+
+        double bound = field.tolerance, max_abs = 0, max_error = 0;
+        for (unsigned int i = 0; i < size; i++) {
+            max_abs = max(max_abs, fabs(data[i]));
+            max_error = max(max_error, fabs(data[i] - result[i]));
+        }
+        if (field.relative_tolerance > 0) {
+            bound = field.relative_tolerance * max_abs;
+        }
+
+        double ratio = (double)(size * sizeof(double)) / compressed;
+        cout << field.name << ": max error " << max_error << " (bound "
+             << bound << "), compression ratio " << ratio << endl;
+
+        EXPECT_LE(max_error, bound);
+        EXPECT_GT(ratio, 1.5);
+    }
+}
+
+/* Values that can't be quantized are kept as they are. */
+TEST(Compression, quantize_not_finite)
+{
+    vector<double> data = {1.0, NAN, 2.0};
+    vector<double> result(data.size());
+    vector<unsigned char> buf(quantize_compress_bound(data.size()));
+
+    size_t compressed = quantize_compress(data.data(), data.size(), 0.1, 0,
+                                          buf.data());
+    quantize_decompress(buf.data(), compressed, data.size(), result.data());
+
+    EXPECT_EQ(1.0, result[0]);
+    EXPECT_TRUE(std::isnan(result[1]));
+    EXPECT_EQ(2.0, result[2]);
+}
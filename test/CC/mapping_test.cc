@@ -0,0 +1,184 @@
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "config.h"
+#include "router.h"
+#include "transport.h"
+
+using namespace std;
+
+/* A mapping with rows of many widths, some with their own kernel and some
+ * not, and buckets of different sizes around the number of rows a kernel
+ * does at once. */
+static void make_mapping(Mapping& mapping, unsigned int num_points)
+{
+    const unsigned int widths[] = {1, 2, 4, 9, 16, 17};
+    const unsigned int num_rows[] = {1, 63, 64, 65, 130, 200};
+    point_t a = 0;
+    unsigned int seed = 1;
+
+    for (unsigned int i = 0; i < 6; i++) {
+        for (unsigned int r = 0; r < num_rows[i]; r++) {
+            for (unsigned int k = 0; k < widths[i]; k++) {
+                seed = (seed * 1103515245u) + 12345u;
+                point_t b = seed % num_points;
+                weight_t w = 0.01 + (seed % 1000) / 997.0;
+                mapping.add_link(a, b, w);
+            }
+            a++;
+        }
+    }
+    mapping.compile();
+}
+
+/* The kernels for each width must give exactly what the generic kernel
+ * does, i.e. add up the links of each row in the same order. */
+TEST(Mapping, kernels_match_generic)
+{
+    const unsigned int num_points = 500;
+    Mapping mapping(nullptr);
+    make_mapping(mapping, num_points);
+
+    vector<double> in(num_points);
+    for (unsigned int i = 0; i < num_points; i++) {
+        in[i] = 280.0 + (i % 37) * 0.731 - (i % 11) * 1.37e-3;
+    }
+
+    unsigned int n = mapping.get_num_points();
+    vector<double> generic(n), kernels(n), chunked(n);
+    mapping.apply(in.data(), generic.data(), true);
+    mapping.apply(in.data(), kernels.data());
+
+    /* Rows done a few at a time, as the threads of a transfer do. */
+    for (unsigned int first = 0; first < n; first += 100) {
+        mapping.apply_rows(in.data(), chunked.data(), first,
+                           min(first + 100, n));
+    }
+
+    for (unsigned int r = 0; r < n; r++) {
+        EXPECT_EQ(generic[r], kernels[r]);
+        EXPECT_EQ(generic[r], chunked[r]);
+    }
+}
+
+/* The same with a field that has a halo, looked up through offsets. */
+TEST(Mapping, kernels_match_generic_with_offsets)
+{
+    const unsigned int num_points = 500;
+    Mapping mapping(nullptr);
+    make_mapping(mapping, num_points);
+
+    vector<point_t> offsets(num_points);
+    vector<double> in(2 * num_points + 1);
+    for (unsigned int i = 0; i < num_points; i++) {
+        offsets[i] = (2 * i) + 1;
+        in[offsets[i]] = 1.0 / (i + 3);
+    }
+
+    unsigned int n = mapping.get_num_points();
+    vector<double> generic(n), kernels(n);
+    mapping.apply(in.data(), generic.data(), true, offsets.data());
+    mapping.apply(in.data(), kernels.data(), false, offsets.data());
+
+    for (unsigned int r = 0; r < n; r++) {
+        EXPECT_EQ(generic[r], kernels[r]);
+    }
+}
+
+/* Append the rows of the mappings of router with peer to rows and, for
+ * send mappings, what they make of a field of field_size points, which
+ * depends on their links and weights. */
+static void add_mappings(const Router& router, string peer, bool send,
+                         unsigned int field_size, vector<point_t>& rows,
+                         vector<double>& values)
+{
+    vector<double> field(field_size);
+    for (unsigned int i = 0; i < field.size(); i++) {
+        field[i] = 1.0 / (i + 1);
+    }
+
+    const auto& mappings = send ? router.get_send_mappings(peer) :
+                                  router.get_recv_mappings(peer);
+    for (const auto& m : mappings) {
+        rows.insert(rows.end(), m->get_rows().begin(), m->get_rows().end());
+        if (send) {
+            vector<double> out(m->get_num_points());
+            m->apply(field.data(), out.data());
+            values.insert(values.end(), out.begin(), out.end());
+        }
+    }
+}
+
+/* Build the routing between an ice and an ocean grid of the given sizes,
+ * both in this process, on the given number of threads. If both_ways the
+ * config has mappings from ice to ocean and back, so each grid sends to and
+ * receives from the other. Returns the rows and results of the mappings,
+ * see add_mappings(). */
+static void build_routing(int num_threads, string config_dir,
+                          unsigned int ice_n, unsigned int ocean_n,
+                          bool both_ways, vector<point_t>& rows,
+                          vector<double>& values)
+{
+#if defined(_OPENMP)
+    omp_set_num_threads(num_threads);
+#endif
+    Config ice_config(config_dir, "ice"), ocean_config(config_dir, "ocean");
+    for (auto config : {&ice_config, &ocean_config}) {
+        config->parse_config();
+        config->read_grid_info();
+    }
+
+    ThreadWorld world(1);
+    ThreadTransport transport(world, 0);
+    Router ice(ice_config, 0, {{0, ice_n, 0, ice_n}}, 0, ice_n, 0, ice_n);
+    Router ocean(ocean_config, 0, {{0, ocean_n, 0, ocean_n}},
+                 0, ocean_n, 0, ocean_n);
+    TileDescriptions descriptions;
+    Router::exchange_descriptions(transport, {&ice, &ocean}, descriptions);
+    ice.build_routing_rules(descriptions);
+    ocean.build_routing_rules(descriptions);
+
+    rows.clear();
+    values.clear();
+    add_mappings(ice, "ocean", true, ice_n * ice_n, rows, values);
+    add_mappings(ocean, "ice", false, ocean_n * ocean_n, rows, values);
+    if (both_ways) {
+        add_mappings(ocean, "ice", true, ocean_n * ocean_n, rows, values);
+        add_mappings(ice, "ocean", false, ice_n * ice_n, rows, values);
+    }
+}
+
+/* The routing is built on several threads, it must come out the same
+ * whatever the number of threads, otherwise ranks using different numbers
+ * would disagree on the layout of messages. */
+TEST(Router, same_routing_on_any_number_of_threads)
+{
+    string config_dir = "./test_input-1_mappings-2_grids-8x8_to_4x4/";
+    vector<point_t> rows, threaded_rows;
+    vector<double> values, threaded_values;
+
+    build_routing(1, config_dir, 8, 4, false, rows, values);
+    build_routing(4, config_dir, 8, 4, false, threaded_rows, threaded_values);
+
+    EXPECT_FALSE(rows.empty());
+    EXPECT_EQ(rows, threaded_rows);
+    EXPECT_EQ(values, threaded_values);
+}
+
+/* The same where each grid has links to find both ways, which is done for
+ * both at once. */
+TEST(Router, same_routing_both_ways_on_any_number_of_threads)
+{
+    string config_dir = "./test_input-2_mappings-2_grids-4x4_to_4x4/";
+    vector<point_t> rows, threaded_rows;
+    vector<double> values, threaded_values;
+
+    build_routing(1, config_dir, 4, 4, true, rows, values);
+    build_routing(4, config_dir, 4, 4, true, threaded_rows, threaded_values);
+
+    EXPECT_FALSE(rows.empty());
+    EXPECT_EQ(rows, threaded_rows);
+    EXPECT_EQ(values, threaded_values);
+}
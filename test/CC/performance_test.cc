@@ -1,5 +1,6 @@
 
 #include <mpi.h>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "tango.h"
@@ -16,27 +17,25 @@ TEST(Performance, large_send_receive)
 
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-    double send_sst[] = {292.1, 295.7, 290.5, 287.9,
-                         291.3, 294.3, 291.8, 290.0,
-                         292.1, 295.2, 290.8, 284.7,
-                         293.3, 290.1, 297.8, 293.4 };
-    assert(sizeof(send_sst) == (l_rows * l_cols * sizeof(double)));
+    vector<double> send_sst(l_rows * l_cols);
+    for (int i = 0; i < l_rows * l_cols; i++) {
+        send_sst[i] = 270.0 + (i % 317) * 0.1;
+    }
 
     if (rank == 0) {
         tango_init(config_dir.c_str(), "ocean", 0, l_rows, 0, l_cols,
                                                 0, g_rows, 0, g_cols);
         tango_begin_transfer(0, "ice");
-        tango_put("sst", send_sst, l_rows * l_cols);
+        tango_put("sst", send_sst.data(), l_rows * l_cols);
         tango_end_transfer();
 
     } else {
-        double recv_sst[l_rows * l_cols] = {};
-        assert(sizeof(recv_sst) == (l_rows * l_cols * sizeof(double)));
+        vector<double> recv_sst(l_rows * l_cols);
 
         tango_init(config_dir.c_str(), "ice", 0, l_rows, 0, l_cols,
                                               0, g_rows, 0, g_cols);
         tango_begin_transfer(0, "ocean");
-        tango_get("sst", recv_sst, l_rows * l_cols);
+        tango_get("sst", recv_sst.data(), l_rows * l_cols);
         tango_end_transfer();
 
         /* Check that send and receive are the same. */
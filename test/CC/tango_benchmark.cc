@@ -0,0 +1,534 @@
+/* A self-contained benchmark of Tango, it doesn't need any input files.
+ *
+ * The remapping weights are made up here, in the ESMF format that Tango
+ * reads, for a square source grid and a square destination grid. Half the
+ * ranks (rounded down) have the source grid, the rest the destination grid.
+ * For each decomposition and number of fields asked for it times the two
+ * phases of initialisation and then a number of transfers, and writes
+ * everything out as JSON. Rank 0 also times the weights kernels on their
+ * own, with and without the kernels specialised by stencil width, see
+ * Mapping::apply(). Run it at several rank counts to see how things scale,
+ * e.g.:
+ *
+ *   mpirun -n 8 ./tango_benchmark.exe --src 400 --dest 200 \
+ *       --stencil conservative --fields 1,10 --decomp strips,blocks \
+ *       --output bench_8.json
+ */
+
+#include <mpi.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <netcdf>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tango.h"
+#include "router.h"
+
+using namespace std;
+using namespace netCDF;
+
+struct Options {
+    unsigned int src_size;
+    unsigned int dest_size;
+    string stencil;
+    vector<unsigned int> num_fields;
+    vector<string> decomps;
+    unsigned int steps;
+    unsigned int warmup;
+    string dir;
+    string output;
+};
+
+/* Timings of Mapping::apply() over the whole grid, on one core. */
+struct KernelResult {
+    unsigned int rows;
+    unsigned int buckets;
+    double bytes_per_link;
+    double generic_gflops;
+    double bucketed_gflops;
+    double max_difference;
+};
+
+struct Result {
+    string decomp;
+    unsigned int num_fields;
+    double add_component_time;
+    double init_components_time;
+    vector<double> step_times;
+    double max_error;
+};
+
+static vector<string> split(const string& s)
+{
+    vector<string> parts;
+    stringstream ss(s);
+    string part;
+
+    while (getline(ss, part, ',')) {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+static void usage(void)
+{
+    cerr << "Usage: tango_benchmark.exe [--src N] [--dest N] "
+         << "[--stencil bilinear|conservative|patch] [--fields N,N,...] "
+         << "[--decomp strips|blocks,...] [--steps N] [--warmup N] "
+         << "[--dir path] [--output file.json]" << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+static void parse_args(int argc, char *argv[], Options& opts)
+{
+    opts.src_size = 200;
+    opts.dest_size = 100;
+    opts.stencil = "conservative";
+    opts.num_fields = {1, 10};
+    opts.decomps = {"strips", "blocks"};
+    opts.steps = 20;
+    opts.warmup = 2;
+    opts.dir = "./tango_benchmark_input";
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        string value = argv[++i];
+
+        if (arg == "--src") {
+            opts.src_size = atoi(value.c_str());
+        } else if (arg == "--dest") {
+            opts.dest_size = atoi(value.c_str());
+        } else if (arg == "--stencil") {
+            opts.stencil = value;
+        } else if (arg == "--fields") {
+            opts.num_fields.clear();
+            for (const auto& f : split(value)) {
+                opts.num_fields.push_back(atoi(f.c_str()));
+            }
+        } else if (arg == "--decomp") {
+            opts.decomps = split(value);
+        } else if (arg == "--steps") {
+            opts.steps = atoi(value.c_str());
+        } else if (arg == "--warmup") {
+            opts.warmup = atoi(value.c_str());
+        } else if (arg == "--dir") {
+            opts.dir = value;
+        } else if (arg == "--output") {
+            opts.output = value;
+        } else {
+            usage();
+        }
+    }
+
+    if (opts.stencil != "bilinear" && opts.stencil != "conservative" &&
+        opts.stencil != "patch") {
+        usage();
+    }
+    for (const auto& d : opts.decomps) {
+        if (d != "strips" && d != "blocks") {
+            usage();
+        }
+    }
+    if (opts.src_size == 0 || opts.dest_size == 0 || opts.steps == 0 ||
+        opts.num_fields.empty()) {
+        usage();
+    }
+}
+
+/* The source cells that overlap destination cell i along one axis, and the
+ * fraction of the destination cell that each covers. The grids cover the
+ * same extent, so a destination cell is src_n / dest_n source cells wide. */
+static void overlaps(unsigned int i, unsigned int src_n, unsigned int dest_n,
+                     vector<unsigned int>& cells, vector<double>& fractions)
+{
+    double lo = (double)i * src_n / dest_n;
+    double hi = (double)(i + 1) * src_n / dest_n;
+
+    cells.clear();
+    fractions.clear();
+    for (unsigned int s = (unsigned int)floor(lo); s < src_n && s < hi; s++) {
+        double overlap = min(hi, (double)s + 1) - max(lo, (double)s);
+        if (overlap > 0) {
+            cells.push_back(s);
+            fractions.push_back(overlap / (hi - lo));
+        }
+    }
+}
+
+/* The two source cells either side of the centre of destination cell i
+ * along one axis, with linear interpolation weights. */
+static void neighbours(unsigned int i, unsigned int src_n, unsigned int dest_n,
+                       vector<unsigned int>& cells, vector<double>& fractions)
+{
+    double x = ((i + 0.5) * src_n / dest_n) - 0.5;
+    x = max(0.0, min(x, (double)src_n - 1));
+    unsigned int s = (unsigned int)floor(x);
+    double f = x - s;
+
+    cells.assign(1, s);
+    fractions.assign(1, 1 - f);
+    if (f > 0 && s + 1 < src_n) {
+        cells.push_back(s + 1);
+        fractions.push_back(f);
+    }
+}
+
+/* The four source cells nearest the centre of destination cell i along one
+ * axis, equally weighted, as a stand-in for the 16 point stencil of patch
+ * remapping. */
+static void patch(unsigned int i, unsigned int src_n, unsigned int dest_n,
+                  vector<unsigned int>& cells, vector<double>& fractions)
+{
+    double x = ((i + 0.5) * src_n / dest_n) - 0.5;
+    int s = (int)floor(x) - 1;
+    s = max(0, min(s, (int)src_n - 4));
+
+    cells.clear();
+    fractions.clear();
+    for (int k = 0; k < 4 && s + k < (int)src_n; k++) {
+        cells.push_back(s + k);
+    }
+    fractions.assign(cells.size(), 1.0 / cells.size());
+}
+
+/* Make the links from the source grid to each destination point. Points are
+ * numbered row by row from 1, as in the weights files. */
+static void make_weights(const Options& opts, vector<int>& cols,
+                         vector<int>& rows, vector<double>& weights)
+{
+    unsigned int src_n = opts.src_size, dest_n = opts.dest_size;
+    vector<unsigned int> ci, cj;
+    vector<double> fi, fj;
+
+    for (unsigned int i = 0; i < dest_n; i++) {
+        for (unsigned int j = 0; j < dest_n; j++) {
+            if (opts.stencil == "bilinear") {
+                neighbours(i, src_n, dest_n, ci, fi);
+                neighbours(j, src_n, dest_n, cj, fj);
+            } else if (opts.stencil == "patch") {
+                patch(i, src_n, dest_n, ci, fi);
+                patch(j, src_n, dest_n, cj, fj);
+            } else {
+                overlaps(i, src_n, dest_n, ci, fi);
+                overlaps(j, src_n, dest_n, cj, fj);
+            }
+
+            for (size_t a = 0; a < ci.size(); a++) {
+                for (size_t b = 0; b < cj.size(); b++) {
+                    cols.push_back((ci[a] * src_n) + cj[b] + 1);
+                    rows.push_back((i * dest_n) + j + 1);
+                    weights.push_back(fi[a] * fj[b]);
+                }
+            }
+        }
+    }
+}
+
+/* Write the config and the weights file, on the first rank only. */
+static unsigned int write_input(const Options& opts, int rank)
+{
+    vector<int> cols, rows;
+    vector<double> weights;
+
+    make_weights(opts, cols, rows, weights);
+    if (rank != 0) {
+        return weights.size();
+    }
+
+    mkdir(opts.dir.c_str(), 0755);
+
+    unsigned int max_fields = *max_element(opts.num_fields.begin(),
+                                           opts.num_fields.end());
+    ofstream config(opts.dir + "/config.yaml");
+    config << "mappings:" << endl
+           << "    - source_grid: src" << endl
+           << "      destination_grid: dest" << endl
+           << "      fields: [";
+    for (unsigned int f = 0; f < max_fields; f++) {
+        config << (f == 0 ? "" : ", ") << "field" << f;
+    }
+    config << "]" << endl;
+
+    NcFile file(opts.dir + "/src_to_dest_rmp.nc", NcFile::replace);
+    file.addDim("n_a", opts.src_size * opts.src_size);
+    file.addDim("n_b", opts.dest_size * opts.dest_size);
+    NcDim n_s = file.addDim("n_s", weights.size());
+    file.addVar("col", ncInt, n_s).putVar(cols.data());
+    file.addVar("row", ncInt, n_s).putVar(rows.data());
+    file.addVar("S", ncDouble, n_s).putVar(weights.data());
+
+    return weights.size();
+}
+
+/* The local domain of rank out of num_ranks, on an n x n grid. Strips split
+ * the rows, blocks split both ways over a near square arrangement of
+ * ranks. */
+static void decompose(const string& decomp, unsigned int n, int rank,
+                      int num_ranks, unsigned int domain[4])
+{
+    unsigned int pi = num_ranks, pj = 1;
+
+    if (decomp == "blocks") {
+        pi = (unsigned int)sqrt((double)num_ranks);
+        while (num_ranks % pi != 0) {
+            pi--;
+        }
+        pj = num_ranks / pi;
+    }
+
+    unsigned int bi = rank / pj, bj = rank % pj;
+    domain[0] = (bi * n) / pi;
+    domain[1] = ((bi + 1) * n) / pi;
+    domain[2] = (bj * n) / pj;
+    domain[3] = ((bj + 1) * n) / pj;
+}
+
+static double max_over_ranks(double value)
+{
+    double result;
+
+    MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    return result;
+}
+
+static Result run(const Options& opts, const string& decomp,
+                  unsigned int num_fields, int rank, int num_ranks)
+{
+    Result result;
+    int num_src_ranks = num_ranks / 2;
+    bool is_src = rank < num_src_ranks;
+    unsigned int n = is_src ? opts.src_size : opts.dest_size;
+    unsigned int domain[4];
+
+    result.decomp = decomp;
+    result.num_fields = num_fields;
+
+    if (is_src) {
+        decompose(decomp, n, rank, num_src_ranks, domain);
+    } else {
+        decompose(decomp, n, rank - num_src_ranks, num_ranks - num_src_ranks,
+                  domain);
+    }
+    unsigned int size = (domain[1] - domain[0]) * (domain[3] - domain[2]);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    tango_add_component(opts.dir.c_str(), is_src ? "src" : "dest", 1, domain,
+                        0, n, 0, n);
+    double added = MPI_Wtime();
+    tango_init_components();
+    double done = MPI_Wtime();
+
+    result.add_component_time = max_over_ranks(added - start);
+    result.init_components_time = max_over_ranks(done - added);
+
+    /* Field f is f + 1 everywhere. Both stencils have weights that add up to
+     * one so this is also what is received. */
+    vector<vector<double> > fields(num_fields, vector<double>(size));
+    for (unsigned int f = 0; f < num_fields; f++) {
+        fill(fields[f].begin(), fields[f].end(), f + 1.0);
+    }
+
+    double error = 0;
+    for (unsigned int step = 0; step < opts.warmup + opts.steps; step++) {
+        string timestamp = to_string(step);
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        double t = MPI_Wtime();
+        tango_begin_transfer(timestamp.c_str(), is_src ? "dest" : "src");
+        for (unsigned int f = 0; f < num_fields; f++) {
+            string name = "field" + to_string(f);
+            if (is_src) {
+                tango_put(name.c_str(), fields[f].data(), size);
+            } else {
+                tango_get(name.c_str(), fields[f].data(), size);
+            }
+        }
+        tango_end_transfer();
+        double elapsed = max_over_ranks(MPI_Wtime() - t);
+
+        if (step >= opts.warmup) {
+            result.step_times.push_back(elapsed);
+        }
+
+        if (!is_src) {
+            for (unsigned int f = 0; f < num_fields; f++) {
+                for (auto v : fields[f]) {
+                    error = max(error, fabs(v - (f + 1.0)));
+                }
+            }
+        }
+    }
+    result.max_error = max_over_ranks(error);
+
+    tango_finalize();
+
+    return result;
+}
+
+/* Put the weights for the whole grid into a single mapping and time
+ * applying them, the same way as packing a message does. */
+static KernelResult time_kernels(const Options& opts)
+{
+    vector<int> cols, rows;
+    vector<double> weights;
+    KernelResult result;
+
+    make_weights(opts, cols, rows, weights);
+
+    unsigned int n = opts.dest_size;
+    vector<Block> blocks = {{0, n, 0, n}};
+    shared_ptr<Tile> dest_tile(new Tile(0, blocks, 0, n, 0, n));
+    Mapping mapping(dest_tile);
+    for (size_t i = 0; i < weights.size(); i++) {
+        mapping.add_link(rows[i] - 1, cols[i] - 1, weights[i]);
+    }
+    mapping.compile();
+
+    /* Enough repeats for about a billion links. */
+    unsigned int repeats = max(1u, (unsigned int)(1e9 / weights.size()));
+    vector<double> in(opts.src_size * opts.src_size);
+    vector<double> generic(mapping.get_num_points());
+    vector<double> bucketed(mapping.get_num_points());
+    for (size_t i = 0; i < in.size(); i++) {
+        in[i] = sin((double)i);
+    }
+
+    double flops = 2.0 * weights.size() * repeats;
+    double start = MPI_Wtime();
+    for (unsigned int r = 0; r < repeats; r++) {
+        mapping.apply(in.data(), generic.data(), true);
+    }
+    result.generic_gflops = flops / (MPI_Wtime() - start) / 1e9;
+
+    start = MPI_Wtime();
+    for (unsigned int r = 0; r < repeats; r++) {
+        mapping.apply(in.data(), bucketed.data());
+    }
+    result.bucketed_gflops = flops / (MPI_Wtime() - start) / 1e9;
+
+    result.max_difference = 0;
+    for (size_t i = 0; i < generic.size(); i++) {
+        result.max_difference = max(result.max_difference,
+                                    fabs(generic[i] - bucketed[i]));
+    }
+
+    /* Bytes moved to apply each link: its index, its weight and the value
+     * it reads, plus a share of the row that it adds to. */
+    result.rows = mapping.get_num_points();
+    result.buckets = 0;
+    vector<unsigned int> widths;
+    for (size_t i = 0; i < weights.size(); i++) {
+        if (i == 0 || rows[i] != rows[i - 1]) {
+            widths.push_back(0);
+        }
+        widths.back()++;
+    }
+    sort(widths.begin(), widths.end());
+    result.buckets = unique(widths.begin(), widths.end()) - widths.begin();
+    result.bytes_per_link = sizeof(point_t) + sizeof(weight_t) +
+                            sizeof(double) +
+                            ((double)sizeof(double) * result.rows /
+                             weights.size());
+
+    return result;
+}
+
+static void write_json(ostream& out, const Options& opts, int num_ranks,
+                       unsigned int num_links, const KernelResult& kernels,
+                       const vector<Result>& results)
+{
+    out.precision(9);
+    out << "{" << endl
+        << "  \"ranks\": " << num_ranks << "," << endl
+        << "  \"src_grid\": [" << opts.src_size << ", " << opts.src_size
+        << "]," << endl
+        << "  \"dest_grid\": [" << opts.dest_size << ", " << opts.dest_size
+        << "]," << endl
+        << "  \"stencil\": \"" << opts.stencil << "\"," << endl
+        << "  \"links\": " << num_links << "," << endl
+        << "  \"steps\": " << opts.steps << "," << endl
+        << "  \"kernels\": {\"rows\": " << kernels.rows
+        << ", \"widths\": " << kernels.buckets
+        << ", \"bytes_per_link\": " << kernels.bytes_per_link << "," << endl
+        << "              \"gflops\": {\"generic\": "
+        << kernels.generic_gflops << ", \"bucketed\": "
+        << kernels.bucketed_gflops << "}, \"max_difference\": "
+        << kernels.max_difference << "}," << endl
+        << "  \"results\": [" << endl;
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        const auto& times = r.step_times;
+        double total = 0;
+        for (auto t : times) {
+            total += t;
+        }
+
+        out << "    {\"decomposition\": \"" << r.decomp << "\", "
+            << "\"fields\": " << r.num_fields << "," << endl
+            << "     \"init\": {\"add_component\": " << r.add_component_time
+            << ", \"init_components\": " << r.init_components_time << "},"
+            << endl
+            << "     \"gflops\": "
+            << 2.0 * num_links * r.num_fields / (total / times.size()) / 1e9
+            << "," << endl
+            << "     \"transfer\": {\"mean\": " << total / times.size()
+            << ", \"min\": " << *min_element(times.begin(), times.end())
+            << ", \"max\": " << *max_element(times.begin(), times.end())
+            << "}," << endl
+            << "     \"max_error\": " << r.max_error << "}"
+            << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl << "}" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int rank, num_ranks;
+    Options opts;
+    vector<Result> results;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    if (num_ranks < 2) {
+        cerr << "Error: the benchmark needs at least 2 ranks." << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    parse_args(argc, argv, opts);
+    unsigned int num_links = write_input(opts, rank);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    for (const auto& decomp : opts.decomps) {
+        for (auto num_fields : opts.num_fields) {
+            results.push_back(run(opts, decomp, num_fields, rank, num_ranks));
+        }
+    }
+
+    if (rank == 0) {
+        KernelResult kernels = time_kernels(opts);
+
+        if (opts.output.empty()) {
+            write_json(cout, opts, num_ranks, num_links, kernels, results);
+        } else {
+            ofstream out(opts.output);
+            write_json(out, opts, num_ranks, num_links, kernels, results);
+        }
+    }
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -1,5 +1,9 @@
 
+#include <cstdio>
 #include <mpi.h>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 #include "tango.h"
@@ -144,12 +148,495 @@ TEST(Tango, send_receive_different_grids)
     tango_finalize();
 }
 
+/* Do a send/receive where half of the source grid is masked out. */
+TEST(Tango, send_receive_masked)
+{
+    int rank;
+    int g_rows = 4, g_cols = 4, l_rows = 4, l_cols = 4;
+    int mask[g_rows * g_cols];
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    /* The first two columns of the ocean are land. */
+    for (int i = 0; i < g_rows * g_cols; i++) {
+        mask[i] = (i % g_cols) < 2 ? 0 : 1;
+    }
+    tango_set_mask("ocean", mask, g_rows * g_cols);
+
+    double send_sst[l_rows * l_cols];
+    for (int i = 0; i < l_rows * l_cols; i++) {
+        send_sst[i] = 290.0 + i;
+    }
+
+    if (rank == 0) {
+        tango_init(config_dir.c_str(), "ocean", 0, l_rows, 0, l_cols,
+                                                0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ice");
+        tango_put("sst", send_sst, l_rows * l_cols);
+        tango_end_transfer();
+
+    } else {
+        double recv_sst[l_rows * l_cols];
+
+        tango_init(config_dir.c_str(), "ice", 0, l_rows, 0, l_cols,
+                                              0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ocean");
+        tango_get("sst", recv_sst, l_rows * l_cols);
+        tango_end_transfer();
+
+        /* Masked points are not sent so they are left as zero. */
+        for (int i = 0; i < l_rows * l_cols; i++) {
+            if (mask[i]) {
+                EXPECT_EQ(send_sst[i], recv_sst[i]);
+            } else {
+                EXPECT_EQ(0, recv_sst[i]);
+            }
+        }
+    }
+
+    tango_finalize();
+}
+
+/* Send/receive several ensemble members of a field in one transfer. */
+TEST(Tango, send_receive_ensemble)
+{
+    int rank;
+    const int num_members = 3;
+    int g_rows = 4, g_cols = 4, l_rows = 4, l_cols = 4;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    double send_sst[num_members * l_rows * l_cols];
+    for (int i = 0; i < num_members * l_rows * l_cols; i++) {
+        send_sst[i] = 280.0 + i;
+    }
+
+    if (rank == 0) {
+        tango_init(config_dir.c_str(), "ocean", 0, l_rows, 0, l_cols,
+                                                0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ice");
+        tango_put_ensemble("sst", send_sst, l_rows * l_cols, num_members);
+        tango_end_transfer();
+
+    } else {
+        double recv_sst[num_members * l_rows * l_cols];
+
+        tango_init(config_dir.c_str(), "ice", 0, l_rows, 0, l_cols,
+                                              0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ocean");
+        tango_get_ensemble("sst", recv_sst, l_rows * l_cols, num_members);
+        tango_end_transfer();
+
+        for (int i = 0; i < num_members * l_rows * l_cols; i++) {
+            EXPECT_EQ(send_sst[i], recv_sst[i]);
+        }
+    }
+
+    tango_finalize();
+}
+
+/* Put from an array with a halo and get into one level of a padded 3-D
+ * array, without copying either. Only the points of the domain are
+ * touched. */
+TEST(Tango, send_receive_strided)
+{
+    int rank;
+    const int l_rows = 4, l_cols = 4, halo = 1, pad = 1, levels = 2;
+    int g_rows = 4, g_cols = 4;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    double send_sst[l_rows + 2 * halo][l_cols + 2 * halo];
+    for (int i = 0; i < l_rows + 2 * halo; i++) {
+        for (int j = 0; j < l_cols + 2 * halo; j++) {
+            send_sst[i][j] = 280.0 + (10 * i) + j;
+        }
+    }
+
+    if (rank == 0) {
+        tango_init(config_dir.c_str(), "ocean", 0, l_rows, 0, l_cols,
+                                                0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ice");
+        tango_put_halo("sst", &send_sst[0][0], halo, halo);
+        tango_end_transfer();
+
+        /* The same field with i varying fastest and a wider halo in j,
+         * everything but the local domain is garbage. */
+        double send_t[l_cols + 4][l_rows + 2];
+        for (int j = 0; j < l_cols + 4; j++) {
+            for (int i = 0; i < l_rows + 2; i++) {
+                send_t[j][i] = -7;
+            }
+        }
+        for (int i = 0; i < l_rows; i++) {
+            for (int j = 0; j < l_cols; j++) {
+                send_t[j + 2][i + 1] = send_sst[i + halo][j + halo];
+            }
+        }
+        tango_begin_transfer("1", "ice");
+        tango_put_halo_column_major("sst", &send_t[0][0], 1, 2);
+        tango_end_transfer();
+
+    } else {
+        double recv_sst[levels][l_rows][l_cols + pad];
+        for (int k = 0; k < levels; k++) {
+            for (int i = 0; i < l_rows; i++) {
+                for (int j = 0; j < l_cols + pad; j++) {
+                    recv_sst[k][i][j] = -1;
+                }
+            }
+        }
+
+        tango_init(config_dir.c_str(), "ice", 0, l_rows, 0, l_cols,
+                                              0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ocean");
+        tango_get_strided("sst", &recv_sst[0][0][0],
+                          l_rows * (l_cols + pad), l_cols + pad, 1);
+        tango_end_transfer();
+
+        for (int i = 0; i < l_rows; i++) {
+            for (int j = 0; j < l_cols + pad; j++) {
+                EXPECT_EQ(-1, recv_sst[0][i][j]);
+                if (j < l_cols) {
+                    EXPECT_EQ(send_sst[i + halo][j + halo], recv_sst[1][i][j]);
+                } else {
+                    EXPECT_EQ(-1, recv_sst[1][i][j]);
+                }
+            }
+        }
+
+        double recv_t[l_cols][l_rows];
+        tango_begin_transfer("1", "ocean");
+        tango_get_halo_column_major("sst", &recv_t[0][0], 0, 0);
+        tango_end_transfer();
+
+        for (int i = 0; i < l_rows; i++) {
+            for (int j = 0; j < l_cols; j++) {
+                EXPECT_EQ(send_sst[i + halo][j + halo], recv_t[j][i]);
+            }
+        }
+    }
+
+    tango_finalize();
+}
+
+/* Two components in one process. Rank 0 has all of the ocean and half of the
+ * ice, rank 1 has the other half of the ice. */
+TEST(Tango, send_receive_colocated)
+{
+    int rank;
+    int g_rows = 4, g_cols = 4;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    double send_sst[] = {292.1, 295.7, 290.5, 287.9,
+                         291.3, 294.3, 291.8, 290.0,
+                         292.1, 295.2, 290.8, 284.7,
+                         293.3, 290.1, 297.8, 293.4 };
+
+    unsigned int ocean_block[] = {0, 4, 0, 4};
+    unsigned int ice_block[] = {2 * (unsigned int)rank, 2 * (unsigned int)rank + 2, 0, 4};
+
+    if (rank == 0) {
+        tango_add_component(config_dir.c_str(), "ocean", 1, ocean_block,
+                            0, g_rows, 0, g_cols);
+    }
+    tango_add_component(config_dir.c_str(), "ice", 1, ice_block,
+                        0, g_rows, 0, g_cols);
+    tango_init_components();
+
+    if (rank == 0) {
+        tango_set_component("ocean");
+        tango_begin_transfer(0, "ice");
+        tango_put("sst", send_sst, g_rows * g_cols);
+        tango_end_transfer();
+    }
+
+    double recv_sst[8];
+    tango_set_component("ice");
+    tango_begin_transfer(0, "ocean");
+    tango_get("sst", recv_sst, 8);
+    tango_end_transfer();
+
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(send_sst[8 * rank + i], recv_sst[i]);
+    }
+
+    tango_finalize();
+}
+
+/* Both ranks have part of the ocean and part of the ice, and each runs the
+ * two components on their own threads at the same time. Each thread chooses
+ * its component and transfers with the other rank, through the same
+ * bundles. The ice on a rank is fed by the ocean on the other. */
+TEST(Tango, concurrent_components)
+{
+    int rank;
+    const int g_rows = 4, g_cols = 4, steps = 20;
+    const int half = (g_rows / 2) * g_cols;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    unsigned int r = rank, other = 1 - rank;
+    unsigned int ocean_block[] = {2 * r, 2 * r + 2, 0, 4};
+    unsigned int ice_block[] = {2 * other, 2 * other + 2, 0, 4};
+
+    tango_add_component(config_dir.c_str(), "ocean", 1, ocean_block,
+                        0, g_rows, 0, g_cols);
+    tango_add_component(config_dir.c_str(), "ice", 1, ice_block,
+                        0, g_rows, 0, g_cols);
+    tango_init_components();
+
+    thread ocean([&]() {
+        tango_set_component("ocean");
+        for (int t = 0; t < steps; t++) {
+            string time = to_string(t);
+            double sst[half], temp[half];
+            for (int i = 0; i < half; i++) {
+                sst[i] = (1000 * t) + (half * r) + i;
+            }
+
+            tango_begin_transfer(time.c_str(), "ice");
+            tango_put("sst", sst, half);
+            tango_end_transfer();
+
+            tango_begin_transfer(time.c_str(), "ice");
+            tango_get("temp", temp, half);
+            tango_end_transfer();
+            for (int i = 0; i < half; i++) {
+                EXPECT_EQ(-sst[i], temp[i]);
+            }
+        }
+    });
+
+    thread ice([&]() {
+        tango_set_component("ice");
+        for (int t = 0; t < steps; t++) {
+            string time = to_string(t);
+            double sst[half], temp[half];
+
+            tango_begin_transfer(time.c_str(), "ocean");
+            tango_get("sst", sst, half);
+            tango_end_transfer();
+            for (int i = 0; i < half; i++) {
+                EXPECT_EQ((1000 * t) + (half * other) + i, sst[i]);
+                temp[i] = -sst[i];
+            }
+
+            tango_begin_transfer(time.c_str(), "ocean");
+            tango_put("temp", temp, half);
+            tango_end_transfer();
+        }
+    });
+
+    ocean.join();
+    ice.join();
+
+    tango_finalize();
+}
+
+/* Make a config for atm coupled to ocean and ice, all 4x4, from the weights
+ * of the 4x4 ocean/ice config. Each rank makes its own copy. */
+static string make_atm_config(void)
+{
+    string input_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+    char config_dir[] = "/tmp/tango_ctest_XXXXXX";
+    EXPECT_NE(nullptr, mkdtemp(config_dir));
+    string dir(config_dir);
+
+    char cwd[4096];
+    EXPECT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+    string src = string(cwd) + "/" + input_dir;
+    const char *links[][2] = {{"ocean_to_ice", "atm_to_ocean"},
+                              {"ocean_to_ice", "atm_to_ice"},
+                              {"ice_to_ocean", "ocean_to_atm"},
+                              {"ice_to_ocean", "ice_to_atm"}};
+    for (auto link : links) {
+        string from = src + link[0] + "_rmp.nc";
+        string to = dir + "/" + link[1] + "_rmp.nc";
+        EXPECT_EQ(0, symlink(from.c_str(), to.c_str()));
+    }
+
+    FILE *f = fopen((dir + "/config.yaml").c_str(), "w");
+    fprintf(f, "mappings:\n"
+               "    - source_grid: atm\n"
+               "      destination_grid: ocean\n"
+               "      fields: [sst]\n"
+               "    - source_grid: atm\n"
+               "      destination_grid: ice\n"
+               "      fields: [sst]\n"
+               "    - source_grid: ocean\n"
+               "      destination_grid: atm\n"
+               "      fields: [temp]\n"
+               "    - source_grid: ice\n"
+               "      destination_grid: atm\n"
+               "      fields: [temp]\n");
+    fclose(f);
+
+    return dir + "/";
+}
+
+static void remove_atm_config(const string& dir)
+{
+    for (auto f : {"atm_to_ocean_rmp.nc", "atm_to_ice_rmp.nc",
+                   "ocean_to_atm_rmp.nc", "ice_to_atm_rmp.nc",
+                   "config.yaml"}) {
+        unlink((dir + f).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+/* The atm on rank 0 puts to and gets from the ocean and the ice in one
+ * transfer. The ocean and ice are both on rank 1, so the messages for the
+ * two grids go to the same rank and must be told apart. */
+TEST(Tango, multi_transfer)
+{
+    int rank;
+    const int g_rows = 4, g_cols = 4, size = g_rows * g_cols, steps = 3;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    string config_dir = make_atm_config();
+
+    unsigned int block[] = {0, 4, 0, 4};
+    if (rank == 0) {
+        tango_init(config_dir.c_str(), "atm", 0, g_rows, 0, g_cols,
+                   0, g_rows, 0, g_cols);
+    } else {
+        tango_add_component(config_dir.c_str(), "ocean", 1, block,
+                            0, g_rows, 0, g_cols);
+        tango_add_component(config_dir.c_str(), "ice", 1, block,
+                            0, g_rows, 0, g_cols);
+        tango_init_components();
+    }
+
+    for (int t = 0; t < steps; t++) {
+        string time = to_string(t);
+        double to_ocean[size], to_ice[size];
+        for (int i = 0; i < size; i++) {
+            to_ocean[i] = (100 * t) + i;
+            to_ice[i] = -(100 * t) - i;
+        }
+
+        if (rank == 0) {
+            double from_ocean[size], from_ice[size];
+
+            tango_begin_multi_transfer(time.c_str());
+            tango_put_to("ocean", "sst", to_ocean, size);
+            tango_put_to("ice", "sst", to_ice, size);
+            tango_get_from("ice", "temp", from_ice, size);
+            tango_get_from("ocean", "temp", from_ocean, size);
+            tango_end_transfer();
+
+            for (int i = 0; i < size; i++) {
+                EXPECT_EQ(2 * to_ocean[i], from_ocean[i]);
+                EXPECT_EQ(3 * to_ice[i], from_ice[i]);
+            }
+        } else {
+            double ocean_sst[size], ice_sst[size];
+
+            tango_set_component("ice");
+            tango_begin_transfer(time.c_str(), "atm");
+            tango_get("sst", ice_sst, size);
+            tango_end_transfer();
+
+            tango_set_component("ocean");
+            tango_begin_transfer(time.c_str(), "atm");
+            tango_get("sst", ocean_sst, size);
+            tango_end_transfer();
+
+            for (int i = 0; i < size; i++) {
+                EXPECT_EQ(to_ocean[i], ocean_sst[i]);
+                EXPECT_EQ(to_ice[i], ice_sst[i]);
+                ocean_sst[i] *= 2;
+                ice_sst[i] *= 3;
+            }
+
+            tango_begin_transfer(time.c_str(), "atm");
+            tango_put("temp", ocean_sst, size);
+            tango_end_transfer();
+
+            tango_set_component("ice");
+            tango_begin_transfer(time.c_str(), "atm");
+            tango_put("temp", ice_sst, size);
+            tango_end_transfer();
+        }
+    }
+
+    tango_finalize();
+    remove_atm_config(config_dir);
+}
+
+/* Tango counts the memory it uses, it should all be given back at the
+ * end. */
+TEST(Tango, memory_usage)
+{
+    int rank;
+    long long current, peak;
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    double sst[16] = {};
+    if (rank == 0) {
+        tango_init(config_dir.c_str(), "ocean", 0, 4, 0, 4, 0, 4, 0, 4);
+    } else {
+        tango_init(config_dir.c_str(), "ice", 0, 4, 0, 4, 0, 4, 0, 4);
+    }
+
+    tango_memory_usage("tiles", &current, &peak);
+    EXPECT_GT(current, 0);
+    tango_memory_usage("mappings", &current, &peak);
+    EXPECT_GT(current, 0);
+
+    /* The weights are only kept while the routing is built. */
+    tango_memory_usage("weights", &current, &peak);
+    EXPECT_EQ(current, 0);
+    EXPECT_GE(peak, 16 * (long long)(2 * sizeof(int) + sizeof(double)));
+
+    if (rank == 0) {
+        tango_begin_transfer(0, "ice");
+        tango_put("sst", sst, 16);
+        tango_end_transfer();
+        tango_memory_usage("send_buffers", &current, &peak);
+        EXPECT_GE(peak, 16 * (long long)sizeof(double));
+    } else {
+        tango_begin_transfer(0, "ocean");
+        tango_get("sst", sst, 16);
+        tango_end_transfer();
+        tango_memory_usage("recv_buffers", &current, &peak);
+        EXPECT_EQ(current, 0);
+        EXPECT_GE(peak, 16 * (long long)sizeof(double));
+    }
+
+    tango_finalize();
+
+    long long total_peak;
+    tango_memory_usage("total", &current, &total_peak);
+    EXPECT_EQ(current, 0);
+    for (auto c : {"tiles", "mappings", "weights", "send_buffers",
+                   "recv_buffers"}) {
+        tango_memory_usage(c, &current, &peak);
+        EXPECT_EQ(current, 0) << c;
+        EXPECT_LE(peak, total_peak) << c;
+    }
+}
+
 int main(int argc, char* argv[])
 {
-    int result = 0;
+    int result = 0, provided;
 
     ::testing::InitGoogleTest(&argc, argv);
-    MPI_Init(&argc, &argv);
+    /* For transfers from several threads at once. */
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
     result = RUN_ALL_TESTS();
     MPI_Finalize();
 
@@ -0,0 +1,152 @@
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tango.h"
+
+using namespace std;
+
+/* These tests use threads as ranks so they don't need MPI, run them without
+ * mpirun. */
+
+/* Do single field send/receive between two threads. */
+TEST(Threads, send_receive)
+{
+    int g_rows = 4, g_cols = 4, l_rows = 4, l_cols = 4;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    double send_sst[] = {292.1, 295.7, 290.5, 287.9,
+                         291.3, 294.3, 291.8, 290.0,
+                         292.1, 295.2, 290.8, 284.7,
+                         293.3, 290.1, 297.8, 293.4 };
+    double recv_sst[l_rows * l_cols] = {};
+
+    thread ocean([&]() {
+        tango_thread_rank_init(0, 2);
+        tango_init(config_dir.c_str(), "ocean", 0, l_rows, 0, l_cols,
+                                                0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ice");
+        tango_put("sst", send_sst, l_rows * l_cols);
+        tango_end_transfer();
+        tango_finalize();
+    });
+
+    thread ice([&]() {
+        tango_thread_rank_init(1, 2);
+        tango_init(config_dir.c_str(), "ice", 0, l_rows, 0, l_cols,
+                                              0, g_rows, 0, g_cols);
+        tango_begin_transfer(0, "ocean");
+        tango_get("sst", recv_sst, l_rows * l_cols);
+        tango_end_transfer();
+        tango_finalize();
+    });
+
+    ocean.join();
+    ice.join();
+
+    for (int i = 0; i < l_rows * l_cols; i++) {
+        EXPECT_EQ(send_sst[i], recv_sst[i]);
+    }
+}
+
+/* Send from two ocean threads to one ice thread, several times. */
+TEST(Threads, multiple_tiles)
+{
+    int g_rows = 4, g_cols = 4;
+    const int num_steps = 10;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    double send_sst[g_rows * g_cols];
+    double recv_sst[g_rows * g_cols];
+    for (int i = 0; i < g_rows * g_cols; i++) {
+        send_sst[i] = i;
+    }
+
+    auto ocean_func = [&](int rank) {
+        double tmp[g_rows * 2];
+
+        tango_thread_rank_init(rank, 3);
+        tango_init(config_dir.c_str(), "ocean", 0, g_rows, 2 * rank,
+                   2 * rank + 2, 0, g_rows, 0, g_cols);
+        for (int t = 0; t < num_steps; t++) {
+            for (int i = 0; i < g_rows; i++) {
+                for (int j = 0; j < 2; j++) {
+                    tmp[i * 2 + j] = send_sst[i * g_cols + 2 * rank + j] + t;
+                }
+            }
+            tango_begin_transfer(0, "ice");
+            tango_put("sst", tmp, g_rows * 2);
+            tango_end_transfer();
+        }
+        tango_finalize();
+    };
+
+    thread ocean_0(ocean_func, 0);
+    thread ocean_1(ocean_func, 1);
+
+    tango_thread_rank_init(2, 3);
+    tango_init(config_dir.c_str(), "ice", 0, g_rows, 0, g_cols,
+                                          0, g_rows, 0, g_cols);
+    for (int t = 0; t < num_steps; t++) {
+        tango_begin_transfer(0, "ocean");
+        tango_get("sst", recv_sst, g_rows * g_cols);
+        tango_end_transfer();
+
+        for (int i = 0; i < g_rows * g_cols; i++) {
+            EXPECT_EQ(send_sst[i] + t, recv_sst[i]);
+        }
+    }
+    tango_finalize();
+
+    ocean_0.join();
+    ocean_1.join();
+}
+
+/* The sender drives its outstanding sends with tango_progress() while the
+ * receiver catches up. */
+TEST(Threads, progress)
+{
+    int g_rows = 4, g_cols = 4, size = g_rows * g_cols;
+    const int num_steps = 10;
+
+    string config_dir = "./test_input-1_mappings-2_grids-4x4_to_4x4/";
+
+    vector<vector<double> > send_sst(num_steps, vector<double>(size));
+    double recv_sst[size];
+
+    thread ocean([&]() {
+        tango_thread_rank_init(0, 2);
+        tango_init(config_dir.c_str(), "ocean", 0, g_rows, 0, g_cols,
+                                                0, g_rows, 0, g_cols);
+        for (int t = 0; t < num_steps; t++) {
+            for (int i = 0; i < size; i++) {
+                send_sst[t][i] = i + t;
+            }
+            tango_begin_transfer(0, "ice");
+            tango_put("sst", send_sst[t].data(), size);
+            tango_end_transfer();
+            tango_progress();
+        }
+        tango_finalize();
+    });
+
+    tango_thread_rank_init(1, 2);
+    tango_init(config_dir.c_str(), "ice", 0, g_rows, 0, g_cols,
+                                          0, g_rows, 0, g_cols);
+    for (int t = 0; t < num_steps; t++) {
+        tango_begin_transfer(0, "ocean");
+        tango_get("sst", recv_sst, size);
+        tango_end_transfer();
+        tango_progress();
+
+        for (int i = 0; i < size; i++) {
+            EXPECT_EQ(i + t, recv_sst[i]);
+        }
+    }
+    tango_finalize();
+
+    ocean.join();
+}
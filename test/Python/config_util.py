@@ -0,0 +1,25 @@
+
+import os
+import shutil
+import tempfile
+
+def make_config(test_case, config_yaml,
+                input_name='test_input-1_mappings-2_grids-4x4_to_4x4'):
+    """
+    Make a config directory with the inputs of input_name, found next to
+    this file, and the given config.yaml. Each rank makes its own copy,
+    which is removed once test_case is done.
+    """
+
+    test_dir = os.path.dirname(os.path.realpath(__file__))
+    input_dir = os.path.join(test_dir, input_name)
+    config = tempfile.mkdtemp()
+    test_case.addCleanup(shutil.rmtree, config)
+
+    for f in os.listdir(input_dir):
+        if f != 'config.yaml':
+            os.symlink(os.path.join(input_dir, f), os.path.join(config, f))
+    with open(os.path.join(config, 'config.yaml'), 'w') as f:
+        f.write(config_yaml)
+
+    return config
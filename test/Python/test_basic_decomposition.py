@@ -2,11 +2,13 @@
 from __future__ import print_function
 
 import sys
+import json
 import unittest
 import os
 import tango as coupler
 import ctypes as ct
 import numpy as np
+from config_util import make_config
 
 # FIXME: remove these. Just use auto-generated.
 send_sst = np.array([292.1, 295.7, 290.5, 287.9,
@@ -193,6 +195,276 @@ class TestBasicDecomposition(unittest.TestCase):
 
         tango.finalize()
 
+    def test_accumulate(self):
+        """
+        Accumulate over several steps and receive the average once per
+        coupling interval.
+        """
+
+        interval = 3
+        num_steps = 6
+
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      coupling_interval: {}\n'
+                             '      fields: [sst]\n'.format(interval))
+
+        if self.rank == 0:
+            tango = coupler.Tango(config, 'ocean', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(num_steps):
+                tango.begin_transfer(str(t), 'ice')
+                tango.accumulate('sst', send_sst + t)
+                tango.end_transfer()
+        else:
+            recv_sst = np.zeros(len(send_sst))
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            for p in range(num_steps // interval):
+                tango.begin_transfer(str(p), 'ocean')
+                tango.get('sst', recv_sst)
+                tango.end_transfer()
+
+                expected = send_sst + p * interval + (interval - 1) / 2.0
+                assert(np.allclose(expected, recv_sst))
+
+        tango.finalize()
+
+    def test_lagged_send_receive(self):
+        """
+        With a lag both sides can put before they get. Each get returns what
+        was put at the previous step.
+        """
+
+        num_steps = 4
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      lag: 1\n'
+                             '      fields: [sst]\n'
+                             '    - source_grid: ice\n'
+                             '      destination_grid: ocean\n'
+                             '      lag: 1\n'
+                             '      fields: [temp]\n')
+
+        if self.rank == 0:
+            grid, peer = 'ocean', 'ice'
+            send_name, send = 'sst', send_sst
+            recv_name, expected = 'temp', send_temp
+        else:
+            grid, peer = 'ice', 'ocean'
+            send_name, send = 'temp', send_temp
+            recv_name, expected = 'sst', send_sst
+
+        tango = coupler.Tango(config, grid, 0, 4, 0, 4, 0, 4, 0, 4)
+        recv = np.zeros(len(expected))
+        for t in range(num_steps):
+            tango.begin_transfer(str(t), peer)
+            tango.put(send_name, send + t)
+            tango.end_transfer()
+
+            tango.begin_transfer(str(t), peer)
+            tango.get(recv_name, recv)
+            tango.end_transfer()
+
+            if t == 0:
+                assert(np.array_equal(recv, np.zeros(len(expected))))
+            else:
+                assert(np.array_equal(recv, expected + t - 1))
+
+        tango.finalize()
+
+    def test_traffic_report(self):
+        """
+        Ask for a report of the coupling traffic in config.yaml.
+        """
+
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n')
+        report = os.path.join(config, 'traffic.yaml')
+        with open(os.path.join(config, 'config.yaml'), 'a') as f:
+            f.write('traffic_report: {}\n'.format(report))
+
+        grid = 'ocean' if self.rank == 0 else 'ice'
+        tango = coupler.Tango(config, grid, 0, 4, 0, 4, 0, 4, 0, 4)
+        tango.finalize()
+
+        if self.rank == 0:
+            with open(report) as f:
+                text = f.read()
+            # A single message of all 16 points from rank 0 to rank 1.
+            assert('- [0, 1, 16, 128]' in text)
+            assert('warnings: []' in text)
+
+    def test_rank_placement(self):
+        """
+        Ask for a suggested placement of ranks on nodes. With one rank per
+        node the coupling traffic has to cross between nodes.
+        """
+
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n')
+        rankfile = os.path.join(config, 'rankfile')
+        with open(os.path.join(config, 'config.yaml'), 'a') as f:
+            f.write('rank_placement: {}\n'.format(rankfile))
+            f.write('ranks_per_node: 1\n')
+
+        grid = 'ocean' if self.rank == 0 else 'ice'
+        tango = coupler.Tango(config, grid, 0, 4, 0, 4, 0, 4, 0, 4)
+        tango.finalize()
+
+        if self.rank == 0:
+            with open(rankfile) as f:
+                lines = f.read().splitlines()
+            assert('#   this placement: 128' in lines)
+            assert('rank 0=+n0 slot=0' in lines)
+            assert('rank 1=+n1 slot=0' in lines)
+
+    def test_node_aggregation(self):
+        """
+        Send through the node leaders. With one rank per node every message
+        goes between nodes.
+        """
+
+        config = make_config(self, 'node_aggregation: true\n'
+                             'ranks_per_node: 1\n'
+                             'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n')
+        recv = np.zeros(len(send_sst))
+
+        if self.rank == 0:
+            tango = coupler.Tango(config, 'ocean', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(3):
+                tango.begin_transfer(str(t), 'ice')
+                tango.put('sst', send_sst + t)
+                tango.end_transfer()
+        else:
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(3):
+                tango.begin_transfer(str(t), 'ocean')
+                tango.get('sst', recv)
+                tango.end_transfer()
+                assert(np.array_equal(recv, send_sst + t))
+
+        tango.finalize()
+
+    def test_redecompose(self):
+        """
+        Change the local domain of the ocean between transfers. It starts as
+        two blocks in the opposite order and ends as one.
+        """
+
+        config = make_config(self, 'cache_weights: true\n'
+                             'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n')
+        recv = np.zeros(len(send_sst))
+        swapped = np.concatenate((send_sst[8:], send_sst[:8]))
+
+        if self.rank == 0:
+            tango = coupler.Tango(config, 'ocean', 0, 0, 0, 0, 0, 4, 0, 4,
+                                  blocks=[(2, 4, 0, 4), (0, 2, 0, 4)])
+            tango.begin_transfer('0', 'ice')
+            tango.put('sst', swapped)
+            tango.end_transfer()
+
+            tango.redecompose(0, 4, 0, 4)
+            tango.begin_transfer('1', 'ice')
+            tango.put('sst', send_sst)
+            tango.end_transfer()
+        else:
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(2):
+                if t == 1:
+                    tango.redecompose(0, 4, 0, 4)
+                tango.begin_transfer(str(t), 'ocean')
+                tango.get('sst', recv)
+                tango.end_transfer()
+                assert(np.array_equal(recv, send_sst))
+
+        tango.finalize()
+
+    def test_trace(self):
+        """
+        Only the ice traces, the ocean still has to take part in comparing
+        clocks. The trace has the phases of each transfer. The timestamp
+        needs escaping to be valid JSON.
+        """
+
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n')
+        trace = os.path.join(config, 'trace')
+        if self.rank == 1:
+            with open(os.path.join(config, 'config.yaml'), 'a') as f:
+                f.write('trace: {}\n'.format(trace))
+        recv = np.zeros(len(send_sst))
+        timestamp = '0\t"1"\\'
+
+        if self.rank == 0:
+            tango = coupler.Tango(config, 'ocean', 0, 4, 0, 4, 0, 4, 0, 4)
+            tango.begin_transfer(timestamp, 'ice')
+            tango.put('sst', send_sst)
+            tango.end_transfer()
+        else:
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            tango.begin_transfer(timestamp, 'ocean')
+            tango.get('sst', recv)
+            tango.end_transfer()
+        tango.finalize()
+
+        trace_file = trace + '.{}.json'.format(self.rank)
+        assert(os.path.exists(trace_file) == (self.rank == 1))
+        if self.rank == 1:
+            with open(trace_file) as f:
+                events = json.load(f)['traceEvents']
+            names = [e['name'] for e in events]
+            for phase in ['build_routing_rules', 'begin_transfer', 'get',
+                          'wait', 'unpack', 'end_transfer']:
+                assert(phase in names)
+            details = [e['args']['detail'] for e in events if 'args' in e and
+                       'detail' in e['args']]
+            assert('ocean ' + timestamp in details)
+
+    def test_multi_transfer(self):
+        """
+        Put and get in a single transfer with begin_multi_transfer(). The
+        puts are sent before the gets are done.
+        """
+
+        config = os.path.join(self.test_dir,
+                              'test_input-2_mappings-2_grids-4x4_to_4x4')
+        recv = np.zeros(len(send_sst))
+
+        if self.rank == 0:
+            tango = coupler.Tango(config, 'ocean', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(3):
+                tango.begin_multi_transfer(str(t))
+                tango.put_to('ice', 'sst', send_sst + t)
+                tango.get_from('ice', 'temp', recv)
+                tango.end_transfer()
+                assert(np.array_equal(recv, send_temp + t))
+        else:
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(3):
+                tango.begin_transfer(str(t), 'ocean')
+                tango.get('sst', recv)
+                tango.end_transfer()
+                assert(np.array_equal(recv, send_sst + t))
+
+                tango.begin_transfer(str(t), 'ocean')
+                tango.put('temp', send_temp + t)
+                tango.end_transfer()
+
+        tango.finalize()
+
 
 if __name__ == '__main__':
     # This interpreter doesn't like exit() being called, because it doesn't
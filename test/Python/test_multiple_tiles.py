@@ -7,6 +7,7 @@ import os
 import tango as coupler
 import ctypes as ct
 import numpy as np
+from config_util import make_config
 
 class TestMultipleTiles(unittest.TestCase):
     """
@@ -61,6 +62,95 @@ class TestMultipleTiles(unittest.TestCase):
 
         tango.finalize()
 
+    def test_multiple_blocks_per_tile(self):
+        """
+        Send from two procs which each have two non-contiguous blocks of the
+        source grid, i.e. a block-cyclic decomposition by column.
+
+        These tests should be called with:
+            mpirun -n 3 ./bin/python-mpi test/test_multiple_tiles.py
+        """
+
+        send_sst = np.arange(16.0)
+        config = os.path.join(self.test_dir, 'test_input-1_mappings-2_grids-4x4_to_4x4')
+
+        if self.rank < 2:
+            cols = [self.rank, self.rank + 2]
+            blocks = [(0, 4, c, c + 1) for c in cols]
+            tango = coupler.Tango(config, 'ocean', None, None, None, None,
+                                  0, 4, 0, 4, blocks=blocks)
+            tango.begin_transfer('0', 'ice')
+            # Blocks go one after the other.
+            tmp = np.concatenate([send_sst.reshape(4, 4)[:,c] for c in cols])
+            tango.put('sst', tmp)
+            tango.end_transfer()
+
+        else:
+            recv_sst = np.ones(len(send_sst), dtype='double')
+
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            tango.begin_transfer('0', 'ocean')
+            tango.get('sst', recv_sst)
+            tango.end_transfer()
+
+            assert(np.array_equal(send_sst, recv_sst))
+
+        tango.finalize()
+
+    def test_node_aggregation(self):
+        """
+        Both ocean procs are on the first emulated node and the ice is on
+        the second, so the ocean leader gathers and sends for both of them
+        and hands out what comes back.
+
+        These tests should be called with:
+            mpirun -n 3 ./bin/python-mpi test/test_multiple_tiles.py
+        """
+
+        send_sst = np.arange(16.0)
+        send_temp = 100.0 - np.arange(16.0)
+        config = make_config(self, 'node_aggregation: true\n'
+                             'ranks_per_node: 2\n'
+                             'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [sst]\n'
+                             '    - source_grid: ice\n'
+                             '      destination_grid: ocean\n'
+                             '      fields: [temp]\n')
+
+        if self.rank < 2:
+            cols = slice(2 * self.rank, 2 * self.rank + 2)
+            tango = coupler.Tango(config, 'ocean', 0, 4, cols.start,
+                                  cols.stop, 0, 4, 0, 4)
+            sst = np.array(send_sst.reshape(4, 4)[:,cols].flatten())
+            temp = np.array(send_temp.reshape(4, 4)[:,cols].flatten())
+            recv_temp = np.zeros(len(temp))
+            for t in range(3):
+                tango.begin_transfer(str(t), 'ice')
+                tango.put('sst', sst + t)
+                tango.end_transfer()
+
+                tango.begin_transfer(str(t), 'ice')
+                tango.get('temp', recv_temp)
+                tango.end_transfer()
+                assert(np.array_equal(temp + t, recv_temp))
+
+        else:
+            recv_sst = np.zeros(len(send_sst))
+            tango = coupler.Tango(config, 'ice', 0, 4, 0, 4, 0, 4, 0, 4)
+            for t in range(3):
+                tango.begin_transfer(str(t), 'ocean')
+                tango.get('sst', recv_sst)
+                tango.end_transfer()
+                assert(np.array_equal(send_sst + t, recv_sst))
+
+                tango.begin_transfer(str(t), 'ocean')
+                tango.put('temp', send_temp + t)
+                tango.end_transfer()
+
+        tango.finalize()
+
 
 if __name__ == '__main__':
     try:
@@ -4,9 +4,11 @@ from __future__ import print_function
 import sys
 import unittest
 import os
+import time
 import tango as coupler
 import ctypes as ct
 import numpy as np
+from config_util import make_config
 
 class TestPerformance(unittest.TestCase):
 
@@ -45,6 +47,57 @@ class TestPerformance(unittest.TestCase):
 
         tango.finalize()
 
+    def test_call_overhead(self):
+        """
+        Time the calls of transfers of many small fields, through ctypes
+        and through the native module, one put or get at a time and as a
+        dict. The fields are tiny so this is mostly the cost of the calls.
+        """
+
+        steps = 200
+        fields = {'f{}'.format(i): np.ones(16) for i in range(20)}
+
+        config = make_config(self, 'mappings:\n'
+                             '    - source_grid: ocean\n'
+                             '      destination_grid: ice\n'
+                             '      fields: [{}]\n'.format(', '.join(fields)))
+
+        if self.rank == 0:
+            grid, peer = 'ocean', 'ice'
+        else:
+            grid, peer = 'ice', 'ocean'
+
+        for native in [False, True]:
+            tango = coupler.Tango(config, grid, 0, 4, 0, 4, 0, 4, 0, 4,
+                                  native=native)
+            if native and tango.native is None:
+                print('The native module has not been built')
+                tango.finalize()
+                break
+
+            for batched in [False, True]:
+                start = time.time()
+                for t in range(steps):
+                    tango.begin_transfer(str(t), peer)
+                    if batched and self.rank == 0:
+                        tango.put_fields(fields)
+                    elif batched:
+                        tango.get_fields(fields)
+                    else:
+                        for name, array in fields.items():
+                            if self.rank == 0:
+                                tango.put(name, array)
+                            else:
+                                tango.get(name, array)
+                    tango.end_transfer()
+                elapsed = time.time() - start
+
+                print('Rank {} {} {}: {:.2f} us per field'.format(
+                      self.rank, 'native' if native else 'ctypes',
+                      'dict' if batched else 'one by one',
+                      1e6 * elapsed / (steps * len(fields))))
+            tango.finalize()
+
 if __name__ == '__main__':
     try:
         unittest.main()
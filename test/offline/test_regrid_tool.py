@@ -131,6 +131,90 @@ class TestRegrid(unittest.TestCase):
         tango.finalize()
 
 
+    def regrid_2d_temp(self, config):
+        """
+        Regrid temp from ice to atm, return the result on the atm rank.
+        """
+
+        if self.rank == 0:
+            with nc.Dataset(os.path.join(config, 'temp.nc')) as f:
+                temp = np.array(f.variables['temp'][0,:,:], dtype='float64')
+
+            tango = coupler.Tango(config, 'ice', 0, 1080, 0, 1440, 0, 1080, 0, 1440)
+            tango.begin_transfer('0', 'atm')
+            tango.put('temp', temp)
+            tango.end_transfer()
+            recv_temp = None
+        else:
+            recv_temp = np.zeros((300, 360), dtype='float64')
+            tango = coupler.Tango(config, 'atm', 0, 300, 0, 360, 0, 300, 0, 360)
+            tango.begin_transfer('0', 'ice')
+            tango.get('temp', recv_temp)
+            tango.end_transfer()
+
+        tango.finalize()
+        return recv_temp
+
+    def test_lossy_compression(self):
+        """
+        Regrid with a tolerance on the field and check the error against the
+        exact result.
+        """
+
+        config = os.path.join(self.test_dir, 'test_input-regrid_tool-2d')
+        exact = self.regrid_2d_temp(config)
+
+        for tolerance in [1e-2, 1e-4]:
+            # Same inputs, different config.yaml
+            lossy_config = tempfile.mkdtemp()
+            for f in os.listdir(config):
+                if f != 'config.yaml':
+                    os.symlink(os.path.join(config, f),
+                               os.path.join(lossy_config, f))
+            with open(os.path.join(lossy_config, 'config.yaml'), 'w') as f:
+                f.write('mappings:\n'
+                        '    - source_grid: ice\n'
+                        '      destination_grid: atm\n'
+                        '      fields: [{{name: temp, tolerance: {}}}]\n'.format(tolerance))
+
+            lossy = self.regrid_2d_temp(lossy_config)
+            shutil.rmtree(lossy_config)
+
+            if self.rank == 1:
+                error = np.max(abs(lossy - exact))
+                print('temp: tolerance {}, max error {}'.format(tolerance, error))
+                assert(error <= tolerance)
+
+    def test_regrid_cli(self):
+        """
+        The tango_regrid program should give the same result as coupling.
+        """
+
+        config = os.path.join(self.test_dir, 'test_input-regrid_tool-2d')
+        exact = self.regrid_2d_temp(config)
+
+        if self.rank == 1:
+            tango_regrid = os.path.join(self.test_dir, '../../build/tango_regrid')
+            output_dir = tempfile.mkdtemp()
+            self.addCleanup(shutil.rmtree, output_dir)
+            output = os.path.join(output_dir, 'temp.nc')
+
+            sp.check_call([tango_regrid, config, 'ice', 'atm', 'temp',
+                           os.path.join(config, 'temp.nc'), output])
+            with nc.Dataset(output) as f:
+                var = f.variables['temp']
+                regridded = np.array(var[0, :], dtype='float64').flatten()
+                fill_value = getattr(var, '_FillValue', None)
+
+            # The coupler doesn't know about missing points, so only compare
+            # the others.
+            exact = exact.flatten()
+            if fill_value is not None:
+                exact = exact[regridded != fill_value]
+                regridded = regridded[regridded != fill_value]
+            assert(len(regridded) > 0)
+            assert(np.allclose(regridded, exact, rtol=1e-12, atol=0))
+
     def test_3d_interp(self):
         """
         This is not really 3d interpolation, but 2d on many levels.
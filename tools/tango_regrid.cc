@@ -0,0 +1,384 @@
+/* Regrid a netCDF variable offline, without MPI ranks or a driver script.
+ *
+ * The remapping weights are read once with the same Config code that the
+ * coupler uses, including any masks in config.yaml. Every record of the
+ * variable is then put through a sparse matrix-vector product on several
+ * threads. While one record is being regridded the previous result is
+ * written and the next record is read, so for long forcing files the
+ * time is about that of the slower of the I/O and the arithmetic, e.g.:
+ *
+ *   tango_regrid --threads 16 config_dir jra55 mom sst jra55_sst.nc \
+ *       mom_sst.nc
+ *
+ * The trailing dimensions of the variable that make up the source grid are
+ * regridded, any leading dimensions such as time and depth are records.
+ * The destination grid is written with the shape of dst_grid_dims in the
+ * weights file if there is one, otherwise as a single dimension, these are
+ * named after the destination grid, e.g. mom_0, mom_1 and so on. Points of
+ * the destination grid that get no weights are zero.
+ *
+ * If the variable has a _FillValue, or else a missing_value, source points
+ * with that value are missing. A destination point that gets a weight from
+ * a missing point is missing too, and the output variable has the same
+ * _FillValue.
+ *
+ * Errors in the config or the weights exit without MPI, see config.cc.
+ * The input is checked before the output is created, so a wrong name or
+ * path doesn't clobber an existing output.
+ */
+
+#include <omp.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <netcdf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+using namespace std;
+using namespace netCDF;
+
+struct Options {
+    int num_threads;
+    string config_dir;
+    string src_grid;
+    string dest_grid;
+    string variable;
+    string input;
+    string output;
+};
+
+/* The weights as a compressed sparse row matrix, one row for each
+ * destination point. */
+struct Weights {
+    unsigned int src_size;
+    unsigned int dest_size;
+    vector<unsigned int> row_starts;
+    vector<unsigned int> cols;
+    vector<double> values;
+    /* Shape of the destination grid, slowest varying first. */
+    vector<size_t> dest_shape;
+};
+
+static void usage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [--threads N] config_dir src_grid "
+         << "dest_grid variable input.nc output.nc" << endl;
+    exit(1);
+}
+
+static void parse_args(int argc, char *argv[], Options& opts)
+{
+    vector<string> args;
+
+    opts.num_threads = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            opts.num_threads = atoi(argv[++i]);
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage(argv[0]);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (args.size() != 6) {
+        usage(argv[0]);
+    }
+
+    opts.config_dir = args[0];
+    opts.src_grid = args[1];
+    opts.dest_grid = args[2];
+    opts.variable = args[3];
+    opts.input = args[4];
+    opts.output = args[5];
+}
+
+static bool file_exists(const string& file)
+{
+    return access(file.c_str(), F_OK) == 0;
+}
+
+/* The grid sizes and destination shape from the weights file, which
+ * Config::read_weights() has already found. */
+static void read_grid_sizes(const Options& opts, Weights& w)
+{
+    string remap_file = opts.config_dir + "/" + opts.src_grid + "_to_" +
+                        opts.dest_grid + "_rmp.nc";
+    NcFile f(remap_file, NcFile::read);
+
+    w.src_size = f.getDim("n_a").getSize();
+    w.dest_size = f.getDim("n_b").getSize();
+
+    /* In Fortran order, i.e. the fastest varying first. */
+    NcVar dims_var = f.getVar("dst_grid_dims");
+    if (!dims_var.isNull()) {
+        vector<int> dims(dims_var.getDim(0).getSize());
+        dims_var.getVar(dims.data());
+        w.dest_shape.assign(dims.rbegin(), dims.rend());
+    } else {
+        w.dest_shape.push_back(w.dest_size);
+    }
+}
+
+static void read_weights(const Options& opts, Weights& w)
+{
+    Config config(opts.config_dir, opts.dest_grid);
+    counted_vector<unsigned int, MEMORY_WEIGHTS> src_points, dest_points;
+    counted_vector<double, MEMORY_WEIGHTS> weights;
+
+    config.parse_config();
+
+    /* Sorted by destination point, so these are already in rows. */
+    config.read_weights(opts.src_grid, opts.dest_grid, src_points,
+                        dest_points, weights, false);
+    read_grid_sizes(opts, w);
+
+    const vector<bool>& src_mask = config.get_mask(opts.src_grid);
+    const vector<bool>& dest_mask = config.get_mask(opts.dest_grid);
+
+    w.row_starts.assign(w.dest_size + 1, 0);
+    for (size_t i = 0; i < weights.size(); i++) {
+        unsigned int src = src_points[i], dest = dest_points[i];
+
+        if (src < 1 || src > w.src_size || dest < 1 || dest > w.dest_size) {
+            cerr << "Error: point out of range in weights from "
+                 << opts.src_grid << " to " << opts.dest_grid << endl;
+            exit(1);
+        }
+        if ((!src_mask.empty() && !src_mask[src - 1]) ||
+            (!dest_mask.empty() && !dest_mask[dest - 1])) {
+            continue;
+        }
+
+        w.cols.push_back(src - 1);
+        w.values.push_back(weights[i]);
+        w.row_starts[dest]++;
+    }
+    for (unsigned int r = 0; r < w.dest_size; r++) {
+        w.row_starts[r + 1] += w.row_starts[r];
+    }
+}
+
+/* Records of the input are read, and results written, one at a time. */
+class RecordIO {
+private:
+    NcFile in_file;
+    NcFile out_file;
+    NcVar in_var;
+    NcVar out_var;
+    /* The leading dimensions of the variable, one record for each
+     * combination. */
+    vector<size_t> record_shape;
+    unsigned int num_dest_dims;
+    vector<size_t> start(size_t record, unsigned int num_grid_dims) const;
+public:
+    size_t num_records;
+    /* The value of missing points, if the variable has one. */
+    bool has_fill;
+    double fill_value;
+    RecordIO(const Options& opts, const Weights& w);
+    void read(size_t record, vector<double>& buf);
+    void write(size_t record, const vector<double>& buf);
+};
+
+RecordIO::RecordIO(const Options& opts, const Weights& w)
+    : num_dest_dims(w.dest_shape.size()), has_fill(false), fill_value(0)
+{
+    if (!file_exists(opts.input)) {
+        cerr << "Error: " << opts.input << " does not exist." << endl;
+        exit(1);
+    }
+    in_file.open(opts.input, NcFile::read);
+
+    in_var = in_file.getVar(opts.variable);
+    if (in_var.isNull()) {
+        cerr << "Error: no variable " << opts.variable << " in "
+             << opts.input << endl;
+        exit(1);
+    }
+
+    auto atts = in_var.getAtts();
+    for (auto name : {"_FillValue", "missing_value"}) {
+        if (atts.count(name) != 0) {
+            atts.find(name)->second.getValues(&fill_value);
+            has_fill = true;
+            break;
+        }
+    }
+
+    /* Find how many of the trailing dimensions make up the source grid. */
+    vector<NcDim> dims = in_var.getDims();
+    size_t grid_size = 1;
+    int first_grid_dim = dims.size();
+    while (first_grid_dim > 0 && grid_size < w.src_size) {
+        grid_size *= dims[--first_grid_dim].getSize();
+    }
+    if (grid_size != w.src_size) {
+        cerr << "Error: the trailing dimensions of " << opts.variable
+             << " don't match the size of grid " << opts.src_grid
+             << ", which is " << w.src_size << endl;
+        exit(1);
+    }
+
+    /* Only now that the input is known to be good. */
+    out_file.open(opts.output, NcFile::replace);
+
+    vector<NcDim> out_dims;
+    num_records = 1;
+    for (int i = 0; i < first_grid_dim; i++) {
+        record_shape.push_back(dims[i].getSize());
+        num_records *= dims[i].getSize();
+        out_dims.push_back(out_file.addDim(dims[i].getName(),
+                                           dims[i].getSize()));
+    }
+    for (size_t i = 0; i < w.dest_shape.size(); i++) {
+        string name = opts.dest_grid + "_" + to_string(i);
+        out_dims.push_back(out_file.addDim(name, w.dest_shape[i]));
+    }
+    out_var = out_file.addVar(opts.variable, ncDouble, out_dims);
+    if (has_fill) {
+        out_var.setFill(true, fill_value);
+    }
+}
+
+vector<size_t> RecordIO::start(size_t record, unsigned int num_grid_dims) const
+{
+    vector<size_t> s(record_shape.size() + num_grid_dims, 0);
+
+    for (int i = record_shape.size() - 1; i >= 0; i--) {
+        s[i] = record % record_shape[i];
+        record /= record_shape[i];
+    }
+    return s;
+}
+
+void RecordIO::read(size_t record, vector<double>& buf)
+{
+    vector<NcDim> dims = in_var.getDims();
+    vector<size_t> count(dims.size(), 1);
+
+    for (size_t i = record_shape.size(); i < dims.size(); i++) {
+        count[i] = dims[i].getSize();
+    }
+    in_var.getVar(start(record, dims.size() - record_shape.size()), count,
+                  buf.data());
+}
+
+void RecordIO::write(size_t record, const vector<double>& buf)
+{
+    vector<NcDim> dims = out_var.getDims();
+    vector<size_t> count(dims.size(), 1);
+
+    for (size_t i = record_shape.size(); i < dims.size(); i++) {
+        count[i] = dims[i].getSize();
+    }
+    out_var.putVar(start(record, num_dest_dims), count, buf.data());
+}
+
+/* dest = W src. Rows are split evenly between the threads so each always
+ * writes the same part of dest. If fill isn't null a row with any source
+ * point equal to *fill is *fill. */
+static void regrid(const Weights& w, const vector<double>& src,
+                   vector<double>& dest, const double *fill)
+{
+    const unsigned int *row_starts = w.row_starts.data();
+    const unsigned int *cols = w.cols.data();
+    const double *values = w.values.data();
+    const double *x = src.data();
+    double *y = dest.data();
+
+    #pragma omp parallel for schedule(static)
+    for (unsigned int r = 0; r < w.dest_size; r++) {
+        double sum = 0;
+        for (unsigned int k = row_starts[r]; k < row_starts[r + 1]; k++) {
+            if (fill != nullptr && x[cols[k]] == *fill) {
+                sum = *fill;
+                break;
+            }
+            sum += values[k] * x[cols[k]];
+        }
+        y[r] = sum;
+    }
+}
+
+static void run(const Options& opts)
+{
+    Weights w;
+
+    auto start_time = chrono::steady_clock::now();
+    read_weights(opts, w);
+    RecordIO io(opts, w);
+
+    /* Two buffers each way, one being regridded while the other is read or
+     * written. netCDF is not thread safe so only one thread at a time uses
+     * it, the main thread before the loop and the I/O thread within it. */
+    vector<double> src[2], dest[2];
+    for (int i = 0; i < 2; i++) {
+        src[i].resize(w.src_size);
+        dest[i].resize(w.dest_size);
+    }
+
+    if (io.num_records > 0) {
+        io.read(0, src[0]);
+    }
+    for (size_t r = 0; r < io.num_records; r++) {
+        int curr = r % 2, other = 1 - curr;
+
+        /* An exception can't leave the thread, so it is passed on. */
+        exception_ptr io_error;
+        thread io_thread([&]() {
+            try {
+                if (r > 0) {
+                    io.write(r - 1, dest[other]);
+                }
+                if (r + 1 < io.num_records) {
+                    io.read(r + 1, src[other]);
+                }
+            } catch (...) {
+                io_error = current_exception();
+            }
+        });
+        regrid(w, src[curr], dest[curr],
+               io.has_fill ? &io.fill_value : nullptr);
+        io_thread.join();
+        if (io_error) {
+            rethrow_exception(io_error);
+        }
+    }
+    if (io.num_records > 0) {
+        io.write(io.num_records - 1, dest[(io.num_records - 1) % 2]);
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() -
+                                       start_time;
+    cout << "Regridded " << io.num_records << " records of "
+         << opts.variable << " from " << opts.src_grid << " to "
+         << opts.dest_grid << " in " << elapsed.count() << " s" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+
+    parse_args(argc, argv, opts);
+    if (opts.num_threads > 0) {
+        omp_set_num_threads(opts.num_threads);
+    }
+
+    /* e.g. a variable or weights file that netCDF can't read. */
+    try {
+        run(opts);
+    } catch (exceptions::NcException& e) {
+        cerr << "Error: " << e.what() << endl;
+        exit(1);
+    }
+
+    return 0;
+}